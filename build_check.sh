@@ -1 +1 @@
-gcc check_gpu_fan_speed.c -o check_gpu_fan_speed -lnvidia-ml -I/usr/local/cuda/include
+gcc check_gpu_fan_speed.c -o check_gpu_fan_speed -lnvidia-ml -lrt -I/usr/local/cuda/include
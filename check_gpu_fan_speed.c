@@ -1,5 +1,10 @@
 #include <nvml.h>
 #include <stdio.h>
+#include <time.h>
+#include "gpu_snapshot.h"
+
+// Snapshots older than this are from a collector that stopped, ask NVML instead
+#define SNAPSHOT_MAX_AGE_SECONDS 60
 
 void printAdditionalInfo(nvmlDevice_t device) {
     nvmlReturn_t result;
@@ -74,7 +79,42 @@ void checkFanSpeed(unsigned int device_count) {
     }
 }
 
+// Report fan speeds from nvml_direct_access's shared memory snapshot, false if it cannot answer
+bool checkFanSpeedFromSnapshot(void) {
+    GpuSnapshotMapping mapping;
+    static GpuSnapshot snapshot;
+    bool usable = gpuSnapshotMap(&mapping, GPU_SNAPSHOT_SHM_NAME) && gpuSnapshotRead(&mapping, &snapshot) && snapshot.generation > 0;
+    gpuSnapshotUnmap(&mapping);
+    if (!usable || !(snapshot.enabled_metrics & (1u << GPU_METRIC_FAN_SPEED))) {
+        return false;
+    }
+    if (time(NULL) - snapshot.timestamp_sec > SNAPSHOT_MAX_AGE_SECONDS) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < snapshot.device_count; i++) {
+        const GpuSnapshotDevice *device = &snapshot.devices[i];
+        unsigned int domain = 0, bus = 0;
+        sscanf(device->pci_bus_id, "%x:%x", &domain, &bus);
+
+        // The collector reports a failed fan speed read as error state 2
+        if ((snapshot.enabled_metrics & (1u << GPU_METRIC_AER_ERROR_STATE)) && device->error_state == 2) {
+            fprintf(stderr, "Failed to get fan speed for device %u. This could indicate a problem.\n", i);
+            printf("\tGPU Utilization: %u%%, Memory Utilization: %u%%\n", device->gpu_util, device->mem_util);
+            printf("\tTemperature: %u C\n", device->gpu_temp);
+            printf("\tPower Usage: %.2f W\n", device->power_usage / 1000.0);
+            continue;
+        }
+        printf("Device %u: Fan Speed: %u%% pciInfo.domain:%u pciDeviceId:%u \n", i, device->fan_speed, domain, bus);
+    }
+    return true;
+}
+
 int main() {
+    if (checkFanSpeedFromSnapshot()) {
+        return 0;
+    }
+
     nvmlReturn_t result = nvmlInit();
     if (NVML_SUCCESS != result) {
         fprintf(stderr, "Failed to initialize NVML: %s\n", nvmlErrorString(result));
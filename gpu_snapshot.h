@@ -0,0 +1,340 @@
+#ifndef GPU_SNAPSHOT_H
+#define GPU_SNAPSHOT_H
+
+// Binary snapshot that nvml_direct_access publishes in POSIX shared memory.
+// Readers such as metrics_exporter and check_gpu_fan_speed map it read-only
+// instead of parsing metrics.txt or calling NVML themselves.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GPU_SNAPSHOT_SHM_NAME "/gddr6_temps"
+#define GPU_SNAPSHOT_MAGIC 0x47363454 // "T46G"
+// Bump whenever the layout below changes
+#define GPU_SNAPSHOT_VERSION 6
+#define GPU_SNAPSHOT_MAX_DEVICES 32
+
+// Every exported metric, in exposition order, which is also the bit order of
+// GpuSnapshot.enabled_metrics. Consumers expand the columns they need:
+//   X(id, name, help, type, member, format, sampler, tier)
+// member is the DeviceData/GpuSnapshotDevice field (GpuSnapshot field for HOST),
+// format how it is printed (GPU_METRIC_FORMAT_*), sampler the collector function
+// that fills it and tier where it is sampled (GPU_METRIC_TIER_*).
+#define GPU_METRIC_LIST(X) \
+    X(VRAM_TEMP, "DCGM_FI_DEV_VRAM_TEMP", "VRAM temperature (in C).", "gauge", \
+      vram_temp, INTEGER, sampleRegisterTemps, REGISTER) \
+    X(HOT_SPOT_TEMP, "DCGM_FI_DEV_HOT_SPOT_TEMP", "Hot Spot temperature (in C).", "gauge", \
+      hotspot_temp, INTEGER, sampleRegisterTemps, REGISTER) \
+    X(CLOCKS_THROTTLE_REASON, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON", "Individual throttle reason for GPU clocks.", "gauge", \
+      clock_throttle_reasons, REASONS, sampleThrottleReasons, DEVICE) \
+    X(AER_TOTAL_ERRORS, "GPU_AER_TOTAL_ERRORS", "Total AER errors for GPU.", "counter", \
+      aer_total_errors, INTEGER, sampleAerCounters, DEVICE) \
+    X(AER_DEV_ERRORS, "GPU_AER_DEV_ERRORS_TOTAL", "AER errors counted by the kernel for the GPU and its upstream port (aer_dev_* in sysfs).", "counter", \
+      aer_dev, AER_COUNTERS, sampleAerCounters, DEVICE) \
+    X(KERNEL_EVENTS, "GPU_KERNEL_EVENTS_TOTAL", "Kernel log events for the GPU read from /dev/kmsg, by kind.", "counter", \
+      kernel_events, KERNEL_EVENTS, sampleKernelEvents, DEVICE) \
+    X(KERNEL_EVENT_TIME, "GPU_KERNEL_EVENT_LAST_TIMESTAMP_SECONDS", "Time of the latest kernel log event of each kind for the GPU (in seconds since the epoch, 0 if none).", "gauge", \
+      kernel_events, KERNEL_EVENT_TIMES, sampleKernelEvents, DEVICE) \
+    X(XID_ERRORS, "GPU_XID_ERRORS_TOTAL", "NVIDIA Xid errors reported for the GPU, by Xid code.", "counter", \
+      kernel_events, XID_COUNTERS, sampleKernelEvents, DEVICE) \
+    X(KERNEL_AER_ERRORS, "GPU_KERNEL_AER_ERRORS_TOTAL", "AER errors the kernel log reports for the GPU, by error type.", "counter", \
+      kernel_events, AER_TYPE_COUNTERS, sampleKernelEvents, DEVICE) \
+    X(AER_ERROR_STATE, "GPU_AER_ERROR_STATE", "Current error state for GPU (1 for error, 0 for no error).", "gauge", \
+      error_state, INTEGER, sampleErrorState, DEVICE) \
+    X(SM_CLOCK, "DCGM_FI_DEV_SM_CLOCK", "SM clock frequency (in MHz).", "gauge", \
+      sm_clock, INTEGER, sampleSmClock, DEVICE) \
+    X(MEM_CLOCK, "DCGM_FI_DEV_MEM_CLOCK", "Memory clock frequency (in MHz).", "gauge", \
+      mem_clock, INTEGER, sampleMemClock, DEVICE) \
+    X(GPU_TEMP, "DCGM_FI_DEV_GPU_TEMP", "GPU temperature (in C).", "gauge", \
+      gpu_temp, INTEGER, sampleGpuTemp, DEVICE) \
+    X(POWER_USAGE, "DCGM_FI_DEV_POWER_USAGE", "Power draw (in W).", "gauge", \
+      power_usage, MILLI, sampleFieldMetrics, DEVICE) \
+    X(FAN_SPEED, "DCGM_FI_DEV_FAN_SPEED", "Fan speed for the device.", "gauge", \
+      fan_speed, INTEGER, sampleFanSpeed, DEVICE) \
+    X(GPU_UTIL, "DCGM_FI_DEV_GPU_UTIL", "GPU utilization (in %).", "gauge", \
+      gpu_util, INTEGER, sampleUtilization, DEVICE) \
+    X(MEM_COPY_UTIL, "DCGM_FI_DEV_MEM_COPY_UTIL", "Memory utilization (in %).", "gauge", \
+      mem_util, INTEGER, sampleUtilization, DEVICE) \
+    X(FB_FREE, "DCGM_FI_DEV_FB_FREE", "Frame buffer memory free (in MB).", "gauge", \
+      fb_free, INTEGER, sampleMemoryInfo, DEVICE) \
+    X(FB_USED, "DCGM_FI_DEV_FB_USED", "Frame buffer memory used (in MB).", "gauge", \
+      fb_used, INTEGER, sampleMemoryInfo, DEVICE) \
+    X(NVLINK_BANDWIDTH_TOTAL, "DCGM_FI_DEV_NVLINK_BANDWIDTH_TOTAL", "Total data transferred over all NVLinks (in KiB).", "counter", \
+      nvlink_bandwidth_total, INTEGER, sampleFieldMetrics, DEVICE) \
+    X(APT_UPGRADABLE_PACKAGES, "APT_UPGRADABLE_PACKAGES", "Number of APT packages that can be upgraded.", "gauge", \
+      apt_upgradable_packages, INTEGER, sampleUpgradablePackages, HOST)
+
+enum {
+#define GPU_METRIC_ENUM(id, ...) GPU_METRIC_##id,
+    GPU_METRIC_LIST(GPU_METRIC_ENUM)
+#undef GPU_METRIC_ENUM
+    GPU_METRIC_COUNT
+};
+
+enum {
+    GPU_METRIC_FORMAT_INTEGER, // Raw integer
+    GPU_METRIC_FORMAT_MILLI,   // Stored in thousandths, printed divided by 1000 with 6 decimals
+    GPU_METRIC_FORMAT_REASONS, // Bit mask, one 0/1 sample per throttle reason
+    GPU_METRIC_FORMAT_AER_COUNTERS, // GpuAerCounters, one sample per port and severity
+    GPU_METRIC_FORMAT_KERNEL_EVENTS, // GpuKernelEvents, one count per event kind
+    GPU_METRIC_FORMAT_KERNEL_EVENT_TIMES, // GpuKernelEvents, one timestamp per event kind
+    GPU_METRIC_FORMAT_XID_COUNTERS, // GpuKernelEvents, one count per Xid code seen
+    GPU_METRIC_FORMAT_AER_TYPE_COUNTERS, // GpuKernelEvents, one count per AER error type seen
+};
+
+enum {
+    GPU_METRIC_TIER_REGISTER, // Read from BAR0, also by the high-rate register sampler
+    GPU_METRIC_TIER_DEVICE,   // Sampled per device on the worker pool
+    GPU_METRIC_TIER_HOST,     // Sampled once per cycle, unlabelled and always exported
+};
+
+// Severity totals of the kernel's aer_dev_correctable/nonfatal/fatal files
+enum {
+    GPU_AER_CORRECTABLE,
+    GPU_AER_NONFATAL,
+    GPU_AER_FATAL,
+    GPU_AER_SEVERITY_COUNT
+};
+
+enum {
+    GPU_AER_PORT_DEVICE,   // The GPU itself
+    GPU_AER_PORT_UPSTREAM, // The bridge or root port above it
+    GPU_AER_PORT_COUNT
+};
+
+static const char* const gpuAerSeverityNames[GPU_AER_SEVERITY_COUNT] = {"correctable", "nonfatal", "fatal"};
+static const char* const gpuAerPortNames[GPU_AER_PORT_COUNT] = {"gpu", "upstream"};
+
+typedef struct {
+    uint64_t errors[GPU_AER_PORT_COUNT][GPU_AER_SEVERITY_COUNT];
+    uint32_t ports; // Bit per GPU_AER_PORT_* whose counters could be read
+    uint32_t reserved;
+} GpuAerCounters;
+
+// Kernel log events the /dev/kmsg reader attributes to a GPU
+enum {
+    GPU_KERNEL_EVENT_AER,            // PCIe AER report naming the GPU's bus id
+    GPU_KERNEL_EVENT_XID,            // NVRM: Xid (PCI:...) error
+    GPU_KERNEL_EVENT_FALLEN_OFF_BUS, // "GPU has fallen off the bus"
+    GPU_KERNEL_EVENT_COUNT
+};
+
+static const char* const gpuKernelEventNames[GPU_KERNEL_EVENT_COUNT] = {"aer", "xid", "fallen_off_bus"};
+
+// Error types of the kernel's AER reports ("[ 6] BadTLP"), named like current kernels do:
+//   X(id, name, severity)
+#define GPU_AER_TYPE_LIST(X) \
+    X(RX_ERR, "RxErr", "correctable") \
+    X(BAD_TLP, "BadTLP", "correctable") \
+    X(BAD_DLLP, "BadDLLP", "correctable") \
+    X(ROLLOVER, "Rollover", "correctable") \
+    X(TIMEOUT, "Timeout", "correctable") \
+    X(NON_FATAL_ERR, "NonFatalErr", "correctable") \
+    X(CORR_INT_ERR, "CorrIntErr", "correctable") \
+    X(HEADER_OF, "HeaderOF", "correctable") \
+    X(DLP, "DLP", "uncorrectable") \
+    X(SDES, "SDES", "uncorrectable") \
+    X(TLP, "TLP", "uncorrectable") \
+    X(FCP, "FCP", "uncorrectable") \
+    X(CMPLT_TO, "CmpltTO", "uncorrectable") \
+    X(CMPLT_ABRT, "CmpltAbrt", "uncorrectable") \
+    X(UNX_CMPLT, "UnxCmplt", "uncorrectable") \
+    X(RX_OF, "RxOF", "uncorrectable") \
+    X(MALF_TLP, "MalfTLP", "uncorrectable") \
+    X(ECRC, "ECRC", "uncorrectable") \
+    X(UNSUP_REQ, "UnsupReq", "uncorrectable") \
+    X(ACS_VIOL, "ACSViol", "uncorrectable")
+
+enum {
+#define GPU_AER_TYPE_ENUM(id, ...) GPU_AER_TYPE_##id,
+    GPU_AER_TYPE_LIST(GPU_AER_TYPE_ENUM)
+#undef GPU_AER_TYPE_ENUM
+    GPU_AER_TYPE_COUNT
+};
+
+static const char* const gpuAerTypeNames[GPU_AER_TYPE_COUNT] = {
+#define GPU_AER_TYPE_NAME(id, name, severity) name,
+    GPU_AER_TYPE_LIST(GPU_AER_TYPE_NAME)
+#undef GPU_AER_TYPE_NAME
+};
+
+static const char* const gpuAerTypeSeverities[GPU_AER_TYPE_COUNT] = {
+#define GPU_AER_TYPE_SEVERITY(id, name, severity) severity,
+    GPU_AER_TYPE_LIST(GPU_AER_TYPE_SEVERITY)
+#undef GPU_AER_TYPE_SEVERITY
+};
+
+// Xid codes with their own counter, higher codes only count towards GPU_KERNEL_EVENT_XID
+#define GPU_XID_CODE_COUNT 192
+
+typedef struct {
+    uint64_t counts[GPU_KERNEL_EVENT_COUNT];
+    double last_seconds[GPU_KERNEL_EVENT_COUNT]; // Wall clock time of the latest event, 0 before the first
+    uint32_t xid_counts[GPU_XID_CODE_COUNT];
+    uint32_t aer_type_counts[GPU_AER_TYPE_COUNT];
+} GpuKernelEvents;
+
+// Summary of the high-rate register samples of one update window, count is 0 when there is none
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t p95;
+    uint32_t p99;
+    uint32_t reserved;
+    double avg;
+} GpuSnapshotTempWindow;
+
+typedef struct {
+    char uuid[96];
+    char name[96];
+    char pci_bus_id[32];
+    uint32_t vram_temp;
+    uint32_t hotspot_temp;
+    uint32_t clock_throttle_reasons;
+    uint32_t sm_clock;
+    uint32_t mem_clock;
+    uint32_t gpu_temp;
+    uint32_t power_usage; // mW
+    uint32_t fan_speed;
+    uint32_t gpu_util;
+    uint32_t mem_util;
+    uint32_t aer_total_errors;
+    uint32_t error_state;
+    uint32_t unsupported_metrics; // Bit per GPU_METRIC_* the device has no sample for, e.g. NVLink
+    uint32_t stale; // 1 if the device did not finish sampling in time and its values are from an earlier cycle
+    uint64_t fb_free;
+    uint64_t fb_used;
+    uint64_t nvlink_bandwidth_total;
+    GpuAerCounters aer_dev;
+    GpuKernelEvents kernel_events;
+    GpuSnapshotTempWindow vram_window;
+    GpuSnapshotTempWindow hotspot_window;
+} GpuSnapshotDevice;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;     // sizeof(GpuSnapshot) of the writer
+    uint32_t sequence; // Seqlock, odd while the collector is writing
+    uint64_t generation;
+    int64_t timestamp_sec; // Wall clock time of the sample
+    int64_t timestamp_nsec;
+    uint32_t enabled_metrics; // Bit per GPU_METRIC_* the collector exports
+    uint32_t device_count;
+    uint32_t apt_upgradable_packages;
+    uint32_t register_sampler_hz;
+    uint64_t handle_cache_rebuilds;
+    uint64_t missed_deadlines;
+    double sample_duration;
+    double cycle_duration;
+    double cycle_lag;
+    char hostname[256];
+    char driver_version[96];
+    GpuSnapshotDevice devices[GPU_SNAPSHOT_MAX_DEVICES];
+} GpuSnapshot;
+
+// Read-only mapping of the collector's snapshot. The descriptor stays open so every
+// access first checks that the object still has this layout: a collector of another
+// version re-sizes it on startup, and touching the mapping past its end raises SIGBUS.
+typedef struct {
+    char name[256];
+    int fd; // -1 while not mapped
+    const GpuSnapshot* shared;
+} GpuSnapshotMapping;
+
+static inline void gpuSnapshotUnmap(GpuSnapshotMapping* mapping) {
+    if (mapping->shared != NULL) {
+        munmap((void*)mapping->shared, sizeof(GpuSnapshot));
+        mapping->shared = NULL;
+    }
+    if (mapping->fd >= 0) {
+        close(mapping->fd);
+        mapping->fd = -1;
+    }
+}
+
+// Whether the mapped object is still the named one, large enough and written with this layout
+static inline bool gpuSnapshotValid(const GpuSnapshotMapping* mapping) {
+    struct stat st;
+    if (mapping->shared == NULL || fstat(mapping->fd, &st) != 0 || st.st_nlink == 0 || st.st_size < (off_t)sizeof(GpuSnapshot)) {
+        return false;
+    }
+    const GpuSnapshot* shared = mapping->shared;
+    return shared->magic == GPU_SNAPSHOT_MAGIC && shared->version == GPU_SNAPSHOT_VERSION && shared->size == sizeof(GpuSnapshot);
+}
+
+// Drop the current mapping and map the object again by name
+static inline bool gpuSnapshotRemap(GpuSnapshotMapping* mapping) {
+    gpuSnapshotUnmap(mapping);
+    int fd = shm_open(mapping->name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(GpuSnapshot)) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(NULL, sizeof(GpuSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    mapping->fd = fd;
+    mapping->shared = (const GpuSnapshot*)mapped;
+    if (!gpuSnapshotValid(mapping)) {
+        gpuSnapshotUnmap(mapping);
+        return false;
+    }
+    return true;
+}
+
+// Map the collector's snapshot, false if it is missing or has another layout. The
+// mapping must be released with gpuSnapshotUnmap even then.
+static inline bool gpuSnapshotMap(GpuSnapshotMapping* mapping, const char* name) {
+    snprintf(mapping->name, sizeof(mapping->name), "%s", name);
+    mapping->fd = -1;
+    mapping->shared = NULL;
+    return gpuSnapshotRemap(mapping);
+}
+
+// Generation of the last complete write, cheap enough to poll before copying.
+// 0 while there is no snapshot of this layout to read.
+static inline uint64_t gpuSnapshotGeneration(GpuSnapshotMapping* mapping) {
+    if (!gpuSnapshotValid(mapping) && !gpuSnapshotRemap(mapping)) {
+        return 0;
+    }
+    return __atomic_load_n(&mapping->shared->generation, __ATOMIC_ACQUIRE);
+}
+
+// Copy a consistent snapshot, false if there is none of this layout or the collector
+// kept writing for the whole retry budget
+static inline bool gpuSnapshotRead(GpuSnapshotMapping* mapping, GpuSnapshot* out) {
+    if (!gpuSnapshotValid(mapping) && !gpuSnapshotRemap(mapping)) {
+        return false;
+    }
+    const GpuSnapshot* shared = mapping->shared;
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint32_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out, shared, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == before) {
+            // The header is part of the copy, a restart mid-read shows up here
+            return out->magic == GPU_SNAPSHOT_MAGIC && out->version == GPU_SNAPSHOT_VERSION &&
+                   out->size == sizeof(GpuSnapshot) && out->device_count <= GPU_SNAPSHOT_MAX_DEVICES;
+        }
+    }
+    return false;
+}
+
+#endif
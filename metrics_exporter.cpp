@@ -1,8 +1,27 @@
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <exception>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
 #include "httplib.h" // Update the include path if necessary
+#include "gpu_snapshot.h"
 
 using namespace httplib;
 
@@ -17,24 +36,643 @@ public:
     }
 };
 
-std::string readMetricsFromFile(const std::string &filename) {
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw FileException("Error opening file: " + filename);
+enum class Encoding { Identity, Gzip, Zstd };
+
+// Compressed form of a cached body. The per-scrape counter lines are compressed
+// separately and appended, see encodeTail().
+struct EncodedBody {
+    std::string bytes; // gzip header plus a sync-flushed deflate stream, or a zstd frame
+    uLong crc = 0;     // CRC-32 of the uncompressed body, needed for the gzip trailer
+    size_t length = 0; // Uncompressed size of the body
+};
+
+// Raw deflate of data, ending with a sync flush (more blocks may follow) or the final block
+void deflateRaw(std::string &out, const char *data, size_t length, int level, int flush) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    size_t start = out.size();
+    out.resize(start + deflateBound(&stream, length) + 16);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = length;
+    stream.next_out = reinterpret_cast<Bytef*>(&out[start]);
+    stream.avail_out = out.size() - start;
+    int result = deflate(&stream, flush);
+    out.resize(start + stream.total_out);
+    deflateEnd(&stream);
+    if (result != (flush == Z_FINISH ? Z_STREAM_END : Z_OK) || stream.avail_in != 0) {
+        throw std::runtime_error("deflate failed");
+    }
+}
+
+#ifdef WITH_ZSTD
+std::string zstdCompress(const char *data, size_t length, int level) {
+    std::string out(ZSTD_compressBound(length), '\0');
+    size_t written = ZSTD_compress(&out[0], out.size(), data, length, level);
+    if (ZSTD_isError(written)) {
+        throw std::runtime_error(std::string("ZSTD_compress failed: ") + ZSTD_getErrorName(written));
+    }
+    out.resize(written);
+    return out;
+}
+#endif
+
+EncodedBody encodeBody(Encoding encoding, const char *data, size_t length) {
+    EncodedBody encoded;
+    encoded.length = length;
+#ifdef WITH_ZSTD
+    if (encoding == Encoding::Zstd) {
+        encoded.bytes = zstdCompress(data, length, 3);
+        return encoded;
+    }
+#endif
+    (void)encoding;
+    // Minimal gzip header: deflate, no flags, no mtime, unknown OS
+    static const char header[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff'};
+    encoded.bytes.assign(header, sizeof(header));
+    deflateRaw(encoded.bytes, data, length, Z_DEFAULT_COMPRESSION, Z_SYNC_FLUSH);
+    encoded.crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), length);
+    return encoded;
+}
+
+// Compress the lines that follow a cached body so the two parts decode as one stream.
+// gzip continues the body's deflate stream and closes it with a trailer covering both
+// parts, zstd simply starts a second frame.
+std::string encodeTail(Encoding encoding, const EncodedBody &body, const std::string &tail) {
+#ifdef WITH_ZSTD
+    if (encoding == Encoding::Zstd) {
+        return zstdCompress(tail.data(), tail.size(), 1);
+    }
+#endif
+    (void)encoding;
+    std::string out;
+    deflateRaw(out, tail.data(), tail.size(), Z_BEST_SPEED, Z_FINISH);
+    uLong tailCrc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(tail.data()), tail.size());
+    uLong crc = crc32_combine(body.crc, tailCrc, tail.size());
+    uLong length = body.length + tail.size();
+    for (int shift = 0; shift < 32; shift += 8) {
+        out += static_cast<char>((crc >> shift) & 0xff);
+    }
+    for (int shift = 0; shift < 32; shift += 8) {
+        out += static_cast<char>((length >> shift) & 0xff);
+    }
+    return out;
+}
+
+// Pick the best encoding the client accepts, ignoring anything it disabled with q=0
+Encoding negotiateEncoding(const std::string &acceptEncoding) {
+    bool gzip = false;
+    bool zstd = false;
+    std::istringstream tokens(acceptEncoding);
+    std::string token;
+    while (getline(tokens, token, ',')) {
+        std::string name = token.substr(0, token.find(';'));
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        size_t q = token.find("q=");
+        if (q != std::string::npos && strtod(token.c_str() + q + 2, nullptr) <= 0) {
+            continue;
+        }
+        if (name == "gzip" || name == "*") {
+            gzip = true;
+        }
+        if (name == "zstd" || name == "*") {
+            zstd = true;
+        }
+    }
+#ifdef WITH_ZSTD
+    if (zstd) {
+        return Encoding::Zstd;
+    }
+#else
+    (void)zstd;
+#endif
+    return gzip ? Encoding::Gzip : Encoding::Identity;
+}
+
+const char* encodingName(Encoding encoding) {
+    return encoding == Encoding::Zstd ? "zstd" : "gzip";
+}
+
+// A /metrics body the handler can hand to the socket without copying it
+class MetricsBody {
+private:
+    // Compressed once per body, i.e. once per file version or snapshot generation
+    mutable std::mutex variantLock;
+    mutable std::shared_ptr<const EncodedBody> gzipped;
+    mutable std::shared_ptr<const EncodedBody> zstdCompressed;
+protected:
+    std::string entityTag;
+    struct timespec sampled = {0, 0};
+public:
+    virtual ~MetricsBody() {}
+    virtual const char* data() const = 0;
+    virtual size_t size() const = 0;
+
+    // Weak validator, the appended cache counters differ between otherwise identical responses
+    const std::string& etag() const { return entityTag; }
+    // When the metrics in this body were collected
+    const struct timespec& timestamp() const { return sampled; }
+
+    std::shared_ptr<const EncodedBody> encoded(Encoding encoding) const {
+        std::lock_guard<std::mutex> guard(variantLock);
+        std::shared_ptr<const EncodedBody> &variant = encoding == Encoding::Zstd ? zstdCompressed : gzipped;
+        if (!variant) {
+            variant = std::make_shared<const EncodedBody>(encodeBody(encoding, data(), size()));
+        }
+        return variant;
+    }
+};
+
+class StringBody : public MetricsBody {
+private:
+    std::string text;
+public:
+    StringBody(std::string content, const std::string &etag, const struct timespec &timestamp) : text(std::move(content)) {
+        entityTag = etag;
+        sampled = timestamp;
+    }
+    const char* data() const override { return text.data(); }
+    size_t size() const override { return text.size(); }
+};
+
+// metrics.txt mapped read-only. The mapping pins the inode that was opened, so the
+// collector renaming a new file over metrics.txt cannot change or tear this body.
+class MappedFileBody : public MetricsBody {
+private:
+    void *mapping = nullptr;
+    size_t length = 0;
+public:
+    MappedFileBody(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw FileException("Error opening file: " + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw FileException("Error reading file: " + filename);
+        }
+        length = st.st_size;
+        // A new metrics.txt is renamed into place, so the inode alone tells versions apart.
+        // mtime and size cover the file being rewritten in place by something else.
+        char tag[96];
+        snprintf(tag, sizeof(tag), "W/\"%llx-%llx.%lx-%zx\"", (unsigned long long)st.st_ino,
+                 (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, length);
+        entityTag = tag;
+        sampled = st.st_mtim;
+        if (length > 0) {
+            mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw FileException("Error mapping file: " + filename);
+            }
+        }
+        close(fd); // The mapping keeps the file open
+    }
+    ~MappedFileBody() {
+        if (length > 0) {
+            munmap(mapping, length);
+        }
+    }
+    const char* data() const override { return length > 0 ? static_cast<const char*>(mapping) : ""; }
+    size_t size() const override { return length; }
+};
+
+// Weak comparison as If-None-Match requires, W/ prefixes are ignored on both sides
+bool etagMatches(const std::string &ifNoneMatch, const std::string &etag) {
+    if (ifNoneMatch.empty() || etag.empty()) {
+        return false;
+    }
+    std::string opaque = etag.compare(0, 2, "W/") == 0 ? etag.substr(2) : etag;
+    std::istringstream tokens(ifNoneMatch);
+    std::string token;
+    while (getline(tokens, token, ',')) {
+        token.erase(0, token.find_first_not_of(" \t"));
+        token.erase(token.find_last_not_of(" \t") + 1);
+        if (token == "*") {
+            return true;
+        }
+        if (token.compare(0, 2, "W/") == 0) {
+            token.erase(0, 2);
+        }
+        if (token == opaque) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ETag plus the sample time, so pollers can skip unchanged data without parsing it
+void setValidatorHeaders(Response &res, const MetricsBody &metrics) {
+    res.set_header("ETag", metrics.etag());
+
+    const struct timespec &timestamp = metrics.timestamp();
+    char value[64];
+    snprintf(value, sizeof(value), "%lld.%03ld", (long long)timestamp.tv_sec, timestamp.tv_nsec / 1000000);
+    res.set_header("X-Metrics-Timestamp", value);
+
+    struct tm tm;
+    if (gmtime_r(&timestamp.tv_sec, &tm) != nullptr && strftime(value, sizeof(value), "%a, %d %b %Y %H:%M:%S GMT", &tm) > 0) {
+        res.set_header("Last-Modified", value);
+    }
+}
+
+// Scrapes answered from the cached body and scrapes that had to load or render it
+std::atomic<unsigned long long> cacheHits(0);
+std::atomic<unsigned long long> cacheMisses(0);
+
+std::string cacheCounters() {
+    std::ostringstream out;
+    out << "# HELP metrics_exporter_cache_hits_total Scrapes served from the cached metrics body.\n";
+    out << "# TYPE metrics_exporter_cache_hits_total counter\n";
+    out << "metrics_exporter_cache_hits_total " << cacheHits.load() << "\n";
+    out << "# HELP metrics_exporter_cache_misses_total Scrapes that had to reload the metrics body.\n";
+    out << "# TYPE metrics_exporter_cache_misses_total counter\n";
+    out << "metrics_exporter_cache_misses_total " << cacheMisses.load() << "\n";
+    return out.str();
+}
+
+// Where /metrics gets its body from
+class MetricsSource {
+public:
+    virtual ~MetricsSource() {}
+    virtual std::shared_ptr<const MetricsBody> metrics() = 0;
+};
+
+// Keeps the last metrics.txt mapped and maps it again only after inotify saw it replaced
+class MetricsFileCache : public MetricsSource {
+private:
+    std::string path;
+    std::string fileName;
+    int inotifyFd = -1;
+    std::atomic<bool> watching;
+    std::atomic<unsigned long long> fileVersion;
+    // Held for the whole reload so concurrent scrapes wait for one load instead of each reading the file
+    std::mutex lock;
+    unsigned long long loadedVersion = 0;
+    std::shared_ptr<const MetricsBody> body;
+
+    void watch() {
+        alignas(struct inotify_event) char events[4096];
+        while (true) {
+            ssize_t length = read(inotifyFd, events, sizeof(events));
+            if (length <= 0) {
+                if (length < 0 && errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "inotify watch on " << path << " stopped, reloading on every scrape" << std::endl;
+                watching = false;
+                return;
+            }
+            for (char *p = events; p < events + length; ) {
+                struct inotify_event *event = reinterpret_cast<struct inotify_event *>(p);
+                if (event->len > 0 && fileName == event->name) {
+                    fileVersion++;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+
+public:
+    MetricsFileCache(const std::string& filename) : path(filename), watching(false), fileVersion(1) {
+        // The collector renames metrics.tmp over metrics.txt, so watch the directory rather than the inode
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+        fileName = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "inotify unavailable (" << strerror(errno) << "), reloading " << path << " on every scrape" << std::endl;
+            return;
+        }
+        if (inotify_add_watch(fd, directory.empty() ? "/" : directory.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE) < 0) {
+            std::cerr << "Cannot watch " << directory << " (" << strerror(errno) << "), reloading " << path << " on every scrape" << std::endl;
+            close(fd);
+            return;
+        }
+        inotifyFd = fd;
+        watching = true;
+        std::thread(&MetricsFileCache::watch, this).detach();
+    }
+
+    std::shared_ptr<const MetricsBody> metrics() override {
+        std::lock_guard<std::mutex> guard(lock);
+        unsigned long long version = fileVersion.load();
+        if (body && watching && version == loadedVersion) {
+            cacheHits++;
+            return body;
+        }
+        cacheMisses++;
+        // Taken before the read, a replacement during the read triggers another reload
+        loadedVersion = version;
+        body.reset();
+        body = std::make_shared<const MappedFileBody>(path);
+        return body;
+    }
+};
+
+void appendFormat(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void appendFormat(std::string &out, const char *format, ...) {
+    char line[2048];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0) {
+        out.append(line, std::min<size_t>(length, sizeof(line) - 1));
+    }
+}
+
+// Throttle reason bits as defined by nvml.h, the exporter is built without it
+struct ThrottleReasonInfo {
+    uint32_t reasonBit;
+    const char *reasonString;
+};
+
+const ThrottleReasonInfo throttleReasons[] = {
+    {0x001, "GpuIdle"},
+    {0x002, "ApplicationsClocksSetting"},
+    {0x004, "SwPowerCap"},
+    {0x008, "HwSlowdown"},
+    {0x010, "SyncBoost"},
+    {0x020, "SwThermalSlowdown"},
+    {0x040, "HwThermalSlowdown"},
+    {0x080, "HwPowerBrakeSlowdown"},
+    {0x100, "DisplayClockSetting"},
+};
+
+// Exposition of every metric, generated from GPU_METRIC_LIST like the collector's registry
+struct MetricDescriptor {
+    int bit;
+    const char *name;
+    const char *help;
+    const char *type;
+    int format; // GPU_METRIC_FORMAT_*
+    int tier;   // GPU_METRIC_TIER_*
+    uint64_t (*value)(const GpuSnapshot &snapshot, const GpuSnapshotDevice &device);
+};
+
+#define SNAPSHOT_VALUE_REGISTER(member, format) device.member
+#define SNAPSHOT_VALUE_DEVICE(member, format) SNAPSHOT_SCALAR_##format(device.member)
+#define SNAPSHOT_VALUE_HOST(member, format) snapshot.member
+// Members that are not a single number are rendered from the device itself
+#define SNAPSHOT_SCALAR_INTEGER(value) value
+#define SNAPSHOT_SCALAR_MILLI(value) value
+#define SNAPSHOT_SCALAR_REASONS(value) value
+#define SNAPSHOT_SCALAR_AER_COUNTERS(value) 0
+#define SNAPSHOT_SCALAR_KERNEL_EVENTS(value) 0
+#define SNAPSHOT_SCALAR_KERNEL_EVENT_TIMES(value) 0
+#define SNAPSHOT_SCALAR_XID_COUNTERS(value) 0
+#define SNAPSHOT_SCALAR_AER_TYPE_COUNTERS(value) 0
+
+const MetricDescriptor metricRegistry[] = {
+#define METRIC_DESCRIPTOR(id, name, help, type, member, format, sampler, tier) \
+    {GPU_METRIC_##id, name, help, type, GPU_METRIC_FORMAT_##format, GPU_METRIC_TIER_##tier, \
+     [](const GpuSnapshot &snapshot, const GpuSnapshotDevice &device) -> uint64_t { \
+         (void)snapshot; (void)device; return SNAPSHOT_VALUE_##tier(member, format); }},
+    GPU_METRIC_LIST(METRIC_DESCRIPTOR)
+#undef METRIC_DESCRIPTOR
+};
+
+struct TempSeries {
+    const char *suffix;
+    const char *help;
+};
+
+const TempSeries tempSeries[] = {
+    {"_min", "Minimum of the high-rate samples since the last update (in C)."},
+    {"_max", "Maximum of the high-rate samples since the last update (in C)."},
+    {"_avg", "Mean of the high-rate samples since the last update (in C)."},
+    {"_p95", "95th percentile of the high-rate samples since the last update (in C)."},
+    {"_p99", "99th percentile of the high-rate samples since the last update (in C)."},
+};
+
+void appendHeader(std::string &out, const char *name, const char *suffix, const char *help, const char *type) {
+    appendFormat(out, "# HELP %s%s %s\n", name, suffix, help);
+    appendFormat(out, "# TYPE %s%s %s\n", name, suffix, type);
+}
+
+void appendDeviceSample(std::string &out, const MetricDescriptor &metric, const char *label,
+                        const GpuSnapshot &snapshot, const GpuSnapshotDevice &device) {
+    uint64_t value = metric.value(snapshot, device);
+    if (metric.format == GPU_METRIC_FORMAT_MILLI) {
+        appendFormat(out, "%s%s %.6f\n", metric.name, label, value / 1000.0);
+    } else if (metric.format == GPU_METRIC_FORMAT_REASONS) {
+        // The reason is appended to the device label set
+        int label_length = (int)strlen(label) - 1;
+        for (const ThrottleReasonInfo &reason : throttleReasons) {
+            appendFormat(out, "%s%.*s,reason=\"%s\"} %d\n", metric.name, label_length, label, reason.reasonString,
+                         (value & reason.reasonBit) ? 1 : 0);
+        }
+    } else if (metric.format == GPU_METRIC_FORMAT_AER_COUNTERS) {
+        int label_length = (int)strlen(label) - 1;
+        for (int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+            if (!(device.aer_dev.ports & (1u << port))) {
+                continue;
+            }
+            for (int severity = 0; severity < GPU_AER_SEVERITY_COUNT; severity++) {
+                appendFormat(out, "%s%.*s,port=\"%s\",severity=\"%s\"} %llu\n", metric.name, label_length, label,
+                             gpuAerPortNames[port], gpuAerSeverityNames[severity],
+                             (unsigned long long)device.aer_dev.errors[port][severity]);
+            }
+        }
+    } else if (metric.format == GPU_METRIC_FORMAT_KERNEL_EVENTS || metric.format == GPU_METRIC_FORMAT_KERNEL_EVENT_TIMES) {
+        int label_length = (int)strlen(label) - 1;
+        for (int kind = 0; kind < GPU_KERNEL_EVENT_COUNT; kind++) {
+            if (metric.format == GPU_METRIC_FORMAT_KERNEL_EVENTS) {
+                appendFormat(out, "%s%.*s,event=\"%s\"} %llu\n", metric.name, label_length, label, gpuKernelEventNames[kind],
+                             (unsigned long long)device.kernel_events.counts[kind]);
+            } else {
+                appendFormat(out, "%s%.*s,event=\"%s\"} %.6f\n", metric.name, label_length, label, gpuKernelEventNames[kind],
+                             device.kernel_events.last_seconds[kind]);
+            }
+        }
+    } else if (metric.format == GPU_METRIC_FORMAT_XID_COUNTERS) {
+        int label_length = (int)strlen(label) - 1;
+        for (int code = 0; code < GPU_XID_CODE_COUNT; code++) {
+            if (device.kernel_events.xid_counts[code] > 0) {
+                appendFormat(out, "%s%.*s,xid=\"%d\"} %u\n", metric.name, label_length, label, code,
+                             device.kernel_events.xid_counts[code]);
+            }
+        }
+    } else if (metric.format == GPU_METRIC_FORMAT_AER_TYPE_COUNTERS) {
+        int label_length = (int)strlen(label) - 1;
+        for (int type = 0; type < GPU_AER_TYPE_COUNT; type++) {
+            if (device.kernel_events.aer_type_counts[type] > 0) {
+                appendFormat(out, "%s%.*s,severity=\"%s\",type=\"%s\"} %u\n", metric.name, label_length, label,
+                             gpuAerTypeSeverities[type], gpuAerTypeNames[type], device.kernel_events.aer_type_counts[type]);
+            }
+        }
+    } else {
+        appendFormat(out, "%s%s %llu\n", metric.name, label, (unsigned long long)value);
+    }
+}
+
+// _min/_max/_avg/_p95/_p99 families across all devices, devices without samples are left out
+void renderTempWindows(std::string &out, const char *metric, const std::vector<std::string> &labels,
+                       const GpuSnapshot &snapshot, bool hotspot) {
+    bool any = false;
+    for (uint32_t i = 0; i < snapshot.device_count; i++) {
+        const GpuSnapshotTempWindow &window = hotspot ? snapshot.devices[i].hotspot_window : snapshot.devices[i].vram_window;
+        any = any || window.count > 0;
+    }
+    if (!any) {
+        return;
+    }
+    for (size_t s = 0; s < sizeof(tempSeries) / sizeof(tempSeries[0]); s++) {
+        appendHeader(out, metric, tempSeries[s].suffix, tempSeries[s].help, "gauge");
+        for (uint32_t i = 0; i < snapshot.device_count; i++) {
+            const GpuSnapshotTempWindow &window = hotspot ? snapshot.devices[i].hotspot_window : snapshot.devices[i].vram_window;
+            if (window.count == 0) {
+                continue;
+            }
+            const char *label = labels[i].c_str();
+            switch (s) {
+                case 0: appendFormat(out, "%s_min%s %u\n", metric, label, window.min); break;
+                case 1: appendFormat(out, "%s_max%s %u\n", metric, label, window.max); break;
+                case 2: appendFormat(out, "%s_avg%s %.2f\n", metric, label, window.avg); break;
+                case 3: appendFormat(out, "%s_p95%s %u\n", metric, label, window.p95); break;
+                default: appendFormat(out, "%s_p99%s %u\n", metric, label, window.p99); break;
+            }
+        }
+    }
+}
+
+// Same exposition text nvml_direct_access writes to metrics.txt, one HELP/TYPE pair per family
+std::string renderSnapshot(const GpuSnapshot &snapshot) {
+    std::string out;
+    out.reserve(4096 + snapshot.device_count * 4096);
+    uint32_t enabled = snapshot.enabled_metrics;
+
+    std::vector<std::string> labels(snapshot.device_count);
+    for (uint32_t i = 0; i < snapshot.device_count; i++) {
+        const GpuSnapshotDevice &device = snapshot.devices[i];
+        char label[1024];
+        snprintf(label, sizeof(label),
+                 "{gpu=\"%u\",UUID=\"%s\",device=\"nvidia%u\",modelName=\"%s\",Hostname=\"%s\",DCGM_FI_DRIVER_VERSION=\"%s\"}",
+                 i, device.uuid, i, device.name, snapshot.hostname, snapshot.driver_version);
+        labels[i] = label;
+    }
+
+    for (const MetricDescriptor &metric : metricRegistry) {
+        if (!(enabled & (1u << metric.bit))) {
+            continue;
+        }
+        if (metric.tier == GPU_METRIC_TIER_HOST) {
+            appendHeader(out, metric.name, "", metric.help, metric.type);
+            appendFormat(out, "%s %llu\n", metric.name, (unsigned long long)metric.value(snapshot, snapshot.devices[0]));
+            continue;
+        }
+        // Devices without a sample are skipped, the header is only written if one has it
+        bool header_written = false;
+        for (uint32_t i = 0; i < snapshot.device_count; i++) {
+            if (snapshot.devices[i].unsupported_metrics & (1u << metric.bit)) {
+                continue;
+            }
+            if (!header_written) {
+                appendHeader(out, metric.name, "", metric.help, metric.type);
+                header_written = true;
+            }
+            appendDeviceSample(out, metric, labels[i].c_str(), snapshot, snapshot.devices[i]);
+        }
+        if (metric.tier == GPU_METRIC_TIER_REGISTER) {
+            renderTempWindows(out, metric.name, labels, snapshot, metric.bit == GPU_METRIC_HOT_SPOT_TEMP);
+        }
     }
 
-    std::string content, line;
-    while (getline(file, line)) {
-        content += line + "\n";
+    out += "# HELP collector_nvml_handle_cache_rebuilds_total Number of times the NVML session and device handle cache were rebuilt.\n";
+    out += "# TYPE collector_nvml_handle_cache_rebuilds_total counter\n";
+    appendFormat(out, "collector_nvml_handle_cache_rebuilds_total %llu\n", (unsigned long long)snapshot.handle_cache_rebuilds);
+
+    out += "# HELP collector_sample_duration_seconds Time taken to sample all devices in the last cycle.\n";
+    out += "# TYPE collector_sample_duration_seconds gauge\n";
+    appendFormat(out, "collector_sample_duration_seconds %.6f\n", snapshot.sample_duration);
+
+    out += "# HELP collector_cycle_duration_seconds Time taken by the previous collection cycle, from wakeup to metrics written.\n";
+    out += "# TYPE collector_cycle_duration_seconds gauge\n";
+    appendFormat(out, "collector_cycle_duration_seconds %.6f\n", snapshot.cycle_duration);
+
+    out += "# HELP collector_cycle_lag_seconds How late the current cycle woke up relative to its deadline.\n";
+    out += "# TYPE collector_cycle_lag_seconds gauge\n";
+    appendFormat(out, "collector_cycle_lag_seconds %.6f\n", snapshot.cycle_lag);
+
+    out += "# HELP collector_missed_deadlines_total Sampling deadlines skipped because the collector was still busy.\n";
+    out += "# TYPE collector_missed_deadlines_total counter\n";
+    appendFormat(out, "collector_missed_deadlines_total %llu\n", (unsigned long long)snapshot.missed_deadlines);
+
+    out += "# HELP collector_device_stale 1 if the GPU did not finish sampling in time and its values are from an earlier cycle.\n";
+    out += "# TYPE collector_device_stale gauge\n";
+    for (uint32_t i = 0; i < snapshot.device_count; i++) {
+        appendFormat(out, "collector_device_stale{gpu=\"%u\"} %u\n", i, snapshot.devices[i].stale);
     }
-    file.close();
-    return content;
+    return out;
 }
 
+// Renders the shared memory snapshot on demand, at most once per collector generation
+class SnapshotRenderer : public MetricsSource {
+private:
+    std::string shmName;
+    GpuSnapshotMapping mapping;
+    bool mapped = false;
+    std::mutex lock;
+    uint64_t renderedGeneration = 0;
+    std::shared_ptr<const MetricsBody> rendered;
+    GpuSnapshot copy;
+public:
+    SnapshotRenderer(const std::string& name) : shmName(name) {}
+
+    ~SnapshotRenderer() {
+        if (mapped) {
+            gpuSnapshotUnmap(&mapping);
+        }
+    }
+
+    std::shared_ptr<const MetricsBody> metrics() override {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!mapped) {
+            // The collector may start after the exporter
+            mapped = true;
+            if (!gpuSnapshotMap(&mapping, shmName.c_str())) {
+                throw FileException("Shared memory snapshot " + shmName + " is not available");
+            }
+        }
+        // Remaps by itself when a restarted collector re-created the object
+        uint64_t generation = gpuSnapshotGeneration(&mapping);
+        if (generation == 0) {
+            throw FileException("Collector has not published a snapshot of this version yet");
+        }
+        if (rendered && generation == renderedGeneration) {
+            cacheHits++;
+            return rendered;
+        }
+        cacheMisses++;
+        if (!gpuSnapshotRead(&mapping, &copy)) {
+            throw std::runtime_error("Snapshot kept changing while it was read");
+        }
+        char tag[64];
+        snprintf(tag, sizeof(tag), "W/\"gen-%llx\"", (unsigned long long)copy.generation);
+        struct timespec timestamp = {static_cast<time_t>(copy.timestamp_sec), static_cast<long>(copy.timestamp_nsec)};
+        rendered = std::make_shared<const StringBody>(renderSnapshot(copy), tag, timestamp);
+        renderedGeneration = copy.generation;
+        return rendered;
+    }
+};
+
 int main(int argc, char* argv[]) {
     std::string metricsFilePath = "./metrics.txt"; // Default file path
-    if (argc > 1) {
-        metricsFilePath = argv[1]; // Override with command-line argument if provided
+    std::shared_ptr<MetricsSource> source;
+    if (argc > 1 && std::string(argv[1]) == "--shm") {
+        // Serve the collector's shared memory snapshot instead of metrics.txt
+        source = std::make_shared<SnapshotRenderer>(argc > 2 ? argv[2] : GPU_SNAPSHOT_SHM_NAME);
+    } else {
+        if (argc > 1) {
+            metricsFilePath = argv[1]; // Override with command-line argument if provided
+        }
+        source = std::make_shared<MetricsFileCache>(metricsFilePath);
     }
 
     Server svr;
@@ -52,10 +690,45 @@ int main(int argc, char* argv[]) {
     });
 
     // Handler for the /metrics path with error handling
-    svr.Get("/metrics", [metricsFilePath](const Request& req, Response& res) {
+    svr.Get("/metrics", [source](const Request& req, Response& res) {
         try {
-            std::string metrics = readMetricsFromFile(metricsFilePath);
-            res.set_content(metrics, "text/plain");
+            std::shared_ptr<const MetricsBody> metrics = source->metrics();
+            setValidatorHeaders(res, *metrics);
+            res.set_header("Vary", "Accept-Encoding");
+            if (etagMatches(req.get_header_value("If-None-Match"), metrics->etag())) {
+                res.status = 304; // Not Modified
+                return;
+            }
+
+            Encoding encoding = negotiateEncoding(req.get_header_value("Accept-Encoding"));
+            std::string counters = cacheCounters();
+
+            // The cached body and the per-scrape counters are sent as two parts, so compressed
+            // responses only compress the few counter lines per request.
+            std::shared_ptr<const void> owner = metrics;
+            const char *body = metrics->data();
+            size_t bodyLength = metrics->size();
+            std::shared_ptr<const std::string> tail;
+            if (encoding == Encoding::Identity) {
+                tail = std::make_shared<const std::string>(std::move(counters));
+            } else {
+                std::shared_ptr<const EncodedBody> compressed = metrics->encoded(encoding);
+                owner = compressed;
+                body = compressed->bytes.data();
+                bodyLength = compressed->bytes.size();
+                tail = std::make_shared<const std::string>(encodeTail(encoding, *compressed, counters));
+                res.set_header("Content-Encoding", encodingName(encoding));
+            }
+
+            // Stream straight from the cached body, the response keeps it alive until it is sent
+            res.set_content_provider(bodyLength + tail->size(), "text/plain",
+                [owner, body, bodyLength, tail](size_t offset, size_t length, DataSink &sink) {
+                    if (offset < bodyLength) {
+                        return sink.write(body + offset, std::min(length, bodyLength - offset));
+                    }
+                    offset -= bodyLength;
+                    return sink.write(tail->data() + offset, std::min(length, tail->size() - offset));
+                });
         } catch (const FileException& e) {
             res.status = 404; // Not Found
             res.set_content(e.what(), "text/plain");
@@ -68,4 +741,5 @@ int main(int argc, char* argv[]) {
     // Bind to 0.0.0.0 to make the server accessible from other machines
     std::cout << "Starting metrics server on port 9500..." << std::endl;
     svr.listen("0.0.0.0", 9500);
+    return 0;
 }
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "httplib.h"
+#include "metrics_server.h"
+
+using namespace httplib;
+
+namespace {
+
+Server svr;
+
+// Scrapes keep their own reference, so publishing never waits for a slow client
+std::mutex body_lock;
+std::shared_ptr<const std::string> current_body;
+
+std::shared_ptr<const std::string> latestMetrics() {
+    std::lock_guard<std::mutex> guard(body_lock);
+    return current_body;
+}
+
+}
+
+bool startMetricsServer(const char* host, int port) {
+    svr.Get("/", [](const Request&, Response& res) {
+        std::string landingPageHtml = "<html>"
+                                      "<head><title>Metrics Exporter</title></head>"
+                                      "<body>"
+                                      "<h1>Welcome to the Metrics Exporter</h1>"
+                                      "<p><a href='/metrics'>Go to Metrics</a></p>"
+                                      "</body>"
+                                      "</html>";
+        res.set_content(landingPageHtml, "text/html");
+    });
+
+    svr.Get("/metrics", [](const Request&, Response& res) {
+        std::shared_ptr<const std::string> metrics = latestMetrics();
+        if (!metrics) {
+            res.status = 503; // Service Unavailable until the first cycle completes
+            res.set_content("No metrics collected yet", "text/plain");
+            return;
+        }
+        res.set_content(*metrics, "text/plain");
+    });
+
+    if (!svr.bind_to_port(host, port)) {
+        std::cerr << "Failed to bind metrics server to " << host << ":" << port << std::endl;
+        return false;
+    }
+    std::thread([] { svr.listen_after_bind(); }).detach();
+    std::cout << "Starting metrics server on port " << port << "..." << std::endl;
+    return true;
+}
+
+void publishMetrics(const char* body, size_t length) {
+    std::shared_ptr<const std::string> metrics = std::make_shared<const std::string>(body, length);
+    std::lock_guard<std::mutex> guard(body_lock);
+    current_body.swap(metrics);
+}
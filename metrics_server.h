@@ -0,0 +1,21 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start serving / and /metrics on a background thread, false if the address could not be bound
+bool startMetricsServer(const char* host, int port);
+
+// Replace the exposition text served on /metrics, the body is copied
+void publishMetrics(const char* body, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
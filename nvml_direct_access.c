@@ -1,4 +1,5 @@
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64 // BARs above 4 GB need a 64-bit off_t for mmap
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,22 +9,52 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <pci/pci.h>
 #include <signal.h>
 #include <nvml.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#include "metrics_server.h"
+#include "gpu_snapshot.h"
 
 #define VRAM_REGISTER_OFFSET 0x0000E2A8
 #define HOTSPOT_REGISTER_OFFSET 0x0002046c
 #define PG_SZ sysconf(_SC_PAGE_SIZE)
 #define MEM_PATH "/dev/mem"
+#define SYSFS_PCI_DEVICES_PATH "bus/pci/devices" // Relative to --sysfs-root
+#define SYSLOG_PATH "/var/log/syslog"
+#define KMSG_PATH "/dev/kmsg"
 // Define the maximum number of devices
 #define MAX_DEVICES 32
-
-int fd = -1;
-void* map_base = MAP_FAILED; // Use MAP_FAILED instead of (void*)-1 for mapping
-FILE *metrics_file = NULL;
+// Upper bound for the sampling worker pool
+#define MAX_WORKERS 32
+// Number of entries in metricRegistry
+#define METRIC_FIELD_COUNT GPU_METRIC_COUNT
+// Sampling interval for metrics.ini entries without an explicit interval
+#define DEFAULT_INTERVAL_MS 5000
+
+// Exposition text of the current cycle, reused so steady-state rendering does not allocate
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed; // An append could not grow the buffer, the output is incomplete
+} OutputBuffer;
+
+OutputBuffer metrics_buffer;
+// Backing store of the interned line prefixes, see buildLinePrefixes()
+OutputBuffer line_prefix_arena;
+// Outputs for the rendered metrics, see --listen and --no-metrics-file
+bool metrics_file_enabled = true;
+bool metrics_server_enabled = false;
+bool metrics_file_due = true; // Cleared by main() for cycles that only read the registers
 
 typedef struct {
     unsigned long long reasonBit;
@@ -44,24 +75,75 @@ const ThrottleReasonInfo throttleReasons[] = {
     // Add more throttle reasons as necessary
 };
 
+#define METRIC_BIT(field) (1u << (field))
+
 typedef struct {
-    bool vram_temp;
-    bool hotspot_temp;
-    bool clocks_throttle_reason;
-    bool gpu_aer_total_errors;
-    bool gpu_aer_error_state;
-    bool sm_clock;
-    bool mem_clock;
-    bool gpu_temp;
-    bool power_usage;
-    bool fan_speed;
-    bool gpu_util;
-    bool mem_util;
-    bool fb_free;
-    bool fb_used;
-    bool nvlink_bandwidth_total;
+    uint32_t enabled; // METRIC_BIT of every exported metric
+    unsigned int interval_ms[METRIC_FIELD_COUNT]; // Sampling interval per metricRegistry entry
 } MetricsConfig;
 
+// Fills device i's slot for the due metrics it handles and returns the bits it covered,
+// so metrics that share a driver call are all served by the first one that is due
+typedef uint32_t (*MetricSampler)(unsigned int i, uint32_t due);
+
+typedef struct {
+    const char* name; // Also the name accepted in metrics.ini
+    const char* help;
+    const char* type;
+    unsigned int format; // GPU_METRIC_FORMAT_*
+    unsigned int tier;   // GPU_METRIC_TIER_*
+    MetricSampler sample;
+} MetricDescriptor;
+
+uint32_t sampleRegisterTemps(unsigned int i, uint32_t due);
+uint32_t sampleThrottleReasons(unsigned int i, uint32_t due);
+uint32_t sampleAerCounters(unsigned int i, uint32_t due);
+uint32_t sampleErrorState(unsigned int i, uint32_t due);
+uint32_t sampleSmClock(unsigned int i, uint32_t due);
+uint32_t sampleMemClock(unsigned int i, uint32_t due);
+uint32_t sampleGpuTemp(unsigned int i, uint32_t due);
+uint32_t sampleFieldMetrics(unsigned int i, uint32_t due);
+uint32_t sampleFanSpeed(unsigned int i, uint32_t due);
+uint32_t sampleUtilization(unsigned int i, uint32_t due);
+uint32_t sampleMemoryInfo(unsigned int i, uint32_t due);
+uint32_t sampleKernelEvents(unsigned int i, uint32_t due);
+uint32_t sampleUpgradablePackages(unsigned int i, uint32_t due);
+
+// Config names, exposition and sampling of every metric, generated from GPU_METRIC_LIST
+const MetricDescriptor metricRegistry[METRIC_FIELD_COUNT] = {
+#define METRIC_DESCRIPTOR(id, name, help, type, member, format, sampler, tier) \
+    {name, help, type, GPU_METRIC_FORMAT_##format, GPU_METRIC_TIER_##tier, sampler},
+    GPU_METRIC_LIST(METRIC_DESCRIPTOR)
+#undef METRIC_DESCRIPTOR
+};
+
+// Metrics of the register and host tiers, everything else is sampled per device on the worker pool
+#define METRIC_IN_TIER(id, tier, wanted) (GPU_METRIC_TIER_##tier == GPU_METRIC_TIER_##wanted ? METRIC_BIT(GPU_METRIC_##id) : 0)
+#define REGISTER_TIER_BIT(id, name, help, type, member, format, sampler, tier) | METRIC_IN_TIER(id, tier, REGISTER)
+#define HOST_TIER_BIT(id, name, help, type, member, format, sampler, tier) | METRIC_IN_TIER(id, tier, HOST)
+const uint32_t register_metrics = 0 GPU_METRIC_LIST(REGISTER_TIER_BIT);
+const uint32_t host_metrics = 0 GPU_METRIC_LIST(HOST_TIER_BIT);
+// Metrics fed by the /dev/kmsg reader thread
+const uint32_t kernel_event_metrics = METRIC_BIT(GPU_METRIC_KERNEL_EVENTS) | METRIC_BIT(GPU_METRIC_KERNEL_EVENT_TIME) |
+                                      METRIC_BIT(GPU_METRIC_XID_ERRORS) | METRIC_BIT(GPU_METRIC_KERNEL_AER_ERRORS);
+
+// Perfect hash of the metric names for metrics.ini, the seed is searched once at startup
+#define METRIC_LOOKUP_BITS 6
+int8_t metric_lookup[1 << METRIC_LOOKUP_BITS];
+uint64_t metric_lookup_seed = 0;
+bool metric_lookup_built = false;
+
+// Min-heap of metrics ordered by the time they are next due
+typedef struct {
+    uint64_t due_ms;
+    unsigned int field; // Index into metricRegistry
+} ScheduleEntry;
+
+typedef struct {
+    ScheduleEntry entries[METRIC_FIELD_COUNT];
+    unsigned int size;
+} Schedule;
+
 typedef struct {
     char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
     unsigned int vram_temp;
@@ -76,25 +158,505 @@ typedef struct {
     unsigned int mem_util;
     unsigned long long fb_free;
     unsigned long long fb_used;
-    unsigned int nvlink_bandwidth_total;
+    unsigned long long nvlink_bandwidth_total;
+    unsigned int aer_total_errors;
+    unsigned int error_state;
+    GpuAerCounters aer_dev;
+    GpuKernelEvents kernel_events;
     char device_name[NVML_DEVICE_NAME_BUFFER_SIZE];
+    bool stale; // Did not finish sampling in time, the values are from an earlier cycle
+    bool aer_total_pending; // Counted from the syslog, whose backfill has not finished yet
 } DeviceData;
 
-DeviceData devices[MAX_DEVICES];
+// Everything readers need from one collection cycle
+typedef struct {
+    unsigned long long generation; // Incremented on every publish
+    unsigned long long identity;   // identity_generation the devices were sampled under
+    struct timespec timestamp;     // Wall clock time the snapshot was published
+    unsigned int device_count;
+    DeviceData devices[MAX_DEVICES];
+} MetricsSnapshot;
+
+// Seqlock-protected buffer, the sequence is odd while a writer fills it
+typedef struct {
+    atomic_uint sequence;
+    MetricsSnapshot snapshot;
+} SnapshotBuffer;
+
+// Samplers fill the back buffer while readers copy the front one without blocking
+SnapshotBuffer snapshot_buffers[2];
+atomic_uint front_buffer = 0;
+unsigned long long snapshot_generation = 0;
+
+// Samplers fill a device's staging slot, which sampleAllDevices copies into the
+// back buffer once the device finished, so a late sampler never writes a published snapshot
+DeviceData device_staging[MAX_DEVICES];
+DeviceData *devices = device_staging;
+// Main loop's copy of the front buffer, static because it is several KB
+MetricsSnapshot current_snapshot;
+
+// NVML handles are only re-fetched when NVML reports that they went stale
+typedef struct {
+    nvmlDevice_t handle;
+    nvmlPciInfo_t pci_info;
+    // Fixed for the lifetime of the handle, so only fetched when the cache is rebuilt
+    char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
+    char name[NVML_DEVICE_NAME_BUFFER_SIZE];
+    bool valid;
+    // Field values the driver rejected for this device, sampled with individual calls instead
+    bool power_field_unsupported;
+    bool nvlink_field_unsupported;
+    bool pci_missing; // Not found on the PCI bus, reported once until it is back
+} DeviceHandle;
+
+// Enough room for the power field plus TX and RX data counters of every NVLink
+#define MAX_FIELD_REQUESTS (1 + 2 * NVML_NVLINK_MAX_LINKS)
+
+DeviceHandle device_handles[MAX_DEVICES];
+unsigned int cached_device_count = 0;
+bool nvml_initialized = false;
+atomic_bool handle_cache_valid = false;
+unsigned long long handle_cache_rebuilds = 0;
+bool handle_cache_rebuild_deferred = false; // A hung worker held off the last rebuild
+
+// Host identity used in every label set, refreshed together with the handle cache
+// since a driver upgrade or hotplug always goes through a rebuild
+char cached_hostname[256];
+char cached_driver_version[NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE];
+unsigned long long identity_generation = 0; // Incremented whenever the above or a device identity may change
+
+// Sample line prefixes ("NAME{labels} ") interned per device, so a cycle only appends values.
+// Slots below METRIC_FIELD_COUNT follow metricRegistry, then come the high-rate
+// aggregate series (VRAM, then hot spot), one slot per throttle reason,
+// one per AER port and severity, two per kernel event kind and one per AER
+// error type. Xid codes are
+// only known at render time and appended to the family's own prefix.
+#define THROTTLE_REASON_COUNT (sizeof(throttleReasons) / sizeof(throttleReasons[0]))
+#define TEMP_SERIES_COUNT 5
+enum {
+    PREFIX_AGGREGATES = METRIC_FIELD_COUNT,
+    PREFIX_THROTTLE = PREFIX_AGGREGATES + 2 * TEMP_SERIES_COUNT,
+    PREFIX_AER_DEV = PREFIX_THROTTLE + THROTTLE_REASON_COUNT,
+    PREFIX_KERNEL_EVENTS = PREFIX_AER_DEV + GPU_AER_PORT_COUNT * GPU_AER_SEVERITY_COUNT,
+    PREFIX_KERNEL_EVENT_TIMES = PREFIX_KERNEL_EVENTS + GPU_KERNEL_EVENT_COUNT,
+    PREFIX_AER_TYPES = PREFIX_KERNEL_EVENT_TIMES + GPU_KERNEL_EVENT_COUNT,
+    PREFIX_COUNT = PREFIX_AER_TYPES + GPU_AER_TYPE_COUNT
+};
+
+typedef struct {
+    uint32_t offset; // Into line_prefix_arena, which may move when it grows
+    uint32_t length;
+} LinePrefix;
+
+typedef struct {
+    const char *suffix;
+    const char *help;
+    unsigned int decimals;
+} TempSeries;
+
+const TempSeries tempSeries[TEMP_SERIES_COUNT] = {
+    {"_min", "Minimum of the high-rate samples since the last update (in C).", 0},
+    {"_max", "Maximum of the high-rate samples since the last update (in C).", 0},
+    {"_avg", "Mean of the high-rate samples since the last update (in C).", 2},
+    {"_p95", "95th percentile of the high-rate samples since the last update (in C).", 0},
+    {"_p99", "99th percentile of the high-rate samples since the last update (in C).", 0},
+};
+
+LinePrefix line_prefixes[MAX_DEVICES][PREFIX_COUNT];
+unsigned long long line_prefixes_identity = 0; // identity_generation the prefixes were built for, 0 if never
+unsigned int line_prefixes_device_count = 0;
+// Family names of the aggregate series, e.g. DCGM_FI_DEV_VRAM_TEMP_p99
+char aggregate_names[2][TEMP_SERIES_COUNT][64];
+
+// A register source opens a file whose contents mirror a device's BAR0 and
+// reports where BAR0 starts inside it. The pages holding the registers are
+// then mmap'ed from that file, whichever backend provided it.
+typedef struct {
+    const char *name;
+    int (*open_bar0)(const struct pci_dev *dev, off_t *bar0_offset);
+} RegisterSource;
+
+int openDevMemBar0(const struct pci_dev *dev, off_t *bar0_offset);
+int openSysfsBar0(const struct pci_dev *dev, off_t *bar0_offset);
+int openFileBar0(const struct pci_dev *dev, off_t *bar0_offset);
+
+const RegisterSource registerSources[] = {
+    {"devmem", openDevMemBar0}, // Physical memory, needs iomem=relaxed
+    {"sysfs", openSysfsBar0},   // /sys/bus/pci/devices/<bdf>/resource0, no kernel parameter needed
+    {"file", openFileBar0},     // <dir>/<bdf> BAR0 images for testing without GPUs
+};
+
+// NULL tries sysfs first and falls back to /dev/mem
+const RegisterSource *register_source = NULL;
+const char *register_file_dir = NULL;
+
+// BAR0 register pages are mapped once and reused until the BAR address changes
+typedef struct {
+    pciaddr_t bar0;
+    int fd;
+    const RegisterSource *source;
+    void *vram_page;
+    void *hotspot_page;
+    off_t vram_offset;    // offset of the register within vram_page
+    off_t hotspot_offset; // offset of the register within hotspot_page
+} RegisterWindow;
+
+RegisterWindow register_windows[MAX_DEVICES];
+// Held while windows are (re)mapped and by the register sampler while it reads them
+pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Temperatures decoded from the registers always fit in 7 bits
+#define TEMP_HISTOGRAM_BINS 128
+
+// Fixed-size aggregate of the register samples taken since the last render
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t histogram[TEMP_HISTOGRAM_BINS];
+} TempWindow;
+
+typedef struct {
+    TempWindow vram;
+    TempWindow hotspot;
+} RegisterAggregates;
+
+// Written by the register sampler under register_lock, taken and reset by createMetricFile
+RegisterAggregates register_aggregates[MAX_DEVICES];
+RegisterAggregates rendered_aggregates[MAX_DEVICES];
+unsigned int register_sampler_hz = 0; // 0 disables the high-rate register sampler
+
+// Hash index of the scanned PCI functions keyed by domain/bus/device/function
+typedef struct {
+    uint64_t key;
+    struct pci_dev *dev; // NULL marks an empty slot
+} PciIndexEntry;
+
+struct pci_access *pacc = NULL;
+PciIndexEntry *pci_index = NULL;
+size_t pci_index_mask = 0;
+atomic_bool pci_index_valid = false;
+
+// A GPU missing from the index only rescans the bus once per backoff period, which
+// doubles while it stays missing so a removed card does not cost a scan every cycle
+#define PCI_RESCAN_MIN_BACKOFF_MS 1000
+#define PCI_RESCAN_MAX_BACKOFF_MS (5 * 60 * 1000)
+atomic_bool pci_rescan_wanted = false; // Set by sampleRegisters for a GPU it could not find
+uint64_t pci_rescan_due_ms = 0;
+unsigned int pci_rescan_backoff_ms = PCI_RESCAN_MIN_BACKOFF_MS;
+
+// Workers sample devices concurrently; the dispatcher waits for them until the batch's deadline
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done; // Waited on against CLOCK_MONOTONIC
+    unsigned long long generation; // Bumped for every batch of devices
+    unsigned int queue[MAX_DEVICES]; // Devices of the current batch
+    unsigned int queue_length;
+    unsigned int next_device; // Next queue entry to hand out
+    unsigned int pending; // Devices of the current batch not finished yet
+    uint32_t due; // Metrics sampled in the current batch
+    bool busy[MAX_DEVICES]; // Being sampled, possibly for an earlier batch that gave up on it
+    bool done[MAX_DEVICES]; // Finished within the current batch
+    unsigned int worker_count;
+    pthread_t threads[MAX_WORKERS];
+} WorkerPool;
+
+// How long a handle cache rebuild or PCI rescan waits for workers still inside NVML
+#define WORKER_IDLE_TIMEOUT_MS 100
+
+WorkerPool worker_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .work_done = PTHREAD_COND_INITIALIZER,
+};
+double last_sample_duration = 0.0;
+double last_cycle_duration = 0.0;
+double last_cycle_lag = 0.0;
+unsigned long long missed_deadlines = 0;
+unsigned int upgradable_packages = 0;
+
+#define LOG_LINE_MAX 4096
+#define LOG_READ_SIZE (64 * 1024)
+
+// Incomplete last line of a log read, completed by the next one
+typedef struct {
+    char line[LOG_LINE_MAX];
+    size_t length;
+} LineCarry;
+
+typedef void (*LineHandler)(const char *line, size_t length);
+
+// Log line classifier shared by the syslog tracker, its backfill and the kmsg reader.
+// One Aho-Corasick automaton over the GPU bus ids and the event patterns, compiled
+// into a DFA over the byte classes that occur in them, so a line is walked once
+// whatever the number of GPUs and patterns.
+typedef struct {
+    uint32_t events;    // Bit per GPU_KERNEL_EVENT_*
+    uint32_t aer_types; // Bit per GPU_AER_TYPE_*
+    uint32_t buses;     // Bit per log bus named by its bus id
+    uint32_t xid_buses; // Bit per log bus named by an "NVRM: Xid (PCI:dddd:bb:dd)" report
+} LogMatch;
+
+typedef struct {
+    const char *text;
+    LogMatch match;
+} LogPattern;
+
+#define EVENT_PATTERN(text, kind) {text, {.events = 1u << GPU_KERNEL_EVENT_##kind}}
+#define AER_TYPE_PATTERN(text, type) {text, {.aer_types = 1u << GPU_AER_TYPE_##type}}
+
+// The bus id patterns are added per GPU. AER error types are matched on the bit lines
+// of a report, "[ 6] BadTLP" on current kernels and "[ 6] Bad TLP" on older ones.
+const LogPattern logEventPatterns[] = {
+    EVENT_PATTERN("AER", AER),
+    EVENT_PATTERN("fallen off the bus", FALLEN_OFF_BUS),
+    AER_TYPE_PATTERN("] RxErr", RX_ERR),
+    AER_TYPE_PATTERN("] Receiver Error", RX_ERR),
+    AER_TYPE_PATTERN("] BadTLP", BAD_TLP),
+    AER_TYPE_PATTERN("] Bad TLP", BAD_TLP),
+    AER_TYPE_PATTERN("] BadDLLP", BAD_DLLP),
+    AER_TYPE_PATTERN("] Bad DLLP", BAD_DLLP),
+    AER_TYPE_PATTERN("] Rollover", ROLLOVER),
+    AER_TYPE_PATTERN("] RELAY_NUM Rollover", ROLLOVER),
+    AER_TYPE_PATTERN("] Timeout", TIMEOUT),
+    AER_TYPE_PATTERN("] Replay Timer Timeout", TIMEOUT),
+    AER_TYPE_PATTERN("] NonFatalErr", NON_FATAL_ERR),
+    AER_TYPE_PATTERN("] Advisory Non-Fatal", NON_FATAL_ERR),
+    AER_TYPE_PATTERN("] CorrIntErr", CORR_INT_ERR),
+    AER_TYPE_PATTERN("] HeaderOF", HEADER_OF),
+    AER_TYPE_PATTERN("] DLP", DLP),
+    AER_TYPE_PATTERN("] Data Link Protocol", DLP),
+    AER_TYPE_PATTERN("] SDES", SDES),
+    AER_TYPE_PATTERN("] Surprise Down Error", SDES),
+    AER_TYPE_PATTERN("] TLP", TLP),
+    AER_TYPE_PATTERN("] Poisoned TLP", TLP),
+    AER_TYPE_PATTERN("] FCP", FCP),
+    AER_TYPE_PATTERN("] Flow Control Protocol", FCP),
+    AER_TYPE_PATTERN("] CmpltTO", CMPLT_TO),
+    AER_TYPE_PATTERN("] Completion Timeout", CMPLT_TO),
+    AER_TYPE_PATTERN("] CmpltAbrt", CMPLT_ABRT),
+    AER_TYPE_PATTERN("] Completer Abort", CMPLT_ABRT),
+    AER_TYPE_PATTERN("] UnxCmplt", UNX_CMPLT),
+    AER_TYPE_PATTERN("] Unexpected Completion", UNX_CMPLT),
+    AER_TYPE_PATTERN("] RxOF", RX_OF),
+    AER_TYPE_PATTERN("] Receiver Overflow", RX_OF),
+    AER_TYPE_PATTERN("] MalfTLP", MALF_TLP),
+    AER_TYPE_PATTERN("] Malformed TLP", MALF_TLP),
+    AER_TYPE_PATTERN("] ECRC", ECRC),
+    AER_TYPE_PATTERN("] UnsupReq", UNSUP_REQ),
+    AER_TYPE_PATTERN("] Unsupported Request", UNSUP_REQ),
+    AER_TYPE_PATTERN("] ACSViol", ACS_VIOL),
+    AER_TYPE_PATTERN("] ACS Violation", ACS_VIOL),
+};
+#define LOG_EVENT_PATTERN_COUNT (sizeof(logEventPatterns) / sizeof(logEventPatterns[0]))
+
+typedef struct {
+    char bus_ids[MAX_DEVICES][20]; // The index selects a bus's counters everywhere, "" for a free slot
+    unsigned int bus_count;        // Slots in use or freed, bus_ids past it are unused
+    uint8_t byte_class[256]; // 0 for bytes that occur in no pattern
+    unsigned int class_count;
+    uint32_t *next;          // Transitions, next[row + class] with row = state * class_count
+    LogMatch *matches;       // What reaching a state has matched, suffixes included
+    uint8_t *matching;       // Whether the state at a row matches anything, so most bytes skip the merge
+} LogClassifier;
+
+LogClassifier log_classifier;
+// Held for writing while a new bus id is added and the automaton rebuilt. Readers take
+// it once per block of lines or per read, not per line, so scanning threads share no
+// cache line while they classify.
+pthread_rwlock_t log_classifier_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Follows the syslog like tail -F and counts AER lines per GPU bus id, so each
+// cycle only parses what was appended since the last one
+typedef struct {
+    int fd; // -1 while the log is not open
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    LineCarry carry;
+    unsigned long long counts[MAX_DEVICES]; // Per log bus
+    unsigned long long scanned_generation; // snapshot_generation of the last scan, ~0 before the first
+    bool open_failed; // Reported once until the log is back
+} AerLogTracker;
+
+// Backfill of the log and its rotations (syslog.1, syslog.2.gz, ...), run on its own
+// thread the first time a GPU needs the syslog counts. Plain files are mapped and split
+// into chunks of whole lines, gzip archives are streamed whole, and the tasks are
+// spread over one thread per core. The tracker leaves the log alone until it is done.
+#define AER_BACKFILL_CHUNK_SIZE (32 * 1024 * 1024)
+#define AER_BACKFILL_GZIP_BUFFER (1024 * 1024)
+#define AER_BACKFILL_MAX_ROTATIONS 100
+
+typedef struct {
+    const char *data; // Mapped range of a plain file, NULL for a gzip archive
+    size_t length;
+    size_t mapped;    // Length of the mapping that starts at data, only set on a file's first chunk
+    char *path;       // gzip archive
+} AerBackfillTask;
+
+typedef struct {
+    AerBackfillTask *tasks;
+    unsigned int task_count;
+    atomic_uint next_task;
+    atomic_ullong gzip_bytes; // Decompressed size of the archives, for the throughput report
+    pthread_mutex_t lock;     // Guards merging the per-thread counts into counts
+    unsigned long long *counts; // Per log bus
+} AerBackfill;
+
+enum {
+    AER_BACKFILL_IDLE,
+    AER_BACKFILL_RUNNING,
+    AER_BACKFILL_DONE // Counts merged into aer_log, which follows the log from there
+};
+
+const char *syslog_path = SYSLOG_PATH;
+AerLogTracker aer_log = { .fd = -1, .scanned_generation = ~0ULL };
+pthread_mutex_t aer_log_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_int aer_backfill_state = AER_BACKFILL_IDLE;
+atomic_bool aer_backfill_resample = false; // A GPU was sampled while the backfill ran
+
+// The kernel's own AER counters of a GPU and its upstream port, opened once and
+// re-read with pread; the syslog is only scanned for GPUs without them
+typedef struct {
+    int fds[GPU_AER_PORT_COUNT][GPU_AER_SEVERITY_COUNT]; // -1 where the file does not exist
+    unsigned long long identity; // identity_generation the files were opened for, 0 if never
+} AerSysfsFiles;
+
+const char* const aerSysfsFileNames[GPU_AER_SEVERITY_COUNT] = {"aer_dev_correctable", "aer_dev_nonfatal", "aer_dev_fatal"};
+AerSysfsFiles aer_sysfs[MAX_DEVICES];
+const char *sysfs_root = "/sys";
+
+// Kernel log events per GPU bus id, counted by the kmsg reader thread as they are logged
+typedef struct {
+    int fd; // Owned by the reader thread
+    GpuKernelEvents events[MAX_DEVICES]; // Per log bus
+    double boot_seconds; // Wall clock time of boot, kmsg timestamps count from there
+    LineCarry carry;
+} KernelEventLog;
+
+const char *kmsg_path = KMSG_PATH;
+KernelEventLog kernel_events = { .fd = -1 };
+pthread_mutex_t kernel_events_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_bool kmsg_reader_running = false;
+
+// Binary copy of every rendered cycle in POSIX shared memory, NULL when disabled
+GpuSnapshot *shared_snapshot = NULL;
+_Static_assert(METRIC_FIELD_COUNT <= 32, "MetricsConfig.enabled holds one bit per metric");
+_Static_assert(MAX_DEVICES <= GPU_SNAPSHOT_MAX_DEVICES, "GpuSnapshot cannot hold MAX_DEVICES devices");
 
 void printPciInfo(const nvmlPciInfo_t *pciInfo);
 void printPciDev(const struct pci_dev *dev);
 void cleanup(int signal);
 void cleanup_sig_handler(void);
-void createMetricFile(int device_count, MetricsConfig* metricsConfig);
+void createMetricFile(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig);
+void writeMetricsFile(const char* body, size_t length);
+bool bufferReserve(OutputBuffer *buf, size_t extra);
+void bufferAppend(OutputBuffer *buf, const char *text, size_t length);
+void bufferAppendString(OutputBuffer *buf, const char *text);
+void bufferAppendUnsigned(OutputBuffer *buf, unsigned long long value);
+void bufferAppendFixed(OutputBuffer *buf, double value, unsigned int decimals);
+void bufferAppendHeader(OutputBuffer *buf, const char *name, const char *help, const char *type);
+void bufferAppendSample(OutputBuffer *buf, const char *name, const char *labels, unsigned long long value);
+void bufferAppendFixedSample(OutputBuffer *buf, const char *name, const char *labels, double value, unsigned int decimals);
+void bufferAppendPrefixedLabelSample(OutputBuffer *buf, unsigned int device, unsigned int slot, const char *label,
+                                     unsigned long long label_value, unsigned long long value);
+uint64_t fnv1aHash(const char *data, size_t length);
+bool openSharedSnapshot(const char* name);
+void writeSharedSnapshot(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig);
+void copyTempWindow(GpuSnapshotTempWindow *out, const TempWindow *window);
 int getGpuPciBusId(unsigned int index, char *pciBusId, unsigned int length);
-unsigned int getTotalAerErrorsForDevice(unsigned int gpuIndex);
+bool getTotalAerErrorsForDevice(unsigned int gpuIndex, unsigned int *count);
+int findLogBus(const char *bus_id);
+int logBusIndex(const char *bus_id);
+int freeLogBus(void);
+void rebuildLogBuses(void);
+bool buildLogClassifier(void);
+LogMatch classifyLogLine(const char *line, size_t length, size_t *xid_end);
+void aerLogScanLine(const char *line, size_t length);
+void aerLogDrain(void);
+bool aerLogOpen(void);
+void updateAerLogTracker(void);
+void aerScanLines(const char *data, size_t length, unsigned long long *counts);
+void aerScanBlock(const char *data, size_t length, unsigned long long *counts);
+bool aerBackfillAddTask(AerBackfill *backfill, AerBackfillTask task);
+bool aerBackfillAddFile(AerBackfill *backfill, int fd, size_t length);
+void aerBackfillGzip(AerBackfill *backfill, const char *path, char *buffer, unsigned long long *counts);
+void* aerBackfillWorker(void* arg);
+off_t backfillAerLog(int current_fd, unsigned long long *counts);
+void* aerBackfillThread(void* arg);
+bool startAerBackfill(void);
+void addGpuLogBuses(void);
+void splitLines(LineCarry *carry, const char *data, size_t length, LineHandler handler);
+bool parseDecimal(const char *text, const char *end, unsigned long long *value);
+void recordKernelEvent(GpuKernelEvents *events, unsigned int kind, double when);
+void kmsgClassifyLine(const char *line, size_t length);
+bool startKmsgReader(void);
+void* kmsgReader(void* arg);
+bool upstreamPortBusId(const char *bdf, char *port, size_t length);
+void openAerSysfsFiles(unsigned int i);
+bool readAerTotal(int fd, uint64_t *total);
 unsigned int checkGpuErrorState(unsigned int gpuIndex);
 bool initializeNvml(void);
+bool rebuildDeviceHandleCache(void);
+bool invalidateHandleCacheOnError(nvmlReturn_t result);
+uint64_t pciIndexKey(unsigned int domain, unsigned int bus, unsigned int dev, unsigned int func);
+size_t pciIndexSlot(uint64_t key, size_t mask);
+bool buildPciIndex(void);
+bool refreshPciIndex(uint64_t now_ms);
+struct pci_dev* lookupPciDevice(const nvmlPciInfo_t *pciInfo);
+void formatBusId(const struct pci_dev *dev, char *bdf, size_t length);
+const RegisterSource* findRegisterSource(const char *spec);
+void* mapRegisterPage(int bar_fd, off_t reg_offset, off_t *offset_in_page);
+bool mapRegisterWindow(RegisterWindow *win, const struct pci_dev *dev);
+void unmapRegisterWindow(RegisterWindow *win);
+void unmapAllRegisterWindows(void);
+uint32_t readRegister(const void *page, off_t offset);
+unsigned int decodeVramTemp(uint32_t value);
+bool decodeHotspotTemp(uint32_t value, unsigned int *temp);
+void recordTemp(TempWindow *window, unsigned int temp);
+unsigned int tempPercentile(const TempWindow *window, unsigned int percent);
+double tempSeriesValue(const TempWindow *window, unsigned int s);
+void writeTempAggregates(OutputBuffer *out, unsigned int device_count, unsigned int aggregate);
+unsigned long long metricValue(const DeviceData *device, unsigned int field);
+uint32_t unsupportedMetrics(const DeviceData *device, unsigned int i);
+void writeMetricFamily(OutputBuffer *out, const MetricsSnapshot *snapshot, unsigned int field);
+void refreshHostIdentity(void);
+bool buildLinePrefixes(const MetricsSnapshot* snapshot);
+void internLinePrefix(unsigned int device, unsigned int slot, const char *name, const char *labels);
+void bufferAppendPrefixedSample(OutputBuffer *buf, unsigned int device, unsigned int slot, unsigned long long value);
+void bufferAppendPrefixedFixed(OutputBuffer *buf, unsigned int device, unsigned int slot, double value, unsigned int decimals);
+void* registerSampler(void* arg);
 unsigned int countUpgradablePackages(void);
 void loadMetricsConfig(MetricsConfig* config);
+size_t metricLookupSlot(const char* name, uint64_t seed);
+bool buildMetricLookup(void);
+int findMetric(const char* name);
+unsigned int parseInterval(const char* text);
+void schedulePush(Schedule* schedule, ScheduleEntry entry);
+ScheduleEntry schedulePop(Schedule* schedule);
+unsigned long long advanceScheduleEntry(ScheduleEntry* entry, unsigned int interval, uint64_t now_ms);
+uint64_t monotonicMillis(void);
+void sleepUntilMillis(uint64_t deadline_ms);
 void printHelpMessage(void);
-void printConsoleOutput(MetricsConfig* metricsConfig);
+void printConsoleOutput(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig);
+DeviceData* beginSnapshot(void);
+void publishSnapshot(unsigned int device_count);
+void readSnapshot(MetricsSnapshot* out);
+void sampleDevice(unsigned int i, uint32_t due);
+void sampleRegisters(unsigned int i, uint32_t due);
+bool sampleFieldValues(unsigned int i, uint32_t due, bool* power_sampled);
+bool nvmlUnsupported(nvmlReturn_t result);
+unsigned long long fieldValueAsULL(const nvmlFieldValue_t* field);
+void* samplingWorker(void* arg);
+bool startWorkerPool(unsigned int worker_count);
+void markDeviceStale(DeviceData *slot, unsigned int i, unsigned int timeout_ms);
+void sampleAllDevices(DeviceData *slots, unsigned int device_count, uint32_t due, unsigned int timeout_ms);
+void monotonicDeadline(struct timespec *deadline, unsigned int timeout_ms);
+bool waitForIdleWorkers(unsigned int timeout_ms);
+bool rebuildHandleCacheWhenIdle(void);
+double monotonicSeconds(void);
 
 unsigned int countUpgradablePackages(void) {
     FILE *fp;
@@ -133,18 +695,7 @@ unsigned int countUpgradablePackages(void) {
 // Cleanup function to release resources
 void cleanup(int signal) {
     (void)signal; // Suppress unused parameter warning
-    if (map_base != MAP_FAILED) {
-        munmap(map_base, PG_SZ);
-        map_base = MAP_FAILED; // Reset to indicate it's unmapped
-    }
-    if (fd != -1) {
-        close(fd);
-        fd = -1; // Reset to indicate it's closed
-    }
-    if (metrics_file != NULL) {
-        fclose(metrics_file); // Close the metrics file if it's open
-        metrics_file = NULL; // Reset to indicate it's closed
-    }
+    // Register windows are left to _exit, taking register_lock here could deadlock
     _exit(0); // Use _exit to immediately terminate the program
 }
 
@@ -166,794 +717,2954 @@ void cleanup_sig_handler(void) {
         perror("Cannot handle SIGTERM");
 }
 
-// Function to load metrics configuration from metrics.ini
-void loadMetricsConfig(MetricsConfig* config) {
-    // Initialize all metrics to false
-    memset(config, 0, sizeof(MetricsConfig));
+uint64_t pciIndexKey(unsigned int domain, unsigned int bus, unsigned int dev, unsigned int func) {
+    return ((uint64_t)domain << 16) | (bus << 8) | (dev << 3) | func;
+}
 
-    FILE* fp = fopen("metrics.ini", "r");
-    if (fp == NULL) {
-        // metrics.ini does not exist, create it with default metrics
-        fp = fopen("metrics.ini", "w");
-        if (fp == NULL) {
-            fprintf(stderr, "Failed to create metrics.ini\n");
-            return;
-        }
-        fprintf(fp, "DCGM_FI_DEV_VRAM_TEMP\n");
-        fprintf(fp, "DCGM_FI_DEV_HOT_SPOT_TEMP\n");
-        fprintf(fp, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON\n");
-        fprintf(fp, "GPU_AER_TOTAL_ERRORS\n");
-        fprintf(fp, "GPU_AER_ERROR_STATE\n");
-        fclose(fp);
-        // Reopen for reading
-        fp = fopen("metrics.ini", "r");
-        if (fp == NULL) {
-            fprintf(stderr, "Failed to open metrics.ini for reading\n");
-            return;
-        }
-    }
+// Fibonacci hashing spreads the densely packed bus addresses over the table
+size_t pciIndexSlot(uint64_t key, size_t mask) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
 
-    char line[256];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        // Remove newline and whitespace
-        char* pos;
-        if ((pos = strchr(line, '\n')) != NULL) *pos = '\0';
+// Scan the PCI bus once and index every function by its address. The previous scan
+// is only freed once the new index is complete, a failed scan keeps it in place.
+// Callers make sure no worker still holds a pci_dev of the previous scan.
+bool buildPciIndex(void) {
+    struct pci_access *access = pci_alloc();
+    if (access == NULL) {
+        fprintf(stderr, "Failed to allocate PCI access\n");
+        return false;
+    }
+    pci_init(access);
+    pci_scan_bus(access);
 
-        // Trim leading and trailing whitespace
-        char* start = line;
-        while (*start && isspace(*start)) start++;
-        char* end = start + strlen(start) - 1;
-        while (end > start && isspace(*end)) *end-- = '\0';
+    // Keep the table at most half full so probe chains stay short
+    size_t function_count = 0;
+    for (struct pci_dev *dev = access->devices; dev; dev = dev->next) {
+        function_count++;
+    }
+    size_t size = 64;
+    while (size < function_count * 2) {
+        size *= 2;
+    }
+    PciIndexEntry *index = calloc(size, sizeof(PciIndexEntry));
+    if (index == NULL) {
+        fprintf(stderr, "Failed to allocate PCI index\n");
+        pci_cleanup(access);
+        return false;
+    }
+    size_t mask = size - 1;
+
+    for (struct pci_dev *dev = access->devices; dev; dev = dev->next) {
+        pci_fill_info(dev, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_CLASS);
+        uint64_t key = pciIndexKey(dev->domain, dev->bus, dev->dev, dev->func);
+        size_t slot = pciIndexSlot(key, mask);
+        while (index[slot].dev != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot].key = key;
+        index[slot].dev = dev;
+    }
 
-        // Set the corresponding metric to true
-        if (strcmp(start, "DCGM_FI_DEV_VRAM_TEMP") == 0) {
-            config->vram_temp = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_HOT_SPOT_TEMP") == 0) {
-            config->hotspot_temp = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON") == 0) {
-            config->clocks_throttle_reason = true;
-        } else if (strcmp(start, "GPU_AER_TOTAL_ERRORS") == 0) {
-            config->gpu_aer_total_errors = true;
-        } else if (strcmp(start, "GPU_AER_ERROR_STATE") == 0) {
-            config->gpu_aer_error_state = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_SM_CLOCK") == 0) {
-            config->sm_clock = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_MEM_CLOCK") == 0) {
-            config->mem_clock = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_GPU_TEMP") == 0) {
-            config->gpu_temp = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_POWER_USAGE") == 0) {
-            config->power_usage = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_FAN_SPEED") == 0) {
-            config->fan_speed = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_GPU_UTIL") == 0) {
-            config->gpu_util = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_MEM_COPY_UTIL") == 0) {
-            config->mem_util = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_FB_FREE") == 0) {
-            config->fb_free = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_FB_USED") == 0) {
-            config->fb_used = true;
-        } else if (strcmp(start, "DCGM_FI_DEV_NVLINK_BANDWIDTH_TOTAL") == 0) {
-            config->nvlink_bandwidth_total = true;
-        }
-        // Ignore unknown metrics
+    if (pacc != NULL) {
+        pci_cleanup(pacc);
     }
-    fclose(fp);
+    free(pci_index);
+    pacc = access;
+    pci_index = index;
+    pci_index_mask = mask;
+
+    // Windows stay mapped, they do not point into the scan and are remapped
+    // when their BAR moved or dropped by sampleRegisters when their GPU is gone
+    pci_index_valid = true;
+    return true;
 }
 
-// Function to create the metrics.txt file
-#define UUID_MAX_LEN (NVML_DEVICE_UUID_BUFFER_SIZE - 1) // 80 - 1 = 79
-#define NAME_MAX_LEN (NVML_DEVICE_NAME_BUFFER_SIZE - 1) // 64 - 1 = 63
-#define HOSTNAME_MAX_LEN 255
-#define DRIVER_VERSION_MAX_LEN (NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE - 1) // 81 - 1 = 80
-
-void createMetricFile(int device_count, MetricsConfig* metricsConfig){
-    metrics_file = fopen("metrics.tmp", "w");
-    if (!metrics_file) {
-        fprintf(stderr, "Failed to open metrics.tmp for writing\n");
-        return;
+// Rescan the bus after the handle cache was rebuilt, or with backoff while a GPU is missing.
+// A worker left behind by a timed out batch may still hold a pci_dev of the current scan,
+// so the rescan waits for the workers to go idle and is put off while one is stuck.
+bool refreshPciIndex(uint64_t now_ms) {
+    if (!pci_index_valid) {
+        if (!waitForIdleWorkers(WORKER_IDLE_TIMEOUT_MS)) {
+            return false;
+        }
+        pci_rescan_wanted = false;
+        pci_rescan_backoff_ms = PCI_RESCAN_MIN_BACKOFF_MS;
+        pci_rescan_due_ms = now_ms + pci_rescan_backoff_ms;
+        return buildPciIndex();
     }
-
-    // Get hostname and driver version
-    char hostname[256];
-    gethostname(hostname, sizeof(hostname));
-    hostname[sizeof(hostname) - 1] = '\0'; // Ensure null termination
-
-    char driver_version[NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE];
-    nvmlReturn_t result = nvmlSystemGetDriverVersion(driver_version, sizeof(driver_version));
-    if (result != NVML_SUCCESS) {
-        fprintf(stderr, "Failed to get driver version: %s\n", nvmlErrorString(result));
-        driver_version[0] = '\0';
+    if (now_ms < pci_rescan_due_ms) {
+        return true;
+    }
+    if (!pci_rescan_wanted) {
+        // Every GPU was found since the last rescan
+        pci_rescan_backoff_ms = PCI_RESCAN_MIN_BACKOFF_MS;
+        return true;
     }
-    driver_version[sizeof(driver_version) -1 ] = '\0'; // Ensure null termination
+    if (!waitForIdleWorkers(WORKER_IDLE_TIMEOUT_MS)) {
+        return true; // Keep the current index and try again next cycle
+    }
+    pci_rescan_wanted = false;
+    pci_rescan_due_ms = now_ms + pci_rescan_backoff_ms;
+    pci_rescan_backoff_ms = pci_rescan_backoff_ms * 2 < PCI_RESCAN_MAX_BACKOFF_MS ? pci_rescan_backoff_ms * 2 : PCI_RESCAN_MAX_BACKOFF_MS;
+    return buildPciIndex();
+}
 
-    // Iterate through devices and write metrics to the file
-    for (int i = 0; i < device_count; i++) {
-        // Include labels
-        char device_label[1024];
-        snprintf(device_label, sizeof(device_label),
-                    "{gpu=\"%d\",UUID=\"%.*s\",device=\"nvidia%d\",modelName=\"%.*s\",Hostname=\"%.*s\",DCGM_FI_DRIVER_VERSION=\"%.*s\"}",
-                    i,
-                    UUID_MAX_LEN, devices[i].uuid,
-                    i,
-                    NAME_MAX_LEN, devices[i].device_name,
-                    HOSTNAME_MAX_LEN, hostname,
-                    DRIVER_VERSION_MAX_LEN, driver_version);
-
-        // Write VRAM temperature
-        if (metricsConfig->vram_temp) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_VRAM_TEMP VRAM temperature (in C).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_VRAM_TEMP gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_VRAM_TEMP%s %u\n", device_label, devices[i].vram_temp);
-        }
-
-        // Write Hot Spot temperature
-        if (metricsConfig->hotspot_temp) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_HOT_SPOT_TEMP Hot Spot temperature (in C).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_HOT_SPOT_TEMP gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_HOT_SPOT_TEMP%s %u\n", device_label, devices[i].hotspot_temp);
-        }
-
-        // Write Clocks Throttle Reason
-        if (metricsConfig->clocks_throttle_reason) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_CLOCKS_THROTTLE_REASON Individual throttle reason for GPU clocks.\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_CLOCKS_THROTTLE_REASON gauge\n");
-
-            // Iterate through throttle reasons and write them to the file
-            for (size_t j = 0; j < sizeof(throttleReasons) / sizeof(throttleReasons[0]); j++) {
-                int isThrottling = (devices[i].clock_throttle_reasons & throttleReasons[j].reasonBit) ? 1 : 0;
-                fprintf(metrics_file, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON{reason=\"%s\", gpu=\"%d\", UUID=\"%s\"} %d\n",
-                    throttleReasons[j].reasonString, i, devices[i].uuid, isThrottling);
-            }
+// Find the PCI function backing an NVML device, or NULL if it is not indexed
+struct pci_dev* lookupPciDevice(const nvmlPciInfo_t *pciInfo) {
+    if (pci_index == NULL) {
+        return NULL;
+    }
+    uint64_t key = pciIndexKey(pciInfo->domain, pciInfo->bus, pciInfo->device, 0);
+    size_t slot = pciIndexSlot(key, pci_index_mask);
+    while (pci_index[slot].dev != NULL) {
+        if (pci_index[slot].key == key) {
+            struct pci_dev *dev = pci_index[slot].dev;
+            unsigned int combinedDeviceId = (dev->device_id << 16) | dev->vendor_id;
+            return combinedDeviceId == pciInfo->pciDeviceId ? dev : NULL;
         }
+        slot = (slot + 1) & pci_index_mask;
+    }
+    return NULL;
+}
 
-        // Write additional metrics as per metricsConfig
-        if (metricsConfig->sm_clock) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_SM_CLOCK SM clock frequency (in MHz).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_SM_CLOCK gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_SM_CLOCK%s %u\n", device_label, devices[i].sm_clock);
-        }
+void formatBusId(const struct pci_dev *dev, char *bdf, size_t length) {
+    snprintf(bdf, length, "%04x:%02x:%02x.%d", (unsigned int)dev->domain, dev->bus, dev->dev, dev->func);
+}
 
-        if (metricsConfig->mem_clock) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_MEM_CLOCK Memory clock frequency (in MHz).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_MEM_CLOCK gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_MEM_CLOCK%s %u\n", device_label, devices[i].mem_clock);
-        }
+int openDevMemBar0(const struct pci_dev *dev, off_t *bar0_offset) {
+    int bar_fd = open(MEM_PATH, O_RDONLY | O_SYNC);
+    if (bar_fd < 0) {
+        perror("Failed to open /dev/mem");
+        return -1;
+    }
+    // Keep all 64 bits, Resizable BAR places BAR0 above 4 GB on some servers
+    *bar0_offset = dev->base_addr[0] & PCI_ADDR_MEM_MASK;
+    return bar_fd;
+}
 
-        if (metricsConfig->gpu_temp) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_GPU_TEMP GPU temperature (in C).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_GPU_TEMP gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_GPU_TEMP%s %u\n", device_label, devices[i].gpu_temp);
-        }
+int openSysfsBar0(const struct pci_dev *dev, off_t *bar0_offset) {
+    char bdf[32];
+    char path[4096];
+    formatBusId(dev, bdf, sizeof(bdf));
+    snprintf(path, sizeof(path), "%s/" SYSFS_PCI_DEVICES_PATH "/%s/resource0", sysfs_root, bdf);
 
-        if (metricsConfig->power_usage) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_POWER_USAGE Power draw (in W).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_POWER_USAGE gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_POWER_USAGE%s %.6f\n", device_label, devices[i].power_usage / 1000.0);
-        }
+    int bar_fd = open(path, O_RDONLY | O_SYNC);
+    if (bar_fd < 0) {
+        return -1;
+    }
+    *bar0_offset = 0;
+    return bar_fd;
+}
 
-        if (metricsConfig->fan_speed) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_FAN_SPEED Fan speed for the device.\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_FAN_SPEED gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_FAN_SPEED%s %u\n", device_label, devices[i].fan_speed);
-        }
+int openFileBar0(const struct pci_dev *dev, off_t *bar0_offset) {
+    char bdf[32];
+    char path[4096];
+    formatBusId(dev, bdf, sizeof(bdf));
+    snprintf(path, sizeof(path), "%s/%s", register_file_dir, bdf);
 
-        if (metricsConfig->gpu_util) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_GPU_UTIL GPU utilization (in %%).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_GPU_UTIL gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_GPU_UTIL%s %u\n", device_label, devices[i].gpu_util);
-        }
+    int bar_fd = open(path, O_RDONLY);
+    if (bar_fd < 0) {
+        fprintf(stderr, "Failed to open register file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Touching a mapped page past the end of a regular file raises SIGBUS
+    struct stat st;
+    if (fstat(bar_fd, &st) != 0 || st.st_size < HOTSPOT_REGISTER_OFFSET + (off_t)sizeof(uint32_t)) {
+        fprintf(stderr, "Register file %s is too small to hold BAR0 registers\n", path);
+        close(bar_fd);
+        return -1;
+    }
+    *bar0_offset = 0;
+    return bar_fd;
+}
 
-        if (metricsConfig->mem_util) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_MEM_COPY_UTIL Memory utilization (in %%).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_MEM_COPY_UTIL gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_MEM_COPY_UTIL%s %u\n", device_label, devices[i].mem_util);
+// Parse --register-backend, NULL means auto
+const RegisterSource* findRegisterSource(const char *spec) {
+    if (strncmp(spec, "file:", 5) == 0) {
+        register_file_dir = spec + 5;
+        return &registerSources[2];
+    }
+    for (size_t s = 0; s < sizeof(registerSources) / sizeof(registerSources[0]); s++) {
+        if (strcmp(spec, registerSources[s].name) == 0 && strcmp(spec, "file") != 0) {
+            return &registerSources[s];
         }
+    }
+    return NULL;
+}
 
-        if (metricsConfig->fb_free) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_FB_FREE Frame buffer memory free (in MB).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_FB_FREE gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_FB_FREE%s %llu\n", device_label, devices[i].fb_free);
-        }
+// Map one read-only page of BAR0 around the given register offset
+void* mapRegisterPage(int bar_fd, off_t reg_offset, off_t *offset_in_page) {
+    off_t page_base = reg_offset & ~(off_t)(PG_SZ - 1);
+    void *page = mmap(0, PG_SZ, PROT_READ, MAP_SHARED, bar_fd, page_base);
+    if (page == MAP_FAILED) {
+        return NULL;
+    }
+    *offset_in_page = reg_offset - page_base;
+    return page;
+}
 
-        if (metricsConfig->fb_used) {
-            fprintf(metrics_file, "# HELP DCGM_FI_DEV_FB_USED Frame buffer memory used (in MB).\n");
-            fprintf(metrics_file, "# TYPE DCGM_FI_DEV_FB_USED gauge\n");
-            fprintf(metrics_file, "DCGM_FI_DEV_FB_USED%s %llu\n", device_label, devices[i].fb_used);
-        }
+// Make sure the device's register window matches the current BAR0 address. Called with
+// register_lock held, which the caller keeps while it reads the pages.
+bool mapRegisterWindow(RegisterWindow *win, const struct pci_dev *dev) {
+    pciaddr_t bar0 = dev->base_addr[0] & PCI_ADDR_MEM_MASK;
+    if (win->vram_page && win->hotspot_page && win->bar0 == bar0) {
+        return true; // Still valid, nothing to do
+    }
 
-        if (metricsConfig->gpu_aer_total_errors) {
-            unsigned int total_aer_errors = getTotalAerErrorsForDevice(i);
-            // Write metrics to file
-            fprintf(metrics_file, "# HELP GPU_AER_TOTAL_ERRORS Total AER errors for GPU.\n");
-            fprintf(metrics_file, "# TYPE GPU_AER_TOTAL_ERRORS counter\n");
-            fprintf(metrics_file, "GPU_AER_TOTAL_ERRORS{gpu=\"%d\", UUID=\"%s\"} %u\n", i, devices[i].uuid, total_aer_errors);
-        }
+    unmapRegisterWindow(win);
 
-        if (metricsConfig->gpu_aer_error_state) {
-            unsigned int error_state = checkGpuErrorState(i);
-            fprintf(metrics_file, "# HELP GPU_AER_ERROR_STATE Current error state for GPU (1 for error, 0 for no error).\n");
-            fprintf(metrics_file, "# TYPE GPU_AER_ERROR_STATE gauge\n");
-            fprintf(metrics_file, "GPU_ERROR_STATE{gpu=\"%d\", UUID=\"%s\"} %d\n", i, devices[i].uuid, error_state);
+    off_t bar0_offset = 0;
+    if (register_source != NULL) {
+        win->source = register_source;
+        win->fd = register_source->open_bar0(dev, &bar0_offset);
+    } else {
+        win->source = &registerSources[1];
+        win->fd = openSysfsBar0(dev, &bar0_offset);
+        if (win->fd < 0) {
+            win->source = &registerSources[0];
+            win->fd = openDevMemBar0(dev, &bar0_offset);
         }
+    }
 
-        // Implement other metrics as needed
+    bool mapped = false;
+    if (win->fd < 0) {
+        // The backend already reported why
+    } else if ((win->vram_page = mapRegisterPage(win->fd, bar0_offset + VRAM_REGISTER_OFFSET, &win->vram_offset)) == NULL) {
+        fprintf(stderr, "Failed to map BAR0 memory via %s: %s\n", win->source->name, strerror(errno));
+        unmapRegisterWindow(win);
+    } else if ((win->hotspot_page = mapRegisterPage(win->fd, bar0_offset + HOTSPOT_REGISTER_OFFSET, &win->hotspot_offset)) == NULL) {
+        fprintf(stderr, "Failed to mmap for hot spot temperature via %s: %s\n", win->source->name, strerror(errno));
+        unmapRegisterWindow(win);
+    } else {
+        win->bar0 = bar0;
+        mapped = true;
     }
+    return mapped;
+}
 
-    // Inside createMetricFile or main loop
-    unsigned int upgradablePackages = countUpgradablePackages();
-    fprintf(metrics_file, "# HELP APT_UPGRADABLE_PACKAGES Number of APT packages that can be upgraded.\n");
-    fprintf(metrics_file, "# TYPE APT_UPGRADABLE_PACKAGES gauge\n");
-    fprintf(metrics_file, "APT_UPGRADABLE_PACKAGES %u\n", upgradablePackages);
+void unmapRegisterWindow(RegisterWindow *win) {
+    if (win->vram_page) {
+        munmap(win->vram_page, PG_SZ);
+    }
+    if (win->hotspot_page) {
+        munmap(win->hotspot_page, PG_SZ);
+    }
+    if (win->source != NULL && win->fd >= 0) {
+        close(win->fd);
+    }
+    memset(win, 0, sizeof(*win));
+    win->fd = -1;
+}
 
-    fflush(metrics_file);
-    fclose(metrics_file);
-    metrics_file = NULL;
-    rename("metrics.tmp", "metrics.txt");
+void unmapAllRegisterWindows(void) {
+    pthread_mutex_lock(&register_lock);
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        unmapRegisterWindow(&register_windows[i]);
+    }
+    pthread_mutex_unlock(&register_lock);
 }
 
-// Utility function to get the PCI bus ID as a string for a given GPU index
-int getGpuPciBusId(unsigned int index, char *pciBusId, unsigned int length) {
-    nvmlDevice_t device;
-    nvmlReturn_t result = nvmlDeviceGetHandleByIndex(index, &device);
-    if (result != NVML_SUCCESS) return -1;
+// Single MMIO load from a mapped register page
+uint32_t readRegister(const void *page, off_t offset) {
+    return *(const volatile uint32_t *)((const char *)page + offset);
+}
 
-    nvmlPciInfo_t pci;
-    result = nvmlDeviceGetPciInfo(device, &pci);
-    if (result != NVML_SUCCESS) return -1;
+unsigned int decodeVramTemp(uint32_t value) {
+    return (value & 0x00000fff) / 0x20;
+}
 
-    snprintf(pciBusId, length, "%04x:%02x:%02x.0", pci.domain, pci.bus, pci.device);
-    return 0;
+// Returns false for readings outside the sensor range
+bool decodeHotspotTemp(uint32_t value, unsigned int *temp) {
+    uint32_t hotSpotTemp = (value >> 8) & 0xff;
+    if (hotSpotTemp >= 0x7f) {
+        return false;
+    }
+    *temp = hotSpotTemp;
+    return true;
 }
 
-// Function to count AER errors from /var/log/syslog for a specific GPU
-unsigned int getTotalAerErrorsForDevice(unsigned int gpuIndex) {
-    char pciBusId[20];
-    if (getGpuPciBusId(gpuIndex, pciBusId, sizeof(pciBusId)) != 0) {
-        fprintf(stderr, "Failed to get PCI bus ID for GPU %u\n", gpuIndex);
-        return 0;
+void recordTemp(TempWindow *window, unsigned int temp) {
+    if (temp >= TEMP_HISTOGRAM_BINS) {
+        temp = TEMP_HISTOGRAM_BINS - 1;
     }
+    if (window->count == 0 || temp < window->min) {
+        window->min = temp;
+    }
+    if (window->count == 0 || temp > window->max) {
+        window->max = temp;
+    }
+    window->count++;
+    window->sum += temp;
+    window->histogram[temp]++;
+}
 
-    FILE *logFile = fopen("/var/log/syslog", "r");
-    if (!logFile) {
-        perror("Failed to open /var/log/syslog");
-        return 0;
+// Smallest temperature that at least percent% of the samples do not exceed
+unsigned int tempPercentile(const TempWindow *window, unsigned int percent) {
+    uint64_t rank = ((uint64_t)window->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (unsigned int t = 0; t < TEMP_HISTOGRAM_BINS; t++) {
+        seen += window->histogram[t];
+        if (seen >= rank) {
+            return t;
+        }
     }
+    return window->max;
+}
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    unsigned int aerErrorCount = 0;
+// Value of series s (see tempSeries) of one window
+double tempSeriesValue(const TempWindow *window, unsigned int s) {
+    switch (s) {
+        case 0: return window->min;
+        case 1: return window->max;
+        case 2: return (double)window->sum / window->count;
+        case 3: return tempPercentile(window, 95);
+        default: return tempPercentile(window, 99);
+    }
+}
 
-    while ((read = getline(&line, &len, logFile)) != -1) {
-        if (strstr(line, "AER") && strstr(line, pciBusId)) {
-            aerErrorCount++;
+// Appends the _min/_max/_avg/_p95/_p99 families of every device, aggregate 0 is VRAM and 1 hot spot.
+// Devices without samples in this window are left out, and so is a family no device has samples for.
+void writeTempAggregates(OutputBuffer *out, unsigned int device_count, unsigned int aggregate) {
+    const TempWindow *windows[MAX_DEVICES];
+    bool any = false;
+    for (unsigned int i = 0; i < device_count; i++) {
+        windows[i] = aggregate == 0 ? &rendered_aggregates[i].vram : &rendered_aggregates[i].hotspot;
+        any = any || windows[i]->count > 0;
+    }
+    if (!any) {
+        return;
+    }
+    for (unsigned int s = 0; s < TEMP_SERIES_COUNT; s++) {
+        bufferAppendHeader(out, aggregate_names[aggregate][s], tempSeries[s].help, "gauge");
+        for (unsigned int i = 0; i < device_count; i++) {
+            if (windows[i]->count > 0) {
+                bufferAppendPrefixedFixed(out, i, PREFIX_AGGREGATES + aggregate * TEMP_SERIES_COUNT + s, tempSeriesValue(windows[i], s), tempSeries[s].decimals);
+            }
         }
     }
+}
+
+// Reads the temperature registers of every mapped device at register_sampler_hz
+void* registerSampler(void* arg) {
+    const MetricsConfig *metricsConfig = arg;
+    long period_ns = 1000000000L / register_sampler_hz;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 
-    free(line);
-    fclose(logFile);
+        pthread_mutex_lock(&register_lock);
+        for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+            const RegisterWindow *win = &register_windows[i];
+            if (win->vram_page == NULL) {
+                continue;
+            }
+            if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_VRAM_TEMP)) {
+                recordTemp(&register_aggregates[i].vram, decodeVramTemp(readRegister(win->vram_page, win->vram_offset)));
+            }
+            unsigned int hotspot;
+            if ((metricsConfig->enabled & METRIC_BIT(GPU_METRIC_HOT_SPOT_TEMP)) && decodeHotspotTemp(readRegister(win->hotspot_page, win->hotspot_offset), &hotspot)) {
+                recordTemp(&register_aggregates[i].hotspot, hotspot);
+            }
+        }
+        pthread_mutex_unlock(&register_lock);
+    }
+    return NULL;
+}
 
-    return aerErrorCount;
+size_t metricLookupSlot(const char* name, uint64_t seed) {
+    return (size_t)(((fnv1aHash(name, strlen(name)) ^ seed) * 0x9E3779B97F4A7C15ULL) >> (64 - METRIC_LOOKUP_BITS));
 }
 
-// Function to initialize NVML, to be called before any other NVML operations
-bool initializeNvml(void) {
-    nvmlReturn_t result = nvmlInit();
-    if (result == NVML_SUCCESS) {
-        return true; // Initialization successful
-    } else {
-        fprintf(stderr, "Failed to initialize NVML: %s\n", nvmlErrorString(result));
-        return false; // Initialization failed
+// Find a seed that puts every metric name in its own slot
+bool buildMetricLookup(void) {
+    for (uint64_t seed = 0; seed < 100000; seed++) {
+        memset(metric_lookup, -1, sizeof(metric_lookup));
+        bool collision = false;
+        for (unsigned int f = 0; f < METRIC_FIELD_COUNT && !collision; f++) {
+            size_t slot = metricLookupSlot(metricRegistry[f].name, seed);
+            collision = metric_lookup[slot] >= 0;
+            metric_lookup[slot] = (int8_t)f;
+        }
+        if (!collision) {
+            metric_lookup_seed = seed;
+            return true;
+        }
     }
+    return false;
 }
 
-// Function to check if there's an error state for a given GPU
-unsigned int checkGpuErrorState(unsigned int gpuIndex) {
-    nvmlDevice_t device;
-    unsigned int fanSpeed;
-    nvmlReturn_t result;
+// Index of a metric in metricRegistry, -1 for unknown names
+int findMetric(const char* name) {
+    if (!metric_lookup_built) {
+        if (!buildMetricLookup()) {
+            fprintf(stderr, "Failed to build the metric name lookup\n");
+            return -1;
+        }
+        metric_lookup_built = true;
+    }
+    int field = metric_lookup[metricLookupSlot(name, metric_lookup_seed)];
+    return field >= 0 && strcmp(name, metricRegistry[field].name) == 0 ? field : -1;
+}
 
-    // Attempt to get handle for the specified GPU
-    result = nvmlDeviceGetHandleByIndex(gpuIndex, &device);
-    if (result != NVML_SUCCESS) {
-        fprintf(stderr, "Failed to get handle for GPU %u: %s\n", gpuIndex, nvmlErrorString(result));
-        return 2; // Error state
+// Parse an interval such as "250ms", "60s" or "5m" (plain numbers are seconds), 0 if invalid
+unsigned int parseInterval(const char* text) {
+    char* unit;
+    unsigned long value = strtoul(text, &unit, 10);
+    if (unit == text) {
+        return 0;
+    }
+    if (strcmp(unit, "ms") == 0) {
+        return value;
+    } else if (strcmp(unit, "s") == 0 || *unit == '\0') {
+        return value * 1000;
+    } else if (strcmp(unit, "m") == 0) {
+        return value * 60 * 1000;
     }
+    return 0;
+}
 
-    // Attempt to get the fan speed for the GPU
-    result = nvmlDeviceGetFanSpeed(device, &fanSpeed);
-    if (result != NVML_SUCCESS) {
-        fprintf(stderr, "Failed to get fan speed for GPU %u: %s\n", gpuIndex, nvmlErrorString(result));
-        return 2; // Error state
+void schedulePush(Schedule* schedule, ScheduleEntry entry) {
+    unsigned int i = schedule->size++;
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+        if (schedule->entries[parent].due_ms <= entry.due_ms) {
+            break;
+        }
+        schedule->entries[i] = schedule->entries[parent];
+        i = parent;
     }
+    schedule->entries[i] = entry;
+}
 
-    return 1; // No error state
+ScheduleEntry schedulePop(Schedule* schedule) {
+    ScheduleEntry top = schedule->entries[0];
+    ScheduleEntry last = schedule->entries[--schedule->size];
+    unsigned int i = 0;
+    while (1) {
+        unsigned int child = 2 * i + 1;
+        if (child >= schedule->size) {
+            break;
+        }
+        if (child + 1 < schedule->size && schedule->entries[child + 1].due_ms < schedule->entries[child].due_ms) {
+            child++;
+        }
+        if (last.due_ms <= schedule->entries[child].due_ms) {
+            break;
+        }
+        schedule->entries[i] = schedule->entries[child];
+        i = child;
+    }
+    schedule->entries[i] = last;
+    return top;
 }
 
-// Function to print the help message
-void printHelpMessage(void) {
-    printf("Usage: nvml_direct_access [options]\n");
-    printf("Options:\n");
-    printf("  --help, -h      Show this help message and exit\n");
-    printf("  --no-console    Disable console output of GPU metrics\n");
-    printf("\n");
-    printf("Available metrics that can be added to metrics.ini:\n");
-    printf("  DCGM_FI_DEV_VRAM_TEMP\n");
-    printf("  DCGM_FI_DEV_HOT_SPOT_TEMP\n");
-    printf("  DCGM_FI_DEV_CLOCKS_THROTTLE_REASON\n");
-    printf("  GPU_AER_TOTAL_ERRORS\n");
-    printf("  GPU_AER_ERROR_STATE\n");
-    printf("  DCGM_FI_DEV_SM_CLOCK\n");
-    printf("  DCGM_FI_DEV_MEM_CLOCK\n");
-    printf("  DCGM_FI_DEV_GPU_TEMP\n");
-    printf("  DCGM_FI_DEV_POWER_USAGE\n");
-    printf("  DCGM_FI_DEV_FAN_SPEED\n");
-    printf("  DCGM_FI_DEV_GPU_UTIL\n");
-    printf("  DCGM_FI_DEV_MEM_COPY_UTIL\n");
-    printf("  DCGM_FI_DEV_FB_FREE\n");
-    printf("  DCGM_FI_DEV_FB_USED\n");
-    printf("  DCGM_FI_DEV_NVLINK_BANDWIDTH_TOTAL\n");
-    printf("\n");
-    printf("Add any of the above metrics to the metrics.ini file to enable them.\n");
-    printf("\n");
-    printf("Example of console output when not disabled:\n");
-    printf("GPU Name: NVIDIA RTX A6000 GPU 0: Temperature: 30 C Power Usage: 28.38 W VRAM Temp: 54 C HotSpotTemp: 38 C Fan: 10%% Core Utilization: 1%%\n");
+// Move a popped entry to its next deadline and return how many deadlines it missed.
+// It advances from the deadline, not from now, so the period does not drift, and
+// deadlines that already passed are skipped instead of queued. One that falls exactly
+// on now is on time, it stays due and is collected again in this cycle.
+unsigned long long advanceScheduleEntry(ScheduleEntry* entry, unsigned int interval, uint64_t now_ms) {
+    entry->due_ms += interval;
+    if (entry->due_ms >= now_ms) {
+        return 0;
+    }
+    uint64_t missed = (now_ms - entry->due_ms - 1) / interval + 1;
+    entry->due_ms += missed * interval;
+    return missed;
 }
 
-int main(int argc, char* argv[]) {
-    // Default is to print to console
-    bool console_output = true;
+// Function to load metrics configuration from metrics.ini
+void loadMetricsConfig(MetricsConfig* config) {
+    // Initialize all metrics to false
+    memset(config, 0, sizeof(MetricsConfig));
+    for (unsigned int f = 0; f < METRIC_FIELD_COUNT; f++) {
+        config->interval_ms[f] = DEFAULT_INTERVAL_MS;
+    }
+    // Host metrics are always exported, listing them in metrics.ini only changes their interval
+    config->enabled = host_metrics;
 
-    // Check for command-line arguments
-    for (int argi = 1; argi < argc; argi++) {
-        if (strcmp(argv[argi], "--help") == 0 || strcmp(argv[argi], "-h") == 0) {
-            printHelpMessage();
-            return 0;
-        } else if (strcmp(argv[argi], "--no-console") == 0) {
-            console_output = false;
+    FILE* fp = fopen("metrics.ini", "r");
+    if (fp == NULL) {
+        // metrics.ini does not exist, create it with default metrics
+        fp = fopen("metrics.ini", "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to create metrics.ini\n");
+            return;
+        }
+        fprintf(fp, "DCGM_FI_DEV_VRAM_TEMP\n");
+        fprintf(fp, "DCGM_FI_DEV_HOT_SPOT_TEMP\n");
+        fprintf(fp, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON\n");
+        fprintf(fp, "GPU_AER_TOTAL_ERRORS\n");
+        fprintf(fp, "GPU_AER_ERROR_STATE\n");
+        fclose(fp);
+        // Reopen for reading
+        fp = fopen("metrics.ini", "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to open metrics.ini for reading\n");
+            return;
+        }
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        // Remove newline and whitespace
+        char* pos;
+        if ((pos = strchr(line, '\n')) != NULL) *pos = '\0';
+
+        // Trim leading and trailing whitespace
+        char* start = line;
+        while (*start && isspace(*start)) start++;
+        char* end = start + strlen(start) - 1;
+        while (end > start && isspace(*end)) *end-- = '\0';
+
+        // Skip blank lines and comments, such as the opt-in metrics of the shipped file
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+
+        // Split "NAME [interval]", e.g. "DCGM_FI_DEV_VRAM_TEMP 250ms"
+        char* interval = start;
+        while (*interval && !isspace(*interval)) interval++;
+        if (*interval) {
+            *interval++ = '\0';
+            while (*interval && isspace(*interval)) interval++;
+        }
+
+        // Set the corresponding metric to true, unknown metrics are ignored
+        int f = findMetric(start);
+        if (f < 0) {
+            continue;
+        }
+        config->enabled |= METRIC_BIT(f);
+        if (*interval) {
+            unsigned int interval_ms = parseInterval(interval);
+            if (interval_ms > 0) {
+                config->interval_ms[f] = interval_ms;
+            } else {
+                fprintf(stderr, "Invalid interval '%s' for %s, using %d ms\n", interval, start, DEFAULT_INTERVAL_MS);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+// Value of a metric as stored in the snapshot, HOST metrics ignore the device
+#define METRIC_VALUE_REGISTER(member, format) device->member
+#define METRIC_VALUE_DEVICE(member, format) METRIC_SCALAR_##format(device->member)
+#define METRIC_VALUE_HOST(member, format) upgradable_packages
+// Members that are not a single number are rendered from the member itself
+#define METRIC_SCALAR_INTEGER(value) value
+#define METRIC_SCALAR_MILLI(value) value
+#define METRIC_SCALAR_REASONS(value) value
+#define METRIC_SCALAR_AER_COUNTERS(value) 0
+#define METRIC_SCALAR_KERNEL_EVENTS(value) 0
+#define METRIC_SCALAR_KERNEL_EVENT_TIMES(value) 0
+#define METRIC_SCALAR_XID_COUNTERS(value) 0
+#define METRIC_SCALAR_AER_TYPE_COUNTERS(value) 0
+
+unsigned long long metricValue(const DeviceData *device, unsigned int field) {
+    switch (field) {
+#define METRIC_VALUE_CASE(id, name, help, type, member, format, sampler, tier) \
+        case GPU_METRIC_##id: return METRIC_VALUE_##tier(member, format);
+        GPU_METRIC_LIST(METRIC_VALUE_CASE)
+#undef METRIC_VALUE_CASE
+        default: return 0;
+    }
+}
+
+// Metrics device i has no sample for: NVLink on GPUs without it, the sysfs
+// AER counters on kernels without them, the syslog AER count until its backfill
+// finished, kernel log events without the kmsg reader
+uint32_t unsupportedMetrics(const DeviceData *device, unsigned int i) {
+    uint32_t unsupported = 0;
+    if (device->aer_total_pending) {
+        unsupported |= METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS);
+    }
+    if (i < cached_device_count && device_handles[i].nvlink_field_unsupported) {
+        unsupported |= METRIC_BIT(GPU_METRIC_NVLINK_BANDWIDTH_TOTAL);
+    }
+    if (device->aer_dev.ports == 0) {
+        unsupported |= METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS);
+    }
+    if (!kmsg_reader_running) {
+        unsupported |= kernel_event_metrics;
+    }
+    return unsupported;
+}
+
+// One HELP/TYPE pair followed by the family's samples: a single unlabelled one
+// for HOST metrics, otherwise one per device that has the metric
+void writeMetricFamily(OutputBuffer *out, const MetricsSnapshot *snapshot, unsigned int field) {
+    const MetricDescriptor *metric = &metricRegistry[field];
+    if (metric->tier == GPU_METRIC_TIER_HOST) {
+        bufferAppendHeader(out, metric->name, metric->help, metric->type);
+        bufferAppendSample(out, metric->name, "", metricValue(NULL, field));
+        return;
+    }
+
+    bool header_written = false;
+    for (unsigned int i = 0; i < snapshot->device_count; i++) {
+        const DeviceData *device = &snapshot->devices[i];
+        if (unsupportedMetrics(device, i) & METRIC_BIT(field)) {
+            continue;
+        }
+        if (!header_written) {
+            bufferAppendHeader(out, metric->name, metric->help, metric->type);
+            header_written = true;
+        }
+        unsigned long long value = metricValue(device, field);
+        switch (metric->format) {
+            case GPU_METRIC_FORMAT_MILLI:
+                bufferAppendPrefixedFixed(out, i, field, value / 1000.0, 6);
+                break;
+            case GPU_METRIC_FORMAT_REASONS:
+                for (size_t j = 0; j < THROTTLE_REASON_COUNT; j++) {
+                    bufferAppendPrefixedSample(out, i, PREFIX_THROTTLE + j, (value & throttleReasons[j].reasonBit) ? 1 : 0);
+                }
+                break;
+            case GPU_METRIC_FORMAT_AER_COUNTERS:
+                for (unsigned int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+                    if (!(device->aer_dev.ports & (1u << port))) {
+                        continue;
+                    }
+                    for (unsigned int severity = 0; severity < GPU_AER_SEVERITY_COUNT; severity++) {
+                        bufferAppendPrefixedSample(out, i, PREFIX_AER_DEV + port * GPU_AER_SEVERITY_COUNT + severity, device->aer_dev.errors[port][severity]);
+                    }
+                }
+                break;
+            case GPU_METRIC_FORMAT_KERNEL_EVENTS:
+                for (unsigned int kind = 0; kind < GPU_KERNEL_EVENT_COUNT; kind++) {
+                    bufferAppendPrefixedSample(out, i, PREFIX_KERNEL_EVENTS + kind, device->kernel_events.counts[kind]);
+                }
+                break;
+            case GPU_METRIC_FORMAT_KERNEL_EVENT_TIMES:
+                for (unsigned int kind = 0; kind < GPU_KERNEL_EVENT_COUNT; kind++) {
+                    bufferAppendPrefixedFixed(out, i, PREFIX_KERNEL_EVENT_TIMES + kind, device->kernel_events.last_seconds[kind], 6);
+                }
+                break;
+            case GPU_METRIC_FORMAT_XID_COUNTERS:
+                for (unsigned int code = 0; code < GPU_XID_CODE_COUNT; code++) {
+                    if (device->kernel_events.xid_counts[code] > 0) {
+                        bufferAppendPrefixedLabelSample(out, i, field, "xid", code, device->kernel_events.xid_counts[code]);
+                    }
+                }
+                break;
+            case GPU_METRIC_FORMAT_AER_TYPE_COUNTERS:
+                for (unsigned int type = 0; type < GPU_AER_TYPE_COUNT; type++) {
+                    if (device->kernel_events.aer_type_counts[type] > 0) {
+                        bufferAppendPrefixedSample(out, i, PREFIX_AER_TYPES + type, device->kernel_events.aer_type_counts[type]);
+                    }
+                }
+                break;
+            default:
+                bufferAppendPrefixedSample(out, i, field, value);
+                break;
+        }
+    }
+
+    if (metric->tier == GPU_METRIC_TIER_REGISTER && register_sampler_hz > 0) {
+        writeTempAggregates(out, snapshot->device_count, field == GPU_METRIC_VRAM_TEMP ? 0 : 1);
+    }
+}
+
+// Function to create the metrics.txt file
+#define UUID_MAX_LEN (NVML_DEVICE_UUID_BUFFER_SIZE - 1) // 80 - 1 = 79
+#define NAME_MAX_LEN (NVML_DEVICE_NAME_BUFFER_SIZE - 1) // 64 - 1 = 63
+#define HOSTNAME_MAX_LEN 255
+#define DRIVER_VERSION_MAX_LEN (NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE - 1) // 81 - 1 = 80
+
+void createMetricFile(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig){
+    // Render into memory first, the same text goes to metrics.txt and the HTTP listener
+    OutputBuffer *out = &metrics_buffer;
+    out->length = 0;
+    out->failed = false;
+
+    // Labels only change with the device or host identity
+    if (line_prefixes_identity != snapshot->identity || line_prefixes_device_count != snapshot->device_count) {
+        if (!buildLinePrefixes(snapshot)) {
+            fprintf(stderr, "Failed to allocate the label cache\n");
+            return;
+        }
+    }
+
+    // Take the high-rate sample windows and start new ones
+    if (register_sampler_hz > 0) {
+        pthread_mutex_lock(&register_lock);
+        memcpy(rendered_aggregates, register_aggregates, sizeof(rendered_aggregates));
+        memset(register_aggregates, 0, sizeof(register_aggregates));
+        pthread_mutex_unlock(&register_lock);
+    }
+
+    if (shared_snapshot != NULL) {
+        writeSharedSnapshot(snapshot, metricsConfig);
+    }
+
+    // Family-major: each HELP/TYPE pair is written once, followed by the samples of every device.
+    // Only the enabled metrics are walked.
+    for (uint32_t pending = metricsConfig->enabled; pending != 0; pending &= pending - 1) {
+        writeMetricFamily(out, snapshot, __builtin_ctz(pending));
+    }
+
+    bufferAppendHeader(out, "collector_nvml_handle_cache_rebuilds_total", "Number of times the NVML session and device handle cache were rebuilt.", "counter");
+    bufferAppendSample(out, "collector_nvml_handle_cache_rebuilds_total", "", handle_cache_rebuilds);
+
+    bufferAppendHeader(out, "collector_sample_duration_seconds", "Time taken to sample all devices in the last cycle.", "gauge");
+    bufferAppendFixedSample(out, "collector_sample_duration_seconds", "", last_sample_duration, 6);
+
+    bufferAppendHeader(out, "collector_cycle_duration_seconds", "Time taken by the previous collection cycle, from wakeup to metrics written.", "gauge");
+    bufferAppendFixedSample(out, "collector_cycle_duration_seconds", "", last_cycle_duration, 6);
+
+    bufferAppendHeader(out, "collector_cycle_lag_seconds", "How late the current cycle woke up relative to its deadline.", "gauge");
+    bufferAppendFixedSample(out, "collector_cycle_lag_seconds", "", last_cycle_lag, 6);
+
+    bufferAppendHeader(out, "collector_missed_deadlines_total", "Sampling deadlines skipped because the collector was still busy.", "counter");
+    bufferAppendSample(out, "collector_missed_deadlines_total", "", missed_deadlines);
+
+    bufferAppendHeader(out, "collector_device_stale", "1 if the GPU did not finish sampling in time and its values are from an earlier cycle.", "gauge");
+    for (unsigned int i = 0; i < snapshot->device_count; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "{gpu=\"%u\"}", i);
+        bufferAppendSample(out, "collector_device_stale", labels, snapshot->devices[i].stale);
+    }
+
+    if (out->failed) {
+        fprintf(stderr, "Failed to allocate the metrics buffer\n");
+        return;
+    }
+
+    if (metrics_server_enabled) {
+        publishMetrics(out->data, out->length);
+    }
+    if (metrics_file_enabled && metrics_file_due) {
+        writeMetricsFile(out->data, out->length);
+    }
+}
+
+// Create or reuse the shared memory segment, readers keep their mapping across collector restarts
+bool openSharedSnapshot(const char* name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open shared memory %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, sizeof(GpuSnapshot)) != 0) {
+        fprintf(stderr, "Failed to size shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, sizeof(GpuSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Failed to map shared memory %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    shared_snapshot = mapped;
+
+    // Keep the generation running so readers caching by generation notice a restart
+    __atomic_store_n(&shared_snapshot->sequence, shared_snapshot->sequence | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shared_snapshot->magic = GPU_SNAPSHOT_MAGIC;
+    shared_snapshot->version = GPU_SNAPSHOT_VERSION;
+    shared_snapshot->size = sizeof(GpuSnapshot);
+    __atomic_store_n(&shared_snapshot->sequence, shared_snapshot->sequence + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void copyTempWindow(GpuSnapshotTempWindow *out, const TempWindow *window) {
+    memset(out, 0, sizeof(*out));
+    if (window->count == 0) {
+        return;
+    }
+    out->count = window->count;
+    out->min = window->min;
+    out->max = window->max;
+    out->p95 = tempPercentile(window, 95);
+    out->p99 = tempPercentile(window, 99);
+    out->avg = (double)window->sum / window->count;
+}
+
+// Publish the rendered cycle under the segment's seqlock
+void writeSharedSnapshot(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig) {
+    GpuSnapshot *out = shared_snapshot;
+    __atomic_store_n(&out->sequence, out->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    out->timestamp_sec = snapshot->timestamp.tv_sec;
+    out->timestamp_nsec = snapshot->timestamp.tv_nsec;
+    out->enabled_metrics = metricsConfig->enabled;
+    out->device_count = snapshot->device_count;
+    out->apt_upgradable_packages = upgradable_packages;
+    out->register_sampler_hz = register_sampler_hz;
+    out->handle_cache_rebuilds = handle_cache_rebuilds;
+    out->missed_deadlines = missed_deadlines;
+    out->sample_duration = last_sample_duration;
+    out->cycle_duration = last_cycle_duration;
+    out->cycle_lag = last_cycle_lag;
+    snprintf(out->hostname, sizeof(out->hostname), "%s", cached_hostname);
+    snprintf(out->driver_version, sizeof(out->driver_version), "%s", cached_driver_version);
+
+    for (unsigned int i = 0; i < snapshot->device_count; i++) {
+        const DeviceData *device = &snapshot->devices[i];
+        GpuSnapshotDevice *slot = &out->devices[i];
+        snprintf(slot->uuid, sizeof(slot->uuid), "%s", device->uuid);
+        snprintf(slot->name, sizeof(slot->name), "%s", device->device_name);
+        if (i < cached_device_count && device_handles[i].valid) {
+            snprintf(slot->pci_bus_id, sizeof(slot->pci_bus_id), "%s", device_handles[i].pci_info.busId);
+        } else {
+            slot->pci_bus_id[0] = '\0';
+        }
+        slot->vram_temp = device->vram_temp;
+        slot->hotspot_temp = device->hotspot_temp;
+        slot->clock_throttle_reasons = device->clock_throttle_reasons;
+        slot->sm_clock = device->sm_clock;
+        slot->mem_clock = device->mem_clock;
+        slot->gpu_temp = device->gpu_temp;
+        slot->power_usage = device->power_usage;
+        slot->fan_speed = device->fan_speed;
+        slot->gpu_util = device->gpu_util;
+        slot->mem_util = device->mem_util;
+        slot->aer_total_errors = device->aer_total_errors;
+        slot->error_state = device->error_state;
+        slot->unsupported_metrics = unsupportedMetrics(device, i);
+        slot->stale = device->stale;
+        slot->aer_dev = device->aer_dev;
+        slot->kernel_events = device->kernel_events;
+        slot->fb_free = device->fb_free;
+        slot->fb_used = device->fb_used;
+        slot->nvlink_bandwidth_total = device->nvlink_bandwidth_total;
+        copyTempWindow(&slot->vram_window, &rendered_aggregates[i].vram);
+        copyTempWindow(&slot->hotspot_window, &rendered_aggregates[i].hotspot);
+    }
+
+    __atomic_store_n(&out->generation, out->generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&out->sequence, out->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Replace metrics.txt atomically so readers never see a partial file
+void writeMetricsFile(const char* body, size_t length) {
+    int fd = open("metrics.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open metrics.tmp for writing\n");
+        return;
+    }
+    // One write() for the whole body, the loop only matters for short writes
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, body + written, length - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    if (close(fd) != 0 || written != length) {
+        fprintf(stderr, "Failed to write metrics.tmp\n");
+        return;
+    }
+    rename("metrics.tmp", "metrics.txt");
+}
+
+// Re-read the hostname and driver version, only called when the handle cache is rebuilt
+void refreshHostIdentity(void) {
+    gethostname(cached_hostname, sizeof(cached_hostname));
+    cached_hostname[sizeof(cached_hostname) - 1] = '\0'; // Ensure null termination
+
+    nvmlReturn_t result = nvmlSystemGetDriverVersion(cached_driver_version, sizeof(cached_driver_version));
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get driver version: %s\n", nvmlErrorString(result));
+        cached_driver_version[0] = '\0';
+    }
+    cached_driver_version[sizeof(cached_driver_version) - 1] = '\0'; // Ensure null termination
+}
+
+void internLinePrefix(unsigned int device, unsigned int slot, const char *name, const char *labels) {
+    LinePrefix *prefix = &line_prefixes[device][slot];
+    prefix->offset = line_prefix_arena.length;
+    bufferAppendString(&line_prefix_arena, name);
+    bufferAppendString(&line_prefix_arena, labels);
+    bufferAppend(&line_prefix_arena, " ", 1);
+    prefix->length = line_prefix_arena.length - prefix->offset;
+}
+
+// Intern "NAME{labels} " for every sample line of every device in the snapshot
+bool buildLinePrefixes(const MetricsSnapshot* snapshot) {
+    line_prefix_arena.length = 0;
+    line_prefix_arena.failed = false;
+
+    const unsigned int aggregate_fields[2] = {GPU_METRIC_VRAM_TEMP, GPU_METRIC_HOT_SPOT_TEMP};
+    for (unsigned int a = 0; a < 2; a++) {
+        for (unsigned int s = 0; s < TEMP_SERIES_COUNT; s++) {
+            snprintf(aggregate_names[a][s], sizeof(aggregate_names[a][s]), "%s%s", metricRegistry[aggregate_fields[a]].name, tempSeries[s].suffix);
+        }
+    }
+
+    for (unsigned int i = 0; i < snapshot->device_count; i++) {
+        char device_label[1024];
+        snprintf(device_label, sizeof(device_label),
+                    "{gpu=\"%u\",UUID=\"%.*s\",device=\"nvidia%u\",modelName=\"%.*s\",Hostname=\"%.*s\",DCGM_FI_DRIVER_VERSION=\"%.*s\"}",
+                    i,
+                    UUID_MAX_LEN, snapshot->devices[i].uuid,
+                    i,
+                    NAME_MAX_LEN, snapshot->devices[i].device_name,
+                    HOSTNAME_MAX_LEN, cached_hostname,
+                    DRIVER_VERSION_MAX_LEN, cached_driver_version);
+
+        for (unsigned int f = 0; f < METRIC_FIELD_COUNT; f++) {
+            internLinePrefix(i, f, metricRegistry[f].name, device_label);
+        }
+        for (unsigned int a = 0; a < 2; a++) {
+            for (unsigned int s = 0; s < TEMP_SERIES_COUNT; s++) {
+                internLinePrefix(i, PREFIX_AGGREGATES + a * TEMP_SERIES_COUNT + s, aggregate_names[a][s], device_label);
+            }
+        }
+        // Same label set as every other family plus the reason, the AER port and severity,
+        // the event kind or the AER error type
+        size_t device_label_length = strlen(device_label);
+        for (unsigned int j = 0; j < THROTTLE_REASON_COUNT; j++) {
+            char reason_label[1024 + 64];
+            snprintf(reason_label, sizeof(reason_label), "%.*s,reason=\"%s\"}", (int)(device_label_length - 1), device_label, throttleReasons[j].reasonString);
+            internLinePrefix(i, PREFIX_THROTTLE + j, "DCGM_FI_DEV_CLOCKS_THROTTLE_REASON", reason_label);
+        }
+        for (unsigned int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+            for (unsigned int severity = 0; severity < GPU_AER_SEVERITY_COUNT; severity++) {
+                char aer_label[1024 + 64];
+                snprintf(aer_label, sizeof(aer_label), "%.*s,port=\"%s\",severity=\"%s\"}", (int)(device_label_length - 1), device_label,
+                         gpuAerPortNames[port], gpuAerSeverityNames[severity]);
+                internLinePrefix(i, PREFIX_AER_DEV + port * GPU_AER_SEVERITY_COUNT + severity, metricRegistry[GPU_METRIC_AER_DEV_ERRORS].name, aer_label);
+            }
+        }
+        for (unsigned int kind = 0; kind < GPU_KERNEL_EVENT_COUNT; kind++) {
+            char event_label[1024 + 64];
+            snprintf(event_label, sizeof(event_label), "%.*s,event=\"%s\"}", (int)(device_label_length - 1), device_label, gpuKernelEventNames[kind]);
+            internLinePrefix(i, PREFIX_KERNEL_EVENTS + kind, metricRegistry[GPU_METRIC_KERNEL_EVENTS].name, event_label);
+            internLinePrefix(i, PREFIX_KERNEL_EVENT_TIMES + kind, metricRegistry[GPU_METRIC_KERNEL_EVENT_TIME].name, event_label);
+        }
+        for (unsigned int type = 0; type < GPU_AER_TYPE_COUNT; type++) {
+            char type_label[1024 + 64];
+            snprintf(type_label, sizeof(type_label), "%.*s,severity=\"%s\",type=\"%s\"}", (int)(device_label_length - 1), device_label,
+                     gpuAerTypeSeverities[type], gpuAerTypeNames[type]);
+            internLinePrefix(i, PREFIX_AER_TYPES + type, metricRegistry[GPU_METRIC_KERNEL_AER_ERRORS].name, type_label);
+        }
+    }
+
+    if (line_prefix_arena.failed) {
+        line_prefixes_identity = 0;
+        return false;
+    }
+    line_prefixes_identity = snapshot->identity;
+    line_prefixes_device_count = snapshot->device_count;
+    return true;
+}
+
+void bufferAppendPrefixedSample(OutputBuffer *buf, unsigned int device, unsigned int slot, unsigned long long value) {
+    const LinePrefix *prefix = &line_prefixes[device][slot];
+    bufferAppend(buf, line_prefix_arena.data + prefix->offset, prefix->length);
+    bufferAppendUnsigned(buf, value);
+    bufferAppend(buf, "\n", 1);
+}
+
+void bufferAppendPrefixedFixed(OutputBuffer *buf, unsigned int device, unsigned int slot, double value, unsigned int decimals) {
+    const LinePrefix *prefix = &line_prefixes[device][slot];
+    bufferAppend(buf, line_prefix_arena.data + prefix->offset, prefix->length);
+    bufferAppendFixed(buf, value, decimals);
+    bufferAppend(buf, "\n", 1);
+}
+
+// Sample of a family's own prefix with one more label whose value is only known at render time
+void bufferAppendPrefixedLabelSample(OutputBuffer *buf, unsigned int device, unsigned int slot, const char *label,
+                                     unsigned long long label_value, unsigned long long value) {
+    const LinePrefix *prefix = &line_prefixes[device][slot];
+    bufferAppend(buf, line_prefix_arena.data + prefix->offset, prefix->length - 2); // Without the closing "} "
+    bufferAppend(buf, ",", 1);
+    bufferAppendString(buf, label);
+    bufferAppend(buf, "=\"", 2);
+    bufferAppendUnsigned(buf, label_value);
+    bufferAppend(buf, "\"} ", 3);
+    bufferAppendUnsigned(buf, value);
+    bufferAppend(buf, "\n", 1);
+}
+
+// Make room for extra bytes, the buffer only grows so steady-state cycles do not allocate
+bool bufferReserve(OutputBuffer *buf, size_t extra) {
+    if (buf->length + extra <= buf->capacity) {
+        return true;
+    }
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
+        buf->failed = true;
+        return false;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
+
+void bufferAppend(OutputBuffer *buf, const char *text, size_t length) {
+    if (!bufferReserve(buf, length)) {
+        return;
+    }
+    memcpy(buf->data + buf->length, text, length);
+    buf->length += length;
+}
+
+void bufferAppendString(OutputBuffer *buf, const char *text) {
+    bufferAppend(buf, text, strlen(text));
+}
+
+void bufferAppendUnsigned(OutputBuffer *buf, unsigned long long value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[sizeof(digits) - ++count] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    bufferAppend(buf, digits + sizeof(digits) - count, count);
+}
+
+// Same digits as printf("%.*f"), without going through stdio
+void bufferAppendFixed(OutputBuffer *buf, double value, unsigned int decimals) {
+    static const unsigned long long scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+    if (decimals >= sizeof(scales) / sizeof(scales[0]) || !(value > -1e9 && value < 1e9)) {
+        // Out of the fast path's range (or NaN), let printf deal with it
+        char text[64];
+        int length = snprintf(text, sizeof(text), "%.*f", (int)decimals, value);
+        bufferAppend(buf, text, length > 0 ? (size_t)length : 0);
+        return;
+    }
+    if (value < 0) {
+        bufferAppend(buf, "-", 1);
+        value = -value;
+    }
+    unsigned long long scaled = (unsigned long long)(value * scales[decimals] + 0.5);
+    bufferAppendUnsigned(buf, scaled / scales[decimals]);
+    if (decimals == 0) {
+        return;
+    }
+    char fraction[10];
+    unsigned long long remainder = scaled % scales[decimals];
+    for (unsigned int d = decimals; d > 0; d--) {
+        fraction[d] = '0' + remainder % 10;
+        remainder /= 10;
+    }
+    fraction[0] = '.';
+    bufferAppend(buf, fraction, decimals + 1);
+}
+
+void bufferAppendHeader(OutputBuffer *buf, const char *name, const char *help, const char *type) {
+    bufferAppendString(buf, "# HELP ");
+    bufferAppendString(buf, name);
+    bufferAppend(buf, " ", 1);
+    bufferAppendString(buf, help);
+    bufferAppendString(buf, "\n# TYPE ");
+    bufferAppendString(buf, name);
+    bufferAppend(buf, " ", 1);
+    bufferAppendString(buf, type);
+    bufferAppend(buf, "\n", 1);
+}
+
+void bufferAppendSample(OutputBuffer *buf, const char *name, const char *labels, unsigned long long value) {
+    bufferAppendString(buf, name);
+    bufferAppendString(buf, labels);
+    bufferAppend(buf, " ", 1);
+    bufferAppendUnsigned(buf, value);
+    bufferAppend(buf, "\n", 1);
+}
+
+void bufferAppendFixedSample(OutputBuffer *buf, const char *name, const char *labels, double value, unsigned int decimals) {
+    bufferAppendString(buf, name);
+    bufferAppendString(buf, labels);
+    bufferAppend(buf, " ", 1);
+    bufferAppendFixed(buf, value, decimals);
+    bufferAppend(buf, "\n", 1);
+}
+
+uint64_t fnv1aHash(const char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Utility function to get the PCI bus ID as a string for a given GPU index
+int getGpuPciBusId(unsigned int index, char *pciBusId, unsigned int length) {
+    if (index >= cached_device_count || !device_handles[index].valid) return -1;
+
+    const nvmlPciInfo_t *pci = &device_handles[index].pci_info;
+    snprintf(pciBusId, length, "%04x:%02x:%02x.0", pci->domain, pci->bus, pci->device);
+    return 0;
+}
+
+// Called with log_classifier_lock held
+int findLogBus(const char *bus_id) {
+    for (unsigned int b = 0; b < log_classifier.bus_count; b++) {
+        if (strcmp(log_classifier.bus_ids[b], bus_id) == 0) {
+            return (int)b;
+        }
+    }
+    return -1;
+}
+
+// First free slot of the bus list, -1 if all MAX_DEVICES are taken. Called with log_classifier_lock held for writing.
+int freeLogBus(void) {
+    for (unsigned int b = 0; b < log_classifier.bus_count; b++) {
+        if (log_classifier.bus_ids[b][0] == '\0') {
+            return (int)b;
+        }
+    }
+    return log_classifier.bus_count < MAX_DEVICES ? (int)log_classifier.bus_count++ : -1;
+}
+
+// Log bus of a GPU bus id, added and compiled into the classifier on first use;
+// -1 once MAX_DEVICES buses are known
+int logBusIndex(const char *bus_id) {
+    pthread_rwlock_rdlock(&log_classifier_lock);
+    int bus = findLogBus(bus_id);
+    pthread_rwlock_unlock(&log_classifier_lock);
+    if (bus >= 0) {
+        return bus;
+    }
+
+    pthread_rwlock_wrlock(&log_classifier_lock);
+    bus = findLogBus(bus_id);
+    if (bus < 0 && (bus = freeLogBus()) >= 0) {
+        snprintf(log_classifier.bus_ids[bus], sizeof(log_classifier.bus_ids[bus]), "%s", bus_id);
+        // On failure the previous automaton stays, without the new bus
+        buildLogClassifier();
+    }
+    pthread_rwlock_unlock(&log_classifier_lock);
+    return bus;
+}
+
+// Match the bus list to the GPUs of a rebuilt handle cache: buses still present keep their
+// slot and counters, the slots of GPUs that went away are freed with their counters cleared,
+// and new GPUs take free slots. Nothing to do before anything used the classifier.
+void rebuildLogBuses(void) {
+    char current[MAX_DEVICES][20];
+    unsigned int current_count = 0;
+    for (unsigned int i = 0; i < cached_device_count; i++) {
+        if (getGpuPciBusId(i, current[current_count], sizeof(current[current_count])) == 0) {
+            current_count++;
+        }
+    }
+
+    uint32_t freed = 0;
+    pthread_rwlock_wrlock(&log_classifier_lock);
+    if (log_classifier.bus_count == 0) {
+        pthread_rwlock_unlock(&log_classifier_lock);
+        return;
+    }
+    bool placed[MAX_DEVICES] = {false};
+    for (unsigned int b = 0; b < log_classifier.bus_count; b++) {
+        bool present = false;
+        for (unsigned int c = 0; c < current_count && !present; c++) {
+            if (!placed[c] && strcmp(log_classifier.bus_ids[b], current[c]) == 0) {
+                placed[c] = present = true;
+            }
+        }
+        if (!present && log_classifier.bus_ids[b][0] != '\0') {
+            log_classifier.bus_ids[b][0] = '\0';
+            freed |= 1u << b;
+        }
+    }
+    bool changed = freed != 0;
+    for (unsigned int c = 0; c < current_count; c++) {
+        int bus;
+        if (!placed[c] && (bus = freeLogBus()) >= 0) {
+            memcpy(log_classifier.bus_ids[bus], current[c], sizeof(log_classifier.bus_ids[bus]));
+            changed = true;
+        }
+    }
+    if (changed) {
+        buildLogClassifier();
+    }
+    pthread_rwlock_unlock(&log_classifier_lock);
+
+    if (freed == 0) {
+        return;
+    }
+    pthread_mutex_lock(&aer_log_lock);
+    for (uint32_t buses = freed; buses != 0; buses &= buses - 1) {
+        aer_log.counts[__builtin_ctz(buses)] = 0;
+    }
+    pthread_mutex_unlock(&aer_log_lock);
+    pthread_mutex_lock(&kernel_events_lock);
+    for (uint32_t buses = freed; buses != 0; buses &= buses - 1) {
+        memset(&kernel_events.events[__builtin_ctz(buses)], 0, sizeof(kernel_events.events[0]));
+    }
+    pthread_mutex_unlock(&kernel_events_lock);
+}
+
+// Compile the event patterns and the bus ids into the DFA. Called with log_classifier_lock held for writing.
+bool buildLogClassifier(void) {
+    LogClassifier *classifier = &log_classifier;
+    LogPattern patterns[LOG_EVENT_PATTERN_COUNT + 2 * MAX_DEVICES];
+    char xid_texts[MAX_DEVICES][32];
+    unsigned int pattern_count = 0;
+    for (size_t p = 0; p < LOG_EVENT_PATTERN_COUNT; p++) {
+        patterns[pattern_count++] = logEventPatterns[p];
+    }
+    for (unsigned int b = 0; b < classifier->bus_count; b++) {
+        if (classifier->bus_ids[b][0] == '\0') {
+            continue;
+        }
+        patterns[pattern_count++] = (LogPattern){ classifier->bus_ids[b], { .buses = 1u << b } };
+        // Xid reports leave out the function, "0000:01:00" of "0000:01:00.0"
+        snprintf(xid_texts[b], sizeof(xid_texts[b]), "NVRM: Xid (PCI:%.10s)", classifier->bus_ids[b]);
+        patterns[pattern_count++] = (LogPattern){ xid_texts[b], { .events = 1u << GPU_KERNEL_EVENT_XID, .xid_buses = 1u << b } };
+    }
+
+    // Bytes no pattern contains share class 0, which always leads back to the root
+    uint8_t byte_class[256] = {0};
+    unsigned int class_count = 1;
+    size_t state_limit = 1;
+    for (unsigned int p = 0; p < pattern_count; p++) {
+        for (const unsigned char *c = (const unsigned char *)patterns[p].text; *c; c++) {
+            if (byte_class[*c] == 0) {
+                byte_class[*c] = class_count++;
+            }
+            state_limit++;
+        }
+    }
+
+    uint32_t *next = calloc(state_limit * class_count, sizeof(*next));
+    LogMatch *matches = calloc(state_limit, sizeof(*matches));
+    uint32_t *fail = calloc(state_limit, sizeof(*fail));
+    uint32_t *queue = calloc(state_limit, sizeof(*queue));
+    if (next == NULL || matches == NULL || fail == NULL || queue == NULL) {
+        fprintf(stderr, "Failed to allocate the log classifier\n");
+        free(next);
+        free(matches);
+        free(fail);
+        free(queue);
+        return false;
+    }
+
+    // Trie of all patterns, state 0 is the root
+    unsigned int state_count = 1;
+    for (unsigned int p = 0; p < pattern_count; p++) {
+        unsigned int state = 0;
+        for (const unsigned char *c = (const unsigned char *)patterns[p].text; *c; c++) {
+            uint32_t *edge = &next[state * class_count + byte_class[*c]];
+            if (*edge == 0) {
+                *edge = state_count++;
+            }
+            state = *edge;
+        }
+        matches[state].events |= patterns[p].match.events;
+        matches[state].aer_types |= patterns[p].match.aer_types;
+        matches[state].buses |= patterns[p].match.buses;
+        matches[state].xid_buses |= patterns[p].match.xid_buses;
+    }
+
+    // Breadth first, so the failure state of a state is complete before the state itself.
+    // Missing edges are replaced by the failure state's, which turns the trie into a DFA.
+    unsigned int head = 0, tail = 0;
+    for (unsigned int c = 1; c < class_count; c++) {
+        if (next[c] != 0) {
+            queue[tail++] = next[c];
+        }
+    }
+    while (head < tail) {
+        unsigned int state = queue[head++];
+        const LogMatch *inherited = &matches[fail[state]];
+        matches[state].events |= inherited->events;
+        matches[state].aer_types |= inherited->aer_types;
+        matches[state].buses |= inherited->buses;
+        matches[state].xid_buses |= inherited->xid_buses;
+        for (unsigned int c = 1; c < class_count; c++) {
+            uint32_t *edge = &next[state * class_count + c];
+            uint32_t fallback = next[fail[state] * class_count + c];
+            if (*edge != 0) {
+                fail[*edge] = fallback;
+                queue[tail++] = *edge;
+            } else {
+                *edge = fallback;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    // Transitions store the target's row rather than its number, saving a multiply per byte
+    uint8_t *matching = calloc(state_count * class_count, sizeof(*matching));
+    if (matching == NULL) {
+        fprintf(stderr, "Failed to allocate the log classifier\n");
+        free(next);
+        free(matches);
+        return false;
+    }
+    for (unsigned int state = 0; state < state_count; state++) {
+        const LogMatch *match = &matches[state];
+        matching[state * class_count] = (match->events | match->aer_types | match->buses | match->xid_buses) != 0;
+    }
+    for (size_t t = 0; t < (size_t)state_count * class_count; t++) {
+        next[t] *= class_count;
+    }
+
+    free(classifier->next);
+    free(classifier->matches);
+    free(classifier->matching);
+    memcpy(classifier->byte_class, byte_class, sizeof(byte_class));
+    classifier->class_count = class_count;
+    classifier->next = next;
+    classifier->matches = matches;
+    classifier->matching = matching;
+    return true;
+}
+
+// Everything the patterns find in a line; xid_end, if given, is set past the last Xid bus id.
+// Called with log_classifier_lock held for reading.
+LogMatch classifyLogLine(const char *line, size_t length, size_t *xid_end) {
+    LogMatch found = {0};
+    const LogClassifier *classifier = &log_classifier;
+    if (classifier->next != NULL) {
+        uint32_t row = 0;
+        for (size_t i = 0; i < length; i++) {
+            row = classifier->next[row + classifier->byte_class[(unsigned char)line[i]]];
+            if (!classifier->matching[row]) {
+                continue;
+            }
+            const LogMatch *match = &classifier->matches[row / classifier->class_count];
+            found.events |= match->events;
+            found.aer_types |= match->aer_types;
+            found.buses |= match->buses;
+            found.xid_buses |= match->xid_buses;
+            if (match->xid_buses != 0 && xid_end != NULL) {
+                *xid_end = i + 1;
+            }
+        }
+    }
+    return found;
+}
+
+// Line handler of the tracker, a line counts for every GPU whose bus id it mentions next to "AER".
+// The caller holds log_classifier_lock for reading.
+void aerLogScanLine(const char *line, size_t length) {
+    aerScanLines(line, length, aer_log.counts);
+}
+
+// Split freshly read bytes into lines, carrying an incomplete last line to the next read
+void splitLines(LineCarry *carry, const char *data, size_t length, LineHandler handler) {
+    const char *end = data + length;
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t chunk = (newline != NULL ? newline : end) - data;
+
+        if (carry->length > 0 || newline == NULL) {
+            // Overlong lines are truncated, the bus id and the event come first anyway
+            size_t room = sizeof(carry->line) - carry->length;
+            size_t copy = chunk < room ? chunk : room;
+            memcpy(carry->line + carry->length, data, copy);
+            carry->length += copy;
+            if (newline != NULL) {
+                handler(carry->line, carry->length);
+                carry->length = 0;
+            }
+        } else {
+            handler(data, chunk);
+        }
+        data += chunk + (newline != NULL ? 1 : 0);
+    }
+}
+
+// Parse everything appended to the open log since the last call
+void aerLogDrain(void) {
+    static char buffer[LOG_READ_SIZE];
+    ssize_t got;
+    while ((got = pread(aer_log.fd, buffer, sizeof(buffer), aer_log.offset)) > 0) {
+        pthread_rwlock_rdlock(&log_classifier_lock);
+        splitLines(&aer_log.carry, buffer, (size_t)got, aerLogScanLine);
+        pthread_rwlock_unlock(&log_classifier_lock);
+        aer_log.offset += got;
+    }
+    if (got < 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", syslog_path, strerror(errno));
+    }
+}
+
+bool aerLogOpen(void) {
+    int fd = open(syslog_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (!aer_log.open_failed) {
+            fprintf(stderr, "Failed to open %s: %s\n", syslog_path, strerror(errno));
+            aer_log.open_failed = true;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    aer_log.open_failed = false;
+    aer_log.fd = fd;
+    aer_log.dev = st.st_dev;
+    aer_log.ino = st.st_ino;
+    aer_log.offset = 0;
+    aer_log.carry.length = 0;
+    return true;
+}
+
+// Every GPU needs to be known to the classifier before a scan, even those without errors yet
+void addGpuLogBuses(void) {
+    for (unsigned int i = 0; i < cached_device_count; i++) {
+        char pciBusId[20];
+        if (getGpuPciBusId(i, pciBusId, sizeof(pciBusId)) == 0) {
+            logBusIndex(pciBusId);
+        }
+    }
+}
+
+// Bring the per-bus counters up to date: read what was appended, and when
+// logrotate moved the file away, finish the old one before starting the new one.
+// Only called once the backfill is done.
+void updateAerLogTracker(void) {
+    addGpuLogBuses();
+
+    if (aer_log.fd >= 0) {
+        struct stat current, opened;
+        bool replaced = stat(syslog_path, &current) == 0 &&
+                        (current.st_ino != aer_log.ino || current.st_dev != aer_log.dev);
+        if (fstat(aer_log.fd, &opened) == 0 && opened.st_size < aer_log.offset) {
+            // Truncated in place (copytruncate), start over at the beginning
+            aer_log.offset = 0;
+            aer_log.carry.length = 0;
+        }
+        aerLogDrain();
+        if (!replaced) {
+            return;
+        }
+        if (aer_log.carry.length > 0) {
+            pthread_rwlock_rdlock(&log_classifier_lock);
+            aerLogScanLine(aer_log.carry.line, aer_log.carry.length);
+            pthread_rwlock_unlock(&log_classifier_lock);
+        }
+        close(aer_log.fd);
+        aer_log.fd = -1;
+    }
+
+    if (aerLogOpen()) {
+        aerLogDrain();
+    }
+}
+
+// Count the lines of a block of whole lines that mention "AER" and a GPU's bus id, per log bus.
+// memchr (vectorised in glibc) jumps from one 'A' to the next and the two bytes after it are
+// compared in place, so only the lines around an "AER" go through the classifier.
+// Called with log_classifier_lock held for reading.
+void aerScanLines(const char *data, size_t length, unsigned long long *counts) {
+    const char *end = data + length;
+    const char *line = data;   // Start of the first line not yet counted
+    const char *cursor = data; // Where the search for the next 'A' resumes
+    while (cursor < end) {
+        const char *hit = memchr(cursor, 'A', end - cursor);
+        if (hit == NULL) {
+            break;
+        }
+        if (end - hit < 3 || hit[1] != 'E' || hit[2] != 'R') {
+            cursor = hit + 1;
+            continue;
+        }
+        const char *start = memrchr(line, '\n', hit - line);
+        start = start != NULL ? start + 1 : line;
+        const char *newline = memchr(hit, '\n', end - hit);
+        const char *stop = newline != NULL ? newline : end;
+        LogMatch match = classifyLogLine(start, stop - start, NULL);
+        if (match.events & (1u << GPU_KERNEL_EVENT_AER)) {
+            for (uint32_t buses = match.buses; buses != 0; buses &= buses - 1) {
+                counts[__builtin_ctz(buses)]++;
+            }
+        }
+        line = stop + 1;
+        cursor = line;
+    }
+}
+
+// aerScanLines under one read lock for the whole block
+void aerScanBlock(const char *data, size_t length, unsigned long long *counts) {
+    pthread_rwlock_rdlock(&log_classifier_lock);
+    aerScanLines(data, length, counts);
+    pthread_rwlock_unlock(&log_classifier_lock);
+}
+
+bool aerBackfillAddTask(AerBackfill *backfill, AerBackfillTask task) {
+    if ((backfill->task_count & (backfill->task_count - 1)) == 0) {
+        // Doubles at every power of two
+        unsigned int capacity = backfill->task_count ? backfill->task_count * 2 : 16;
+        AerBackfillTask *tasks = realloc(backfill->tasks, capacity * sizeof(*tasks));
+        if (tasks == NULL) {
+            fprintf(stderr, "Failed to allocate the AER backfill tasks\n");
+            return false;
+        }
+        backfill->tasks = tasks;
+    }
+    backfill->tasks[backfill->task_count++] = task;
+    return true;
+}
+
+// Map the first length bytes of a plain log and queue them in chunks that end on a newline
+bool aerBackfillAddFile(AerBackfill *backfill, int fd, size_t length) {
+    if (length == 0) {
+        return true;
+    }
+    const char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map log for the AER backfill: %s\n", strerror(errno));
+        return false;
+    }
+    madvise((void*)data, length, MADV_SEQUENTIAL);
+
+    size_t start = 0;
+    while (start < length) {
+        size_t stop = length;
+        if (length - start > AER_BACKFILL_CHUNK_SIZE) {
+            const char *newline = memchr(data + start + AER_BACKFILL_CHUNK_SIZE, '\n', length - start - AER_BACKFILL_CHUNK_SIZE);
+            stop = newline != NULL ? (size_t)(newline - data) + 1 : length;
+        }
+        if (!aerBackfillAddTask(backfill, (AerBackfillTask){ .data = data + start, .length = stop - start, .mapped = start == 0 ? length : 0 })) {
+            if (start == 0) {
+                munmap((void*)data, length);
+            }
+            break;
+        }
+        start = stop;
+    }
+    return true;
+}
+
+// Stream a gzip archive through a fixed buffer, scanning the whole lines of every read
+void aerBackfillGzip(AerBackfill *backfill, const char *path, char *buffer, unsigned long long *counts) {
+    gzFile file = gzopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    gzbuffer(file, 256 * 1024);
+
+    size_t carried = 0;
+    int got;
+    while ((got = gzread(file, buffer + carried, AER_BACKFILL_GZIP_BUFFER - carried)) > 0) {
+        atomic_fetch_add(&backfill->gzip_bytes, (unsigned long long)got);
+        size_t filled = carried + (size_t)got;
+        const char *newline = memrchr(buffer, '\n', filled);
+        size_t whole = newline != NULL ? (size_t)(newline - buffer) + 1 : filled; // A line longer than the buffer is cut
+        aerScanBlock(buffer, whole, counts);
+        carried = filled - whole;
+        memmove(buffer, buffer + whole, carried);
+    }
+    if (got < 0) {
+        int err;
+        fprintf(stderr, "Failed to read %s: %s\n", path, gzerror(file, &err));
+    }
+    aerScanBlock(buffer, carried, counts);
+    gzclose(file);
+}
+
+void* aerBackfillWorker(void* arg) {
+    AerBackfill *backfill = arg;
+    unsigned long long counts[MAX_DEVICES] = {0};
+    char *buffer = NULL;
+
+    unsigned int t;
+    while ((t = atomic_fetch_add(&backfill->next_task, 1)) < backfill->task_count) {
+        const AerBackfillTask *task = &backfill->tasks[t];
+        if (task->data != NULL) {
+            aerScanBlock(task->data, task->length, counts);
+            continue;
+        }
+        if (buffer == NULL && (buffer = malloc(AER_BACKFILL_GZIP_BUFFER)) == NULL) {
+            fprintf(stderr, "Failed to allocate the AER backfill buffer\n");
+            continue;
+        }
+        aerBackfillGzip(backfill, task->path, buffer, counts);
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&backfill->lock);
+    for (unsigned int b = 0; b < MAX_DEVICES; b++) {
+        backfill->counts[b] += counts[b];
+    }
+    pthread_mutex_unlock(&backfill->lock);
+    return NULL;
+}
+
+// Count the AER lines the rotated logs and the whole lines of the open log already hold into
+// counts, returning how far into the open log that got. Runs without aer_log_lock.
+off_t backfillAerLog(int current_fd, unsigned long long *counts) {
+    double start = monotonicSeconds();
+    AerBackfill backfill = { .lock = PTHREAD_MUTEX_INITIALIZER, .counts = counts };
+    size_t plain_bytes = 0;
+    unsigned int file_count = 0;
+
+    // Oldest rotations hold the least and are gzip, queue them first so they start early
+    char path[4096];
+    unsigned int rotations = 0;
+    while (rotations < AER_BACKFILL_MAX_ROTATIONS) {
+        snprintf(path, sizeof(path), "%s.%u", syslog_path, rotations + 1);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            snprintf(path, sizeof(path), "%s.%u.gz", syslog_path, rotations + 1);
+            if (stat(path, &st) != 0) {
+                break;
+            }
+        }
+        rotations++;
+    }
+    for (unsigned int n = rotations; n > 0; n--) {
+        snprintf(path, sizeof(path), "%s.%u.gz", syslog_path, n);
+        if (access(path, R_OK) == 0) {
+            char *archive = strdup(path);
+            if (archive == NULL || !aerBackfillAddTask(&backfill, (AerBackfillTask){ .path = archive })) {
+                free(archive);
+                break;
+            }
+            file_count++;
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s.%u", syslog_path, n);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        } else if (aerBackfillAddFile(&backfill, fd, (size_t)st.st_size)) {
+            plain_bytes += (size_t)st.st_size;
+            file_count++;
+        }
+        if (fd >= 0) {
+            close(fd); // The mapping stays valid
+        }
+    }
+
+    // The open log up to its last newline, the tracker follows from there
+    off_t covered = 0;
+    struct stat st;
+    if (fstat(current_fd, &st) == 0 && st.st_size > 0) {
+        char tail[LOG_LINE_MAX];
+        off_t tail_start = st.st_size > (off_t)sizeof(tail) ? st.st_size - (off_t)sizeof(tail) : 0;
+        ssize_t got = pread(current_fd, tail, (size_t)(st.st_size - tail_start), tail_start);
+        const char *newline = got > 0 ? memrchr(tail, '\n', (size_t)got) : NULL;
+        if (newline != NULL) {
+            covered = tail_start + (newline - tail) + 1;
+        }
+        if (covered > 0 && aerBackfillAddFile(&backfill, current_fd, (size_t)covered)) {
+            plain_bytes += (size_t)covered;
+            file_count++;
         } else {
-            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
-            fprintf(stderr, "Use --help or -h for usage information.\n");
-            return 1;
+            covered = 0;
+        }
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+    if (threads > (long)backfill.task_count) {
+        threads = backfill.task_count;
+    }
+    pthread_t workers[MAX_WORKERS];
+    long started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, aerBackfillWorker, &backfill) == 0) {
+        started++;
+    }
+    if (started == 0 && backfill.task_count > 0) {
+        aerBackfillWorker(&backfill);
+    }
+    for (long w = 0; w < started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+
+    for (unsigned int t = 0; t < backfill.task_count; t++) {
+        AerBackfillTask *task = &backfill.tasks[t];
+        if (task->data == NULL) {
+            free(task->path);
+        } else if (task->mapped > 0) {
+            munmap((void*)task->data, task->mapped);
+        }
+    }
+    free(backfill.tasks);
+
+    if (file_count > 0) {
+        double elapsed = monotonicSeconds() - start;
+        double bytes = (double)plain_bytes + (double)backfill.gzip_bytes;
+        printf("Counted AER lines in %u logs (%.1f MB) on %ld threads in %.2f s (%.2f GB/s)\n",
+               file_count, bytes / 1e6, started > 0 ? started : 1L, elapsed, elapsed > 0 ? bytes / elapsed / 1e9 : 0.0);
+        fflush(stdout);
+    }
+    return covered;
+}
+
+// Backfills the log as it is now, then hands the open log to the tracker at the first
+// line the backfill did not count and publishes the counts
+void* aerBackfillThread(void* arg) {
+    (void)arg;
+    static unsigned long long counts[MAX_DEVICES];
+    struct stat st;
+    int fd = open(syslog_path, O_RDONLY | O_CLOEXEC);
+    off_t covered = 0;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        covered = backfillAerLog(fd, counts);
+    } else if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    // A log missing now is counted from its start once it appears, rotations are not backfilled then
+    pthread_mutex_lock(&aer_log_lock);
+    if (fd >= 0) {
+        aer_log.fd = fd;
+        aer_log.dev = st.st_dev;
+        aer_log.ino = st.st_ino;
+        aer_log.offset = covered;
+        aer_log.carry.length = 0;
+    }
+    for (unsigned int b = 0; b < MAX_DEVICES; b++) {
+        aer_log.counts[b] += counts[b];
+    }
+    aer_log.scanned_generation = ~0ULL;
+    atomic_store(&aer_backfill_state, AER_BACKFILL_DONE);
+    pthread_mutex_unlock(&aer_log_lock);
+    return NULL;
+}
+
+// Start the backfill thread, called with aer_log_lock held
+bool startAerBackfill(void) {
+    addGpuLogBuses();
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, aerBackfillThread, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start the AER backfill, counting from the end of %s: %s\n", syslog_path, strerror(err));
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// AER lines seen for a GPU since the collector started, including rotated-away logs.
+// The first GPU sampled in a cycle updates the counters of all of them. False while the
+// backfill is still running, the count is not known yet.
+bool getTotalAerErrorsForDevice(unsigned int gpuIndex, unsigned int *count) {
+    *count = 0;
+    char pciBusId[20];
+    if (getGpuPciBusId(gpuIndex, pciBusId, sizeof(pciBusId)) != 0) {
+        fprintf(stderr, "Failed to get PCI bus ID for GPU %u\n", gpuIndex);
+        return true;
+    }
+
+    pthread_mutex_lock(&aer_log_lock);
+    int state = atomic_load(&aer_backfill_state);
+    if (state == AER_BACKFILL_IDLE) {
+        state = startAerBackfill() ? AER_BACKFILL_RUNNING : AER_BACKFILL_DONE;
+        atomic_store(&aer_backfill_state, state);
+    }
+    if (state != AER_BACKFILL_DONE) {
+        atomic_store(&aer_backfill_resample, true);
+        pthread_mutex_unlock(&aer_log_lock);
+        return false;
+    }
+    if (aer_log.scanned_generation != snapshot_generation) {
+        updateAerLogTracker();
+        aer_log.scanned_generation = snapshot_generation;
+    }
+    int bus = logBusIndex(pciBusId);
+    *count = bus >= 0 ? (unsigned int)aer_log.counts[bus] : 0;
+    pthread_mutex_unlock(&aer_log_lock);
+    return true;
+}
+
+// Bus id of the bridge or root port a device hangs off, false below a host bridge
+bool upstreamPortBusId(const char *bdf, char *port, size_t length) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/" SYSFS_PCI_DEVICES_PATH "/%s", sysfs_root, bdf);
+    char *resolved = realpath(path, NULL);
+    if (resolved == NULL) {
+        return false;
+    }
+    // .../pci0000:00/0000:00:01.0/0000:01:00.0, the parent directory is the port
+    bool found = false;
+    char *slash = strrchr(resolved, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        const char *parent = strrchr(resolved, '/');
+        parent = parent != NULL ? parent + 1 : resolved;
+        unsigned int domain, bus, dev, func;
+        char end;
+        if (sscanf(parent, "%x:%x:%x.%x%c", &domain, &bus, &dev, &func, &end) == 4) {
+            snprintf(port, length, "%s", parent);
+            found = true;
+        }
+    }
+    free(resolved);
+    return found;
+}
+
+// (Re)open the aer_dev_* files of GPU i and its upstream port for the current handle cache
+void openAerSysfsFiles(unsigned int i) {
+    AerSysfsFiles *files = &aer_sysfs[i];
+    for (unsigned int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+        for (unsigned int severity = 0; severity < GPU_AER_SEVERITY_COUNT; severity++) {
+            if (files->identity != 0 && files->fds[port][severity] >= 0) {
+                close(files->fds[port][severity]);
+            }
+            files->fds[port][severity] = -1;
+        }
+    }
+    files->identity = identity_generation;
+
+    char bus_ids[GPU_AER_PORT_COUNT][32];
+    if (getGpuPciBusId(i, bus_ids[GPU_AER_PORT_DEVICE], sizeof(bus_ids[GPU_AER_PORT_DEVICE])) != 0) {
+        return;
+    }
+    bool has_upstream = upstreamPortBusId(bus_ids[GPU_AER_PORT_DEVICE], bus_ids[GPU_AER_PORT_UPSTREAM], sizeof(bus_ids[GPU_AER_PORT_UPSTREAM]));
+
+    for (unsigned int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+        if (port == GPU_AER_PORT_UPSTREAM && !has_upstream) {
+            continue;
+        }
+        for (unsigned int severity = 0; severity < GPU_AER_SEVERITY_COUNT; severity++) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/" SYSFS_PCI_DEVICES_PATH "/%s/%s", sysfs_root, bus_ids[port], aerSysfsFileNames[severity]);
+            files->fds[port][severity] = open(path, O_RDONLY | O_CLOEXEC);
+        }
+    }
+}
+
+// The TOTAL_ERR_* line of an aer_dev_* file, which lists one counter per error type before it
+bool readAerTotal(int fd, uint64_t *total) {
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[4096];
+    ssize_t got = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (got <= 0) {
+        return false;
+    }
+    buffer[got] = '\0';
+    const char *line = strstr(buffer, "TOTAL_ERR_");
+    const char *value = line != NULL ? strchr(line, ' ') : NULL;
+    if (value == NULL) {
+        return false;
+    }
+    *total = strtoull(value + 1, NULL, 10);
+    return true;
+}
+
+// Digits at text, false if there are none before end
+bool parseDecimal(const char *text, const char *end, unsigned long long *value) {
+    const char *start = text;
+    *value = 0;
+    while (text < end && *text >= '0' && *text <= '9') {
+        *value = *value * 10 + (unsigned long long)(*text++ - '0');
+    }
+    return text > start;
+}
+
+void recordKernelEvent(GpuKernelEvents *events, unsigned int kind, double when) {
+    events->counts[kind]++;
+    if (when > events->last_seconds[kind]) {
+        events->last_seconds[kind] = when;
+    }
+}
+
+// One kmsg record, "priority,sequence,microseconds,flags;message". AER reports and the
+// error types on their bit lines count for the GPUs whose bus id they name, Xid reports
+// for the GPU in "NVRM: Xid (PCI:dddd:bb:dd): code", and "fallen off the bus" for either.
+// Continuation lines (" KEY=value") have no header. Called with log_classifier_lock held for reading.
+void kmsgClassifyLine(const char *line, size_t length) {
+    const char *end = line + length;
+    const char *message = memchr(line, ';', length);
+    if (message == NULL || line[0] == ' ') {
+        return;
+    }
+    message++;
+
+    size_t xid_end = 0;
+    LogMatch match = classifyLogLine(message, end - message, &xid_end);
+    uint32_t named = match.buses | match.xid_buses;
+    if (named == 0 || (match.events == 0 && match.aer_types == 0)) {
+        return;
+    }
+
+    // Microseconds since boot are the third header field
+    unsigned long long usec = 0;
+    const char *field = memchr(line, ',', message - line);
+    field = field != NULL ? memchr(field + 1, ',', message - field - 1) : NULL;
+    if (field != NULL) {
+        parseDecimal(field + 1, message, &usec);
+    }
+
+    unsigned long long code = 0;
+    bool has_code = false;
+    if (match.xid_buses != 0) {
+        const char *digits = message + xid_end;
+        while (digits < end && (*digits == ':' || *digits == ' ')) {
+            digits++;
+        }
+        has_code = parseDecimal(digits, end, &code);
+    }
+
+    pthread_mutex_lock(&kernel_events_lock);
+    double when = kernel_events.boot_seconds + usec / 1e6;
+    for (uint32_t buses = named; buses != 0; buses &= buses - 1) {
+        unsigned int bus = __builtin_ctz(buses);
+        GpuKernelEvents *events = &kernel_events.events[bus];
+        if (match.buses & (1u << bus)) {
+            if (match.events & (1u << GPU_KERNEL_EVENT_AER)) {
+                recordKernelEvent(events, GPU_KERNEL_EVENT_AER, when);
+            }
+            for (uint32_t types = match.aer_types; types != 0; types &= types - 1) {
+                events->aer_type_counts[__builtin_ctz(types)]++;
+            }
+        }
+        if (match.xid_buses & (1u << bus)) {
+            recordKernelEvent(events, GPU_KERNEL_EVENT_XID, when);
+            if (has_code && code < GPU_XID_CODE_COUNT) {
+                events->xid_counts[code]++;
+            }
+        }
+        if (match.events & (1u << GPU_KERNEL_EVENT_FALLEN_OFF_BUS)) {
+            recordKernelEvent(events, GPU_KERNEL_EVENT_FALLEN_OFF_BUS, when);
+        }
+    }
+    pthread_mutex_unlock(&kernel_events_lock);
+}
+
+// Open the kernel log and follow it on a thread of its own, false if it cannot be read
+bool startKmsgReader(void) {
+    kernel_events.fd = open(kmsg_path, O_RDONLY | O_CLOEXEC);
+    if (kernel_events.fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", kmsg_path, strerror(errno));
+        return false;
+    }
+
+    // Known GPUs are added to the classifier before the ring buffer is replayed, later ones when first sampled
+    for (unsigned int i = 0; i < cached_device_count; i++) {
+        char pciBusId[20];
+        if (getGpuPciBusId(i, pciBusId, sizeof(pciBusId)) == 0) {
+            logBusIndex(pciBusId);
+        }
+    }
+    pthread_mutex_lock(&kernel_events_lock);
+    struct timespec real, monotonic;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    kernel_events.boot_seconds = (real.tv_sec - monotonic.tv_sec) + (real.tv_nsec - monotonic.tv_nsec) / 1e9;
+    pthread_mutex_unlock(&kernel_events_lock);
+
+    kmsg_reader_running = true;
+    pthread_t reader_thread;
+    int err = pthread_create(&reader_thread, NULL, kmsgReader, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start kmsg reader: %s\n", strerror(err));
+        kmsg_reader_running = false;
+        close(kernel_events.fd);
+        return false;
+    }
+    return true;
+}
+
+// Blocks on the kernel log and classifies every record as it arrives. A regular
+// file standing in for /dev/kmsg is followed with inotify once its end is reached.
+void* kmsgReader(void* arg) {
+    (void)arg;
+    // A /dev/kmsg read returns exactly one record and fails if it does not fit
+    static char buffer[LOG_READ_SIZE];
+    int inotify_fd = -1;
+    struct stat st;
+    if (fstat(kernel_events.fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, kmsg_path, IN_MODIFY) < 0) {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+
+    while (1) {
+        ssize_t got = read(kernel_events.fd, buffer, sizeof(buffer));
+        if (got > 0) {
+            pthread_rwlock_rdlock(&log_classifier_lock);
+            splitLines(&kernel_events.carry, buffer, (size_t)got, kmsgClassifyLine);
+            pthread_rwlock_unlock(&log_classifier_lock);
+        } else if (got < 0 && (errno == EPIPE || errno == EINTR)) {
+            // EPIPE: the ring buffer overwrote records before they were read, go on with the oldest left
+            continue;
+        } else if (got == 0 && inotify_fd >= 0) {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            if (read(inotify_fd, events, sizeof(events)) < 0 && errno != EINTR) {
+                fprintf(stderr, "Failed to watch %s: %s\n", kmsg_path, strerror(errno));
+                break;
+            }
+        } else {
+            fprintf(stderr, "Failed to read %s: %s\n", kmsg_path, got < 0 ? strerror(errno) : "unexpected end of file");
+            break;
+        }
+    }
+
+    kmsg_reader_running = false;
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+    close(kernel_events.fd);
+    return NULL;
+}
+
+// Function to initialize NVML, to be called before any other NVML operations
+bool initializeNvml(void) {
+    nvmlReturn_t result = nvmlInit();
+    if (result == NVML_SUCCESS) {
+        return true; // Initialization successful
+    } else {
+        fprintf(stderr, "Failed to initialize NVML: %s\n", nvmlErrorString(result));
+        return false; // Initialization failed
+    }
+}
+
+// Mark the handle cache stale if NVML reports the GPU or the driver went away
+bool invalidateHandleCacheOnError(nvmlReturn_t result) {
+    if (result == NVML_ERROR_GPU_IS_LOST ||
+        result == NVML_ERROR_UNINITIALIZED ||
+        result == NVML_ERROR_DRIVER_NOT_LOADED) {
+        handle_cache_valid = false;
+        return true;
+    }
+    return false;
+}
+
+// NVML cannot answer this on the driver or device at all, as opposed to failing this time
+bool nvmlUnsupported(nvmlReturn_t result) {
+    return result == NVML_ERROR_NOT_SUPPORTED || result == NVML_ERROR_FUNCTION_NOT_FOUND;
+}
+
+// (Re)initialize NVML and fetch a handle and PCI info for every device
+bool rebuildDeviceHandleCache(void) {
+    if (nvml_initialized) {
+        // A driver reload leaves the old session unusable, start a fresh one
+        nvmlShutdown();
+        nvml_initialized = false;
+        handle_cache_rebuilds++;
+    }
+    memset(device_handles, 0, sizeof(device_handles));
+    cached_device_count = 0;
+    // Device indices may now point at different GPUs
+    unmapAllRegisterWindows();
+    pci_index_valid = false;
+
+    if (!initializeNvml()) {
+        return false;
+    }
+    nvml_initialized = true;
+
+    unsigned int count;
+    nvmlReturn_t result = nvmlDeviceGetCount(&count);
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get device count: %s\n", nvmlErrorString(result));
+        return false;
+    }
+    if (count > MAX_DEVICES) {
+        fprintf(stderr, "Found %u devices, only the first %d will be monitored\n", count, MAX_DEVICES);
+        count = MAX_DEVICES;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        result = nvmlDeviceGetHandleByIndex(i, &device_handles[i].handle);
+        if (result != NVML_SUCCESS) {
+            fprintf(stderr, "Failed to get handle for device %u: %s\n", i, nvmlErrorString(result));
+            continue;
+        }
+
+        result = nvmlDeviceGetPciInfo(device_handles[i].handle, &device_handles[i].pci_info);
+        if (result != NVML_SUCCESS) {
+            fprintf(stderr, "Failed to get PCI info for device %u: %s\n", i, nvmlErrorString(result));
+            continue;
+        }
+
+        result = nvmlDeviceGetName(device_handles[i].handle, device_handles[i].name, sizeof(device_handles[i].name));
+        if (result != NVML_SUCCESS) {
+            fprintf(stderr, "Failed to get name for device %u: %s\n", i, nvmlErrorString(result));
+            device_handles[i].name[0] = '\0';
+        }
+        device_handles[i].name[sizeof(device_handles[i].name) - 1] = '\0'; // Ensure null termination
+
+        result = nvmlDeviceGetUUID(device_handles[i].handle, device_handles[i].uuid, sizeof(device_handles[i].uuid));
+        if (result != NVML_SUCCESS) {
+            fprintf(stderr, "Failed to get UUID for device %u: %s\n", i, nvmlErrorString(result));
+            device_handles[i].uuid[0] = '\0';
+        }
+        device_handles[i].uuid[sizeof(device_handles[i].uuid) - 1] = '\0'; // Ensure null termination
+        device_handles[i].valid = true;
+    }
+
+    refreshHostIdentity();
+    identity_generation++;
+    cached_device_count = count;
+    handle_cache_valid = true;
+    rebuildLogBuses();
+    return true;
+}
+
+// Function to check if there's an error state for a given GPU
+unsigned int checkGpuErrorState(unsigned int gpuIndex) {
+    unsigned int fanSpeed;
+    nvmlReturn_t result;
+
+    // Use the cached handle for the specified GPU
+    if (gpuIndex >= cached_device_count || !device_handles[gpuIndex].valid) {
+        fprintf(stderr, "No valid handle for GPU %u\n", gpuIndex);
+        return 2; // Error state
+    }
+
+    // Attempt to get the fan speed for the GPU
+    result = nvmlDeviceGetFanSpeed(device_handles[gpuIndex].handle, &fanSpeed);
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get fan speed for GPU %u: %s\n", gpuIndex, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        return 2; // Error state
+    }
+
+    return 1; // No error state
+}
+
+// Function to print the help message
+void printHelpMessage(void) {
+    printf("Usage: nvml_direct_access [options]\n");
+    printf("Options:\n");
+    printf("  --help, -h      Show this help message and exit\n");
+    printf("  --no-console    Disable console output of GPU metrics\n");
+    printf("  --workers N     Number of threads sampling GPUs in parallel (default: number of CPU cores)\n");
+    printf("  --register-backend auto|devmem|sysfs|file:<dir>\n");
+    printf("                  How BAR0 registers are read: /dev/mem (needs iomem=relaxed), the sysfs\n");
+    printf("                  resource0 file, or <dir>/<bus id> BAR0 images (default: auto, sysfs then devmem)\n");
+    printf("  --register-hz N Sample the VRAM and hot spot registers N times per second and export\n");
+    printf("                  _min, _max, _avg, _p95 and _p99 of each update window (default: off)\n");
+    printf("  --listen [host:]port Serve /metrics straight from memory on an embedded HTTP listener\n");
+    printf("  --no-metrics-file Do not write metrics.txt, requires --listen\n");
+    printf("  --shm NAME      Name of the shared memory snapshot for metrics_exporter --shm and\n");
+    printf("                  check_gpu_fan_speed (default: %s)\n", GPU_SNAPSHOT_SHM_NAME);
+    printf("  --no-shm        Do not publish the shared memory snapshot\n");
+    printf("  --syslog PATH   Log followed for GPU_AER_TOTAL_ERRORS on kernels without sysfs AER counters\n");
+    printf("                  (default: %s)\n", SYSLOG_PATH);
+    printf("  --sysfs-root DIR Where sysfs is mounted, for the AER counters and the sysfs register backend (default: /sys)\n");
+    printf("  --kmsg PATH     Kernel log followed for the GPU_KERNEL_EVENT* and GPU_XID_ERRORS_TOTAL metrics,\n");
+    printf("                  a file in the same format can stand in for testing (default: %s)\n", KMSG_PATH);
+    printf("\n");
+    printf("Available metrics that can be added to metrics.ini:\n");
+    for (unsigned int f = 0; f < METRIC_FIELD_COUNT; f++) {
+        const MetricDescriptor *metric = &metricRegistry[f];
+        printf("  %s%s\n", metric->name, metric->tier == GPU_METRIC_TIER_HOST ? " (always enabled, only the interval can be changed)" : "");
+    }
+    printf("\n");
+    printf("Add any of the above metrics to the metrics.ini file to enable them.\n");
+    printf("Each entry can be followed by its own sampling interval (default 5s), e.g.:\n");
+    printf("  DCGM_FI_DEV_VRAM_TEMP 250ms\n");
+    printf("  GPU_AER_TOTAL_ERRORS 60s\n");
+    printf("\n");
+    printf("Example of console output when not disabled:\n");
+    printf("GPU Name: NVIDIA RTX A6000 GPU 0: Temperature: 30 C Power Usage: 28.38 W VRAM Temp: 54 C HotSpotTemp: 38 C Fan: 10%% Core Utilization: 1%%\n");
+}
+
+// Start a new snapshot in the back buffer, seeded with the last published values
+// so metrics that are not due this cycle keep their previous reading
+DeviceData* beginSnapshot(void) {
+    unsigned int front = atomic_load_explicit(&front_buffer, memory_order_acquire);
+    SnapshotBuffer *back = &snapshot_buffers[front ^ 1];
+
+    atomic_fetch_add_explicit(&back->sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(back->snapshot.devices, snapshot_buffers[front].snapshot.devices, sizeof(back->snapshot.devices));
+    return back->snapshot.devices;
+}
+
+// Make the back buffer the one readers see
+void publishSnapshot(unsigned int device_count) {
+    unsigned int back_index = atomic_load_explicit(&front_buffer, memory_order_relaxed) ^ 1;
+    SnapshotBuffer *back = &snapshot_buffers[back_index];
+
+    back->snapshot.generation = ++snapshot_generation;
+    back->snapshot.identity = identity_generation;
+    back->snapshot.device_count = device_count;
+    clock_gettime(CLOCK_REALTIME, &back->snapshot.timestamp);
+    atomic_fetch_add_explicit(&back->sequence, 1, memory_order_release);
+    atomic_store_explicit(&front_buffer, back_index, memory_order_release);
+}
+
+// Copy the latest published snapshot, retrying if the writer reused the buffer mid-copy
+void readSnapshot(MetricsSnapshot* out) {
+    while (1) {
+        unsigned int front = atomic_load_explicit(&front_buffer, memory_order_acquire);
+        const SnapshotBuffer *buffer = &snapshot_buffers[front];
+        unsigned int before = atomic_load_explicit(&buffer->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(out, &buffer->snapshot, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&buffer->sequence, memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+unsigned long long fieldValueAsULL(const nvmlFieldValue_t* field) {
+    switch (field->valueType) {
+        case NVML_VALUE_TYPE_DOUBLE:
+            return (unsigned long long)field->value.dVal;
+        case NVML_VALUE_TYPE_UNSIGNED_INT:
+            return field->value.uiVal;
+        case NVML_VALUE_TYPE_UNSIGNED_LONG:
+            return field->value.ulVal;
+        case NVML_VALUE_TYPE_SIGNED_LONG_LONG:
+            return field->value.sllVal < 0 ? 0 : (unsigned long long)field->value.sllVal;
+        default:
+            return field->value.ullVal;
+    }
+}
+
+// Fetch every enabled metric NVML exposes as a field value with a single
+// nvmlDeviceGetFieldValues call. Fields the driver rejects are remembered
+// per device and left to the individual calls in sampleFieldMetrics().
+bool sampleFieldValues(unsigned int i, uint32_t due, bool* power_sampled) {
+    DeviceHandle *handle = &device_handles[i];
+    nvmlFieldValue_t fields[MAX_FIELD_REQUESTS];
+    int field_count = 0;
+    int power_field = -1;
+    int nvlink_first = -1;
+
+    memset(fields, 0, sizeof(fields));
+#ifdef NVML_FI_DEV_POWER_INSTANT
+    if ((due & METRIC_BIT(GPU_METRIC_POWER_USAGE)) && !handle->power_field_unsupported) {
+        power_field = field_count;
+        fields[field_count++].fieldId = NVML_FI_DEV_POWER_INSTANT;
+    }
+#endif
+#ifdef NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX
+    if ((due & METRIC_BIT(GPU_METRIC_NVLINK_BANDWIDTH_TOTAL)) && !handle->nvlink_field_unsupported) {
+        nvlink_first = field_count;
+        for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+            fields[field_count].fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX;
+            fields[field_count++].scopeId = link;
+            fields[field_count].fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX;
+            fields[field_count++].scopeId = link;
         }
     }
+#endif
+    if (field_count == 0) {
+        return true;
+    }
 
+    nvmlReturn_t result = nvmlDeviceGetFieldValues(handle->handle, field_count, fields);
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get field values for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        if (nvmlUnsupported(result)) {
+            // Older drivers without field value support, stop asking
+            handle->power_field_unsupported = true;
+            handle->nvlink_field_unsupported = true;
+        }
+        return false;
+    }
 
-    // Open the metrics file in write mode to overwrite the existing content
-    cleanup_sig_handler();
-
-    MetricsConfig metricsConfig;
-    loadMetricsConfig(&metricsConfig);
-
-    while(1){
-        // Initialize PCI library
-        struct pci_access *pacc = pci_alloc();
-        nvmlReturn_t result = nvmlInit();
-        if (result != NVML_SUCCESS) {
-            fprintf(stderr, "Failed to initialize NVML: %s\n", nvmlErrorString(result));
-            return 1;
+    if (power_field >= 0) {
+        if (fields[power_field].nvmlReturn == NVML_SUCCESS) {
+            devices[i].power_usage = fieldValueAsULL(&fields[power_field]);
+            *power_sampled = true;
+        } else if (nvmlUnsupported(fields[power_field].nvmlReturn)) {
+            handle->power_field_unsupported = true;
         }
+    }
 
-        unsigned int device_count;
-        result = nvmlDeviceGetCount(&device_count);
-        if (result != NVML_SUCCESS) {
-            fprintf(stderr, "Failed to get device count: %s\n", nvmlErrorString(result));
-            nvmlShutdown();
-            return 1;
+    if (nvlink_first >= 0) {
+        unsigned long long total = 0;
+        bool any_link = false;
+        bool all_unsupported = true;
+        for (int f = nvlink_first; f < nvlink_first + 2 * NVML_NVLINK_MAX_LINKS; f++) {
+            if (fields[f].nvmlReturn == NVML_SUCCESS) {
+                total += fieldValueAsULL(&fields[f]);
+                any_link = true;
+            }
+            all_unsupported = all_unsupported && nvmlUnsupported(fields[f].nvmlReturn);
+        }
+        if (any_link) {
+            devices[i].nvlink_bandwidth_total = total;
+        } else if (all_unsupported) {
+            // No NVLink on this device, there is no per-call fallback either
+            handle->nvlink_field_unsupported = true;
         }
+    }
+    return true;
+}
 
-        pci_init(pacc);
-        pci_scan_bus(pacc);
+// Sample the due metrics of one device into its DeviceData slot through the registry's samplers
+void sampleDevice(unsigned int i, uint32_t due) {
+    if (!device_handles[i].valid) {
+        return;
+    }
 
-        for (unsigned int i = 0; i < device_count; i++) {
-            nvmlDevice_t nvml_device;
-            unsigned long long clocksThrottleReasons;
-            char device_name[NVML_DEVICE_NAME_BUFFER_SIZE];
+    // Name and UUID were fetched with the handle
+    memcpy(devices[i].device_name, device_handles[i].name, sizeof(devices[i].device_name));
+    memcpy(devices[i].uuid, device_handles[i].uuid, sizeof(devices[i].uuid));
 
-            // Store data in the devices array
+    due &= ~host_metrics;
+    while (due != 0) {
+        unsigned int field = __builtin_ctz(due);
+        due &= ~(metricRegistry[field].sample(i, due) | METRIC_BIT(field));
+    }
+}
 
-            result = nvmlDeviceGetHandleByIndex(i, &nvml_device);
-            if (result != NVML_SUCCESS) {
-                fprintf(stderr, "Failed to get handle for device %u: %s\n", i, nvmlErrorString(result));
-                continue;
-            }
+uint32_t sampleRegisterTemps(unsigned int i, uint32_t due) {
+    sampleRegisters(i, due);
+    return register_metrics;
+}
 
-            result = nvmlDeviceGetName(nvml_device, device_name, NVML_DEVICE_NAME_BUFFER_SIZE);
-            if (result == NVML_SUCCESS) {
-                // Ensure null termination of device_name
-                device_name[NVML_DEVICE_NAME_BUFFER_SIZE - 1] = '\0';
-                strncpy(devices[i].device_name, device_name, sizeof(devices[i].device_name));
-                devices[i].device_name[sizeof(devices[i].device_name) - 1] = '\0'; // Ensure null termination
-            } else {
-                fprintf(stderr, "Failed to get name for device: %s\n", nvmlErrorString(result));
-                devices[i].device_name[0] = '\0'; // Ensure the string is empty in case of failure
-            }
+// Power and NVLink come from one batched field value call, power falls back to its own call
+uint32_t sampleFieldMetrics(unsigned int i, uint32_t due) {
+    bool power_sampled = false;
+    sampleFieldValues(i, due, &power_sampled);
 
-            nvmlPciInfo_t pciInfo;
-            result = nvmlDeviceGetPciInfo(nvml_device, &pciInfo);
-            if (result != NVML_SUCCESS) {
-                fprintf(stderr, "Failed to get PCI info for device %u: %s\n", i, nvmlErrorString(result));
-                continue;
-            }
+    if ((due & METRIC_BIT(GPU_METRIC_POWER_USAGE)) && !power_sampled) {
+        unsigned int power;
+        nvmlReturn_t result = nvmlDeviceGetPowerUsage(device_handles[i].handle, &power);
+        if (result == NVML_SUCCESS) {
+            devices[i].power_usage = power;
+        } else {
+            fprintf(stderr, "Failed to get power usage for device %u: %s\n", i, nvmlErrorString(result));
+            invalidateHandleCacheOnError(result);
+            devices[i].power_usage = 0;
+        }
+    }
+    return METRIC_BIT(GPU_METRIC_POWER_USAGE) | METRIC_BIT(GPU_METRIC_NVLINK_BANDWIDTH_TOTAL);
+}
 
-            // Collect metrics
-            if (metricsConfig.gpu_temp) {
-                unsigned int temp;
-                result = nvmlDeviceGetTemperature(nvml_device, NVML_TEMPERATURE_GPU, &temp);
-                if (result == NVML_SUCCESS) {
-                    devices[i].gpu_temp = temp;
-                } else {
-                    fprintf(stderr, "Failed to get temperature for device %u: %s\n", i, nvmlErrorString(result));
-                    devices[i].gpu_temp = 0;
-                }
-            }
+uint32_t sampleGpuTemp(unsigned int i, uint32_t due) {
+    (void)due;
+    unsigned int temp;
+    nvmlReturn_t result = nvmlDeviceGetTemperature(device_handles[i].handle, NVML_TEMPERATURE_GPU, &temp);
+    if (result == NVML_SUCCESS) {
+        devices[i].gpu_temp = temp;
+    } else {
+        fprintf(stderr, "Failed to get temperature for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        devices[i].gpu_temp = 0;
+    }
+    return METRIC_BIT(GPU_METRIC_GPU_TEMP);
+}
 
-            if (metricsConfig.power_usage) {
-                unsigned int power;
-                result = nvmlDeviceGetPowerUsage(nvml_device, &power);
-                if (result == NVML_SUCCESS) {
-                    devices[i].power_usage = power;
-                } else {
-                    fprintf(stderr, "Failed to get power usage for device %u: %s\n", i, nvmlErrorString(result));
-                    devices[i].power_usage = 0;
-                }
-            }
+uint32_t sampleSmClock(unsigned int i, uint32_t due) {
+    (void)due;
+    unsigned int sm_clock;
+    nvmlReturn_t result = nvmlDeviceGetClockInfo(device_handles[i].handle, NVML_CLOCK_SM, &sm_clock);
+    if (result == NVML_SUCCESS) {
+        devices[i].sm_clock = sm_clock;
+    } else {
+        fprintf(stderr, "Failed to get SM clock for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        devices[i].sm_clock = 0;
+    }
+    return METRIC_BIT(GPU_METRIC_SM_CLOCK);
+}
 
-            // Additional metrics
-            if (metricsConfig.sm_clock) {
-                unsigned int sm_clock;
-                result = nvmlDeviceGetClockInfo(nvml_device, NVML_CLOCK_SM, &sm_clock);
-                if (result == NVML_SUCCESS) {
-                    devices[i].sm_clock = sm_clock;
-                } else {
-                    fprintf(stderr, "Failed to get SM clock for device %u: %s\n", i, nvmlErrorString(result));
-                    devices[i].sm_clock = 0;
-                }
-            }
+uint32_t sampleMemClock(unsigned int i, uint32_t due) {
+    (void)due;
+    unsigned int mem_clock;
+    nvmlReturn_t result = nvmlDeviceGetClockInfo(device_handles[i].handle, NVML_CLOCK_MEM, &mem_clock);
+    if (result == NVML_SUCCESS) {
+        devices[i].mem_clock = mem_clock;
+    } else {
+        fprintf(stderr, "Failed to get Memory clock for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        devices[i].mem_clock = 0;
+    }
+    return METRIC_BIT(GPU_METRIC_MEM_CLOCK);
+}
 
-            if (metricsConfig.mem_clock) {
-                unsigned int mem_clock;
-                result = nvmlDeviceGetClockInfo(nvml_device, NVML_CLOCK_MEM, &mem_clock);
-                if (result == NVML_SUCCESS) {
-                    devices[i].mem_clock = mem_clock;
-                } else {
-                    fprintf(stderr, "Failed to get Memory clock for device %u: %s\n", i, nvmlErrorString(result));
-                    devices[i].mem_clock = 0;
-                }
-            }
+// The error state probe is a fan speed read, so a due error state is served from the same call
+uint32_t sampleFanSpeed(unsigned int i, uint32_t due) {
+    uint32_t covered = METRIC_BIT(GPU_METRIC_FAN_SPEED);
+    unsigned int fan_speed;
+    nvmlReturn_t result = nvmlDeviceGetFanSpeed(device_handles[i].handle, &fan_speed);
+    if (result == NVML_SUCCESS) {
+        devices[i].fan_speed = fan_speed;
+    } else {
+        fprintf(stderr, "Failed to get fan speed for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        devices[i].fan_speed = 0;
+    }
+    if (due & METRIC_BIT(GPU_METRIC_AER_ERROR_STATE)) {
+        devices[i].error_state = result == NVML_SUCCESS ? 1 : 2;
+        covered |= METRIC_BIT(GPU_METRIC_AER_ERROR_STATE);
+    }
+    return covered;
+}
 
-            if (metricsConfig.fan_speed) {
-                unsigned int fan_speed;
-                result = nvmlDeviceGetFanSpeed(nvml_device, &fan_speed);
-                if (result == NVML_SUCCESS) {
-                    devices[i].fan_speed = fan_speed;
-                } else {
-                    fprintf(stderr, "Failed to get fan speed for device %u: %s\n", i, nvmlErrorString(result));
-                    devices[i].fan_speed = 0;
-                }
-            }
+uint32_t sampleErrorState(unsigned int i, uint32_t due) {
+    if (due & METRIC_BIT(GPU_METRIC_FAN_SPEED)) {
+        return sampleFanSpeed(i, due);
+    }
+    devices[i].error_state = checkGpuErrorState(i);
+    return METRIC_BIT(GPU_METRIC_AER_ERROR_STATE);
+}
 
-            if (metricsConfig.gpu_util || metricsConfig.mem_util) {
-                nvmlUtilization_t utilization;
-                result = nvmlDeviceGetUtilizationRates(nvml_device, &utilization);
-                if (result == NVML_SUCCESS) {
-                    if (metricsConfig.gpu_util) {
-                        devices[i].gpu_util = utilization.gpu;
-                    }
-                    if (metricsConfig.mem_util) {
-                        devices[i].mem_util = utilization.memory;
-                    }
-                } else {
-                    fprintf(stderr, "Failed to get utilization rates for device %u: %s\n", i, nvmlErrorString(result));
-                    if (metricsConfig.gpu_util) {
-                        devices[i].gpu_util = 0;
-                    }
-                    if (metricsConfig.mem_util) {
-                        devices[i].mem_util = 0;
-                    }
-                }
-            }
+uint32_t sampleUtilization(unsigned int i, uint32_t due) {
+    nvmlUtilization_t utilization;
+    nvmlReturn_t result = nvmlDeviceGetUtilizationRates(device_handles[i].handle, &utilization);
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get utilization rates for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        memset(&utilization, 0, sizeof(utilization));
+    }
+    if (due & METRIC_BIT(GPU_METRIC_GPU_UTIL)) {
+        devices[i].gpu_util = utilization.gpu;
+    }
+    if (due & METRIC_BIT(GPU_METRIC_MEM_COPY_UTIL)) {
+        devices[i].mem_util = utilization.memory;
+    }
+    return METRIC_BIT(GPU_METRIC_GPU_UTIL) | METRIC_BIT(GPU_METRIC_MEM_COPY_UTIL);
+}
 
-            if (metricsConfig.fb_free || metricsConfig.fb_used) {
-                nvmlMemory_t memory;
-                result = nvmlDeviceGetMemoryInfo(nvml_device, &memory);
-                if (result == NVML_SUCCESS) {
-                    if (metricsConfig.fb_free) {
-                        devices[i].fb_free = memory.free / (1024 * 1024); // Convert to MB
-                    }
-                    if (metricsConfig.fb_used) {
-                        devices[i].fb_used = memory.used / (1024 * 1024); // Convert to MB
-                    }
-                } else {
-                    fprintf(stderr, "Failed to get memory info for device %u: %s\n", i, nvmlErrorString(result));
-                    if (metricsConfig.fb_free) {
-                        devices[i].fb_free = 0;
-                    }
-                    if (metricsConfig.fb_used) {
-                        devices[i].fb_used = 0;
-                    }
-                }
-            }
+uint32_t sampleMemoryInfo(unsigned int i, uint32_t due) {
+    nvmlMemory_t memory;
+    nvmlReturn_t result = nvmlDeviceGetMemoryInfo(device_handles[i].handle, &memory);
+    if (result != NVML_SUCCESS) {
+        fprintf(stderr, "Failed to get memory info for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+        memset(&memory, 0, sizeof(memory));
+    }
+    if (due & METRIC_BIT(GPU_METRIC_FB_FREE)) {
+        devices[i].fb_free = memory.free / (1024 * 1024); // Convert to MB
+    }
+    if (due & METRIC_BIT(GPU_METRIC_FB_USED)) {
+        devices[i].fb_used = memory.used / (1024 * 1024); // Convert to MB
+    }
+    return METRIC_BIT(GPU_METRIC_FB_FREE) | METRIC_BIT(GPU_METRIC_FB_USED);
+}
 
-            for (struct pci_dev *pci_dev = pacc->devices; pci_dev; pci_dev = pci_dev->next) {
-                pci_fill_info(pci_dev, PCI_FILL_IDENT | PCI_FILL_BASES | PCI_FILL_CLASS);
-                unsigned int combinedDeviceId = (pci_dev->device_id << 16) | pci_dev->vendor_id;
+uint32_t sampleThrottleReasons(unsigned int i, uint32_t due) {
+    (void)due;
+    unsigned long long clocksThrottleReasons;
+    nvmlReturn_t result = nvmlDeviceGetCurrentClocksThrottleReasons(device_handles[i].handle, &clocksThrottleReasons);
+    if (result == NVML_SUCCESS) {
+        devices[i].clock_throttle_reasons = clocksThrottleReasons;
+    } else {
+        fprintf(stderr, "Failed to get clocks throttle reasons for device %u: %s\n", i, nvmlErrorString(result));
+        invalidateHandleCacheOnError(result);
+    }
+    return METRIC_BIT(GPU_METRIC_CLOCKS_THROTTLE_REASON);
+}
 
-                if (combinedDeviceId == pciInfo.pciDeviceId &&
-                    (unsigned int)pci_dev->domain == pciInfo.domain &&
-                    pci_dev->bus == pciInfo.bus &&
-                    pci_dev->dev == pciInfo.device) {
+// GPU_AER_DEV_ERRORS_TOTAL and GPU_AER_TOTAL_ERRORS both come from the sysfs counters.
+// GPU_AER_TOTAL_ERRORS falls back to counting syslog lines on kernels without them.
+uint32_t sampleAerCounters(unsigned int i, uint32_t due) {
+    AerSysfsFiles *files = &aer_sysfs[i];
+    if (files->identity != identity_generation) {
+        openAerSysfsFiles(i);
+    }
 
-                    fd = open(MEM_PATH, O_RDWR | O_SYNC);
-                    if (fd < 0) {
-                        perror("Failed to open /dev/mem");
-                        continue;
-                    }
+    GpuAerCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    for (unsigned int port = 0; port < GPU_AER_PORT_COUNT; port++) {
+        bool complete = true;
+        for (unsigned int severity = 0; severity < GPU_AER_SEVERITY_COUNT && complete; severity++) {
+            complete = readAerTotal(files->fds[port][severity], &counters.errors[port][severity]);
+        }
+        if (complete) {
+            counters.ports |= 1u << port;
+        }
+    }
+    devices[i].aer_dev = counters;
 
-                    uint32_t phys_addr =  (pci_dev->base_addr[0] & 0xFFFFFFFF) + VRAM_REGISTER_OFFSET;
-                    uint32_t base_offset = phys_addr & ~(PG_SZ-1);
-                    map_base = mmap(0, PG_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base_offset);
-                    if (map_base == MAP_FAILED) {
-                        perror("Failed to map BAR0 memory");
-                        close(fd);
-                        continue;
-                    }
+    if (due & METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS)) {
+        if (counters.ports & (1u << GPU_AER_PORT_DEVICE)) {
+            const uint64_t *errors = counters.errors[GPU_AER_PORT_DEVICE];
+            devices[i].aer_total_errors = (unsigned int)(errors[GPU_AER_CORRECTABLE] + errors[GPU_AER_NONFATAL] + errors[GPU_AER_FATAL]);
+            devices[i].aer_total_pending = false;
+        } else {
+            devices[i].aer_total_pending = !getTotalAerErrorsForDevice(i, &devices[i].aer_total_errors);
+        }
+    }
+    return METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS) | METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS);
+}
 
-                    uint32_t *vram_temp_reg = (uint32_t *)((char *)map_base + (phys_addr - base_offset));
-                    uint32_t vram_temp_value = *vram_temp_reg;
-                    vram_temp_value = ((vram_temp_value & 0x00000fff) / 0x20);
-                    if (i < MAX_DEVICES) {
-                        devices[i].vram_temp = vram_temp_value;
-                    } else {
-                        fprintf(stderr, "Exceeded maximum number of devices\n");
-                    }
+// Copy of what the kmsg reader counted for the GPU's bus id so far
+uint32_t sampleKernelEvents(unsigned int i, uint32_t due) {
+    (void)due;
+    memset(&devices[i].kernel_events, 0, sizeof(devices[i].kernel_events));
+    char pciBusId[20];
+    int bus = getGpuPciBusId(i, pciBusId, sizeof(pciBusId)) == 0 ? logBusIndex(pciBusId) : -1;
+    if (bus >= 0) {
+        pthread_mutex_lock(&kernel_events_lock);
+        devices[i].kernel_events = kernel_events.events[bus];
+        pthread_mutex_unlock(&kernel_events_lock);
+    }
+    return kernel_event_metrics;
+}
 
-                    char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
-                    result = nvmlDeviceGetUUID(nvml_device, uuid, sizeof(uuid));
-                    if (result == NVML_SUCCESS) {
-                        // Ensure null termination of uuid
-                        uuid[NVML_DEVICE_UUID_BUFFER_SIZE - 1] = '\0';
-                        strncpy(devices[i].uuid, uuid, sizeof(devices[i].uuid));
-                        devices[i].uuid[sizeof(devices[i].uuid) - 1] = '\0'; // Ensure null termination 
-                    } else {
-                        fprintf(stderr, "Failed to get UUID for device %d: %s\n", i, nvmlErrorString(result));
-                        devices[i].uuid[0] = '\0'; // Ensure the string is empty in case of failure
-                    }
+// Host tier, called once per cycle instead of per device
+uint32_t sampleUpgradablePackages(unsigned int i, uint32_t due) {
+    (void)i;
+    (void)due;
+    upgradable_packages = countUpgradablePackages();
+    return METRIC_BIT(GPU_METRIC_APT_UPGRADABLE_PACKAGES);
+}
 
-                    if (i < MAX_DEVICES) {
-                        strncpy(devices[i].uuid, uuid, sizeof(devices[i].uuid));
-                        devices[i].uuid[sizeof(devices[i].uuid) - 1] = '\0'; // Ensure null termination
-                    } else {
-                        fprintf(stderr, "Exceeded maximum number of devices\n");
-                    }
+// Read the VRAM and hot spot registers of one device through its BAR0 window
+void sampleRegisters(unsigned int i, uint32_t due) {
+    struct pci_dev *pci_dev = lookupPciDevice(&device_handles[i].pci_info);
+    RegisterWindow *win = &register_windows[i];
+    if (pci_dev == NULL) {
+        if (!device_handles[i].pci_missing) {
+            fprintf(stderr, "No PCI device found for GPU %u\n", i);
+            device_handles[i].pci_missing = true;
+            // Stop the register sampler from reading a BAR that is gone
+            pthread_mutex_lock(&register_lock);
+            unmapRegisterWindow(win);
+            pthread_mutex_unlock(&register_lock);
+        }
+        pci_rescan_wanted = true;
+        return;
+    }
+    device_handles[i].pci_missing = false;
 
-                    // Code to read the hot spot temperature for the current device
-                    uint32_t hotSpotRegAddr = (pci_dev->base_addr[0] & 0xFFFFFFFF) + HOTSPOT_REGISTER_OFFSET;
-                    uint32_t hotSpotBaseOffset = hotSpotRegAddr & ~(PG_SZ-1);
-                    void* hotSpotMapBase = mmap(0, PG_SZ, PROT_READ, MAP_SHARED, fd, hotSpotBaseOffset);
-                    if (hotSpotMapBase == MAP_FAILED) {
-                        fprintf(stderr, "Failed to mmap for hot spot temperature\n");
-                        continue; // Skip this device if we cannot map the register space
-                    }
+    // Held across the reads, like the register sampler, so a rebuild cannot unmap the pages mid-read
+    pthread_mutex_lock(&register_lock);
+    if (mapRegisterWindow(win, pci_dev)) {
+        if (due & METRIC_BIT(GPU_METRIC_VRAM_TEMP)) {
+            devices[i].vram_temp = decodeVramTemp(readRegister(win->vram_page, win->vram_offset));
+        }
 
-                    uint32_t hotSpotRegValue = *((uint32_t *)((char *)hotSpotMapBase + (hotSpotRegAddr - hotSpotBaseOffset)));
-                    munmap(hotSpotMapBase, PG_SZ); // Unmap immediately after reading
+        unsigned int hotSpotTemp;
+        if ((due & METRIC_BIT(GPU_METRIC_HOT_SPOT_TEMP)) && decodeHotspotTemp(readRegister(win->hotspot_page, win->hotspot_offset), &hotSpotTemp)) {
+            devices[i].hotspot_temp = hotSpotTemp;
+        }
+    }
+    pthread_mutex_unlock(&register_lock);
+}
 
-                    uint32_t hotSpotTemp = (hotSpotRegValue >> 8) & 0xff;
-                    if (hotSpotTemp < 0x7f) {
-                        if (i < MAX_DEVICES) {
-                            devices[i].hotspot_temp = hotSpotTemp;
-                        } else {
-                            fprintf(stderr, "Exceeded maximum number of devices\n");
-                        }
-                    }
+uint64_t monotonicMillis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-                    if (metricsConfig.clocks_throttle_reason) {
-                        result = nvmlDeviceGetCurrentClocksThrottleReasons(nvml_device, &clocksThrottleReasons);
-                        if (NVML_SUCCESS != result) {
-                            fprintf(stderr, "Failed to get clocks throttle reasons for device %d: %s\n", i, nvmlErrorString(result));
-                            continue;
-                        }
-
-                        if (i < MAX_DEVICES) {
-                            devices[i].clock_throttle_reasons = clocksThrottleReasons;
-                        } else {
-                            fprintf(stderr, "Exceeded maximum number of devices\n");
-                        }
-                    }
+// Sleep until an absolute CLOCK_MONOTONIC deadline so time spent working never shifts the schedule
+void sleepUntilMillis(uint64_t deadline_ms) {
+    struct timespec deadline = { .tv_sec = deadline_ms / 1000, .tv_nsec = (deadline_ms % 1000) * 1000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+        // Interrupted by a signal, keep waiting for the same deadline
+    }
+}
 
-                    // Flush the stream to write to the file immediately
-                    if (map_base != MAP_FAILED) {
-                        munmap(map_base, PG_SZ);
-                        map_base = MAP_FAILED; // Reset to indicate it's unmapped
-                    }
-                    if (fd != -1) {
-                        close(fd);
-                        fd = -1; // Reset to indicate it's closed
-                    }
-                    break; // Break from the PCI device loop once matched
-                }
+double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* samplingWorker(void* arg) {
+    WorkerPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next_device >= pool->queue_length) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        unsigned long long generation = pool->generation;
+        unsigned int i = pool->queue[pool->next_device++];
+        uint32_t due = pool->due;
+        pthread_mutex_unlock(&pool->lock);
+        sampleDevice(i, due);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->busy[i] = false;
+        // A batch that already gave up on this device does not wait for it anymore
+        if (pool->generation == generation) {
+            pool->done[i] = true;
+            if (--pool->pending == 0) {
+                pthread_cond_signal(&pool->work_done);
             }
+        } else {
+            // A rebuild may be waiting for the workers to leave NVML
+            pthread_cond_signal(&pool->work_done);
         }
-        createMetricFile(device_count, &metricsConfig);
-        // If console output is enabled, print the metrics to console
-        if (console_output) {
-            printConsoleOutput(&metricsConfig);
+    }
+    return NULL;
+}
+
+bool startWorkerPool(unsigned int worker_count) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&worker_pool.work_done);
+    pthread_cond_init(&worker_pool.work_done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (unsigned int w = 0; w < worker_count; w++) {
+        int err = pthread_create(&worker_pool.threads[w], NULL, samplingWorker, &worker_pool);
+        if (err != 0) {
+            fprintf(stderr, "Failed to start sampling worker: %s\n", strerror(err));
+            break;
         }
-        pci_cleanup(pacc);
-        nvmlShutdown();
-        sleep(5);
+        worker_pool.worker_count++;
     }
+    return worker_pool.worker_count > 0;
+}
 
-    return 0;
+// Mark a device's slot as holding the values of an earlier cycle
+void markDeviceStale(DeviceData *slot, unsigned int i, unsigned int timeout_ms) {
+    if (!slot->stale) {
+        fprintf(stderr, "GPU %u did not finish sampling within %u ms, publishing its previous values\n", i, timeout_ms);
+    }
+    slot->stale = true;
 }
 
-void printConsoleOutput(MetricsConfig* metricsConfig) {
-    FILE* fp = fopen("metrics.txt", "r");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to open metrics.txt for reading\n");
+// Sample all devices into slots, seeded with their previous values. The worker pool gets
+// timeout_ms; a device that has not finished by then, or is still stuck in an earlier
+// batch, keeps its previous values marked stale so one hung NVML call cannot hold
+// back the snapshot of every other GPU. Without workers devices are sampled in turn.
+void sampleAllDevices(DeviceData *slots, unsigned int device_count, uint32_t due, unsigned int timeout_ms) {
+    double start = monotonicSeconds();
+
+    if (worker_pool.worker_count == 0) {
+        for (unsigned int i = 0; i < device_count; i++) {
+            devices[i] = slots[i];
+            sampleDevice(i, due);
+            slots[i] = devices[i];
+            slots[i].stale = false;
+        }
+        last_sample_duration = monotonicSeconds() - start;
         return;
     }
 
-    // Define a structure to hold the metrics per GPU
-    typedef struct {
-        char gpu_name[NVML_DEVICE_NAME_BUFFER_SIZE];
-        char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
-        int gpu_index;
-        char model_name[NVML_DEVICE_NAME_BUFFER_SIZE];
-        unsigned int gpu_temp;
-        float power_usage;
-        unsigned int vram_temp;
-        unsigned int hotspot_temp;
-        unsigned int fan_speed;
-        unsigned int gpu_util;
-        // Add other metrics as needed
-        bool has_data; // Indicates if data for this GPU is available
-    } ConsoleDeviceData;
+    struct timespec deadline;
+    monotonicDeadline(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&worker_pool.lock);
+    worker_pool.generation++;
+    worker_pool.due = due;
+    worker_pool.queue_length = 0;
+    for (unsigned int i = 0; i < device_count; i++) {
+        worker_pool.done[i] = false;
+        if (worker_pool.busy[i]) {
+            markDeviceStale(&slots[i], i, timeout_ms);
+            continue;
+        }
+        devices[i] = slots[i];
+        worker_pool.busy[i] = true;
+        worker_pool.queue[worker_pool.queue_length++] = i;
+    }
+    worker_pool.next_device = 0;
+    worker_pool.pending = worker_pool.queue_length;
+    pthread_cond_broadcast(&worker_pool.work_ready);
 
-    ConsoleDeviceData console_devices[MAX_DEVICES];
-    memset(console_devices, 0, sizeof(console_devices));
+    while (worker_pool.pending > 0) {
+        if (pthread_cond_timedwait(&worker_pool.work_done, &worker_pool.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    for (unsigned int q = 0; q < worker_pool.queue_length; q++) {
+        unsigned int i = worker_pool.queue[q];
+        if (worker_pool.done[i]) {
+            slots[i] = devices[i];
+            slots[i].stale = false;
+        } else {
+            if (q >= worker_pool.next_device) {
+                worker_pool.busy[i] = false; // No worker picked it up in time
+            }
+            markDeviceStale(&slots[i], i, timeout_ms);
+        }
+    }
+    // Workers stop handing out what is left of the batch, and the ones still on it
+    // report to waitForIdleWorkers instead
+    worker_pool.queue_length = worker_pool.next_device;
+    worker_pool.generation++;
+    pthread_mutex_unlock(&worker_pool.lock);
 
-    char line[1024];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        // Skip comments and empty lines
-        if (line[0] == '#' || line[0] == '\n') {
-            continue;
+    last_sample_duration = monotonicSeconds() - start;
+}
+
+// Absolute CLOCK_MONOTONIC time timeout_ms from now, for the worker pool's timed waits
+void monotonicDeadline(struct timespec *deadline, unsigned int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_nsec -= 1000000000L;
+        deadline->tv_sec++;
+    }
+}
+
+// Wait up to timeout_ms for workers left behind by a timed out batch, false if one is still busy
+bool waitForIdleWorkers(unsigned int timeout_ms) {
+    struct timespec deadline;
+    monotonicDeadline(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&worker_pool.lock);
+    bool idle = false;
+    while (!idle) {
+        idle = true;
+        for (unsigned int i = 0; i < MAX_DEVICES && idle; i++) {
+            idle = !worker_pool.busy[i];
+        }
+        if (!idle && pthread_cond_timedwait(&worker_pool.work_done, &worker_pool.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&worker_pool.lock);
+    return idle;
+}
+
+// The rebuild shuts NVML down and unmaps the register windows, so it waits until no worker
+// is still inside NVML with an old handle. While one hangs the rebuild is put off and the
+// other GPUs keep being sampled with the current session. False if the rebuild failed.
+bool rebuildHandleCacheWhenIdle(void) {
+    if (!waitForIdleWorkers(WORKER_IDLE_TIMEOUT_MS)) {
+        if (!handle_cache_rebuild_deferred) {
+            fprintf(stderr, "A GPU is still being sampled, rebuilding the NVML handle cache later\n");
+            handle_cache_rebuild_deferred = true;
         }
+        return true;
+    }
+    handle_cache_rebuild_deferred = false;
+    return rebuildDeviceHandleCache();
+}
 
-        // Parse the metric line
-        char metric_name[128];
-        char labels[512];
-        char value_str[64];
+int main(int argc, char* argv[]) {
+    // Default is to print to console
+    bool console_output = true;
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *listen_host = "0.0.0.0";
+    long listen_port = 0;
+    const char *shm_name = GPU_SNAPSHOT_SHM_NAME;
 
-        char* ptr = strchr(line, '{');
-        if (ptr) {
-            // Metric with labels
-            size_t name_len = ptr - line;
-            if (name_len >= sizeof(metric_name)) {
-                name_len = sizeof(metric_name) - 1;
+    // Check for command-line arguments
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "--help") == 0 || strcmp(argv[argi], "-h") == 0) {
+            printHelpMessage();
+            return 0;
+        } else if (strcmp(argv[argi], "--no-console") == 0) {
+            console_output = false;
+        } else if (strcmp(argv[argi], "--workers") == 0 && argi + 1 < argc) {
+            worker_count = strtol(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--register-backend") == 0 && argi + 1 < argc) {
+            const char *spec = argv[++argi];
+            register_source = findRegisterSource(spec);
+            if (register_source == NULL && strcmp(spec, "auto") != 0) {
+                fprintf(stderr, "Unknown register backend: %s\n", spec);
+                return 1;
+            }
+        } else if (strcmp(argv[argi], "--register-hz") == 0 && argi + 1 < argc) {
+            register_sampler_hz = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "--listen") == 0 && argi + 1 < argc) {
+            // [host:]port, the host defaults to all interfaces like metrics_exporter
+            char *spec = argv[++argi];
+            char *colon = strrchr(spec, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                listen_host = spec;
+                listen_port = strtol(colon + 1, NULL, 10);
+            } else {
+                listen_port = strtol(spec, NULL, 10);
             }
-            strncpy(metric_name, line, name_len);
-            metric_name[name_len] = '\0';
-
-            char* end_labels = strchr(ptr, '}');
-            if (!end_labels) continue; // Malformed line, skip
-            size_t labels_len = end_labels - ptr - 1;
-            if (labels_len >= sizeof(labels)) {
-                labels_len = sizeof(labels) - 1;
+            if (listen_port <= 0 || listen_port > 65535) {
+                fprintf(stderr, "Invalid listen port: %s\n", colon != NULL ? colon + 1 : spec);
+                return 1;
             }
-            strncpy(labels, ptr + 1, labels_len);
-            labels[labels_len] = '\0';
+        } else if (strcmp(argv[argi], "--no-metrics-file") == 0) {
+            metrics_file_enabled = false;
+        } else if (strcmp(argv[argi], "--shm") == 0 && argi + 1 < argc) {
+            shm_name = argv[++argi];
+        } else if (strcmp(argv[argi], "--no-shm") == 0) {
+            shm_name = NULL;
+        } else if (strcmp(argv[argi], "--syslog") == 0 && argi + 1 < argc) {
+            syslog_path = argv[++argi];
+        } else if (strcmp(argv[argi], "--sysfs-root") == 0 && argi + 1 < argc) {
+            sysfs_root = argv[++argi];
+        } else if (strcmp(argv[argi], "--kmsg") == 0 && argi + 1 < argc) {
+            kmsg_path = argv[++argi];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            fprintf(stderr, "Use --help or -h for usage information.\n");
+            return 1;
+        }
+    }
 
-            // Get the value after the labels
-            char* value_ptr = end_labels + 1;
-            while (*value_ptr && isspace(*value_ptr)) value_ptr++;
-            strncpy(value_str, value_ptr, sizeof(value_str) - 1);
-            value_str[sizeof(value_str) - 1] = '\0';
 
-        } else {
-            // Metric without labels (unlikely in this case)
-            continue; // Skip
-        }
-
-        // Extract GPU index from labels
-        int gpu_index = -1;
-        char uuid[NVML_DEVICE_UUID_BUFFER_SIZE] = "";
-        char model_name[NVML_DEVICE_NAME_BUFFER_SIZE] = "";
-        //char hostname[256] = "";
-        //char driver_version[NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE] = "";
-        // Extract other labels if needed
-
-        // Tokenize labels
-        char* label_ptr = strtok(labels, ",");
-        while (label_ptr != NULL) {
-            char* equal_sign = strchr(label_ptr, '=');
-            if (equal_sign) {
-                *equal_sign = '\0';
-                char* key = label_ptr;
-                char* value = equal_sign + 1;
-
-                // Remove quotes from value
-                if (value[0] == '\"') value++;
-                size_t len = strlen(value);
-                if (len > 0 && value[len - 1] == '\"') value[len - 1] = '\0';
-
-                if (strcmp(key, "gpu") == 0) {
-                    gpu_index = atoi(value);
-                } else if (strcmp(key, "UUID") == 0) {
-                    snprintf(uuid, sizeof(uuid), "%s", value);
-                } else if (strcmp(key, "modelName") == 0) {
-                    snprintf(model_name, sizeof(model_name), "%s", value);
-                } else if (strcmp(key, "Hostname") == 0) {
-                    // Optionally store hostname if needed
-                } else if (strcmp(key, "DCGM_FI_DRIVER_VERSION") == 0) {
-                    // Optionally store driver version if needed
-                }
-                // Handle other labels if needed
-            }
-            label_ptr = strtok(NULL, ",");
+    // Open the metrics file in write mode to overwrite the existing content
+    cleanup_sig_handler();
+
+    if (listen_port > 0) {
+        if (!startMetricsServer(listen_host, (int)listen_port)) {
+            return 1;
         }
+        metrics_server_enabled = true;
+    } else if (!metrics_file_enabled) {
+        fprintf(stderr, "--no-metrics-file requires --listen\n");
+        return 1;
+    }
 
-        if (gpu_index >= 0 && gpu_index < MAX_DEVICES) {
-            console_devices[gpu_index].gpu_index = gpu_index;
-            console_devices[gpu_index].has_data = true;
+    // Room for a few dozen GPUs up front, the buffer grows if it ever needs more
+    bufferReserve(&metrics_buffer, 256 * 1024);
 
-            // Store common labels
-            if (uuid[0] != '\0') {
-                snprintf(console_devices[gpu_index].uuid, sizeof(console_devices[gpu_index].uuid), "%s", uuid);
-            }
-            if (model_name[0] != '\0') {
-                snprintf(console_devices[gpu_index].model_name, sizeof(console_devices[gpu_index].model_name), "%s", model_name);
-            }
+    if (shm_name != NULL && !openSharedSnapshot(shm_name)) {
+        fprintf(stderr, "Continuing without the shared memory snapshot\n");
+    }
 
-            // Store metric values based on metric name
-            if (strcmp(metric_name, "DCGM_FI_DEV_GPU_TEMP") == 0 && metricsConfig->gpu_temp) {
-                console_devices[gpu_index].gpu_temp = atoi(value_str);
-            } else if (strcmp(metric_name, "DCGM_FI_DEV_POWER_USAGE") == 0 && metricsConfig->power_usage) {
-                console_devices[gpu_index].power_usage = atof(value_str);
-            } else if (strcmp(metric_name, "DCGM_FI_DEV_VRAM_TEMP") == 0 && metricsConfig->vram_temp) {
-                console_devices[gpu_index].vram_temp = atoi(value_str);
-            } else if (strcmp(metric_name, "DCGM_FI_DEV_HOT_SPOT_TEMP") == 0 && metricsConfig->hotspot_temp) {
-                console_devices[gpu_index].hotspot_temp = atoi(value_str);
-            } else if (strcmp(metric_name, "DCGM_FI_DEV_FAN_SPEED") == 0 && metricsConfig->fan_speed) {
-                console_devices[gpu_index].fan_speed = atoi(value_str);
-            } else if (strcmp(metric_name, "DCGM_FI_DEV_GPU_UTIL") == 0 && metricsConfig->gpu_util) {
-                console_devices[gpu_index].gpu_util = atoi(value_str);
-            }
-            // Add other metrics as needed
+    MetricsConfig metricsConfig;
+    loadMetricsConfig(&metricsConfig);
+
+    // NVML stays initialized for the lifetime of the collector
+    if (!rebuildDeviceHandleCache()) {
+        if (nvml_initialized) {
+            nvmlShutdown();
         }
+        return 1;
     }
 
-    fclose(fp);
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    if (worker_count > MAX_WORKERS) {
+        worker_count = MAX_WORKERS;
+    }
+    if (worker_count > 1 && !startWorkerPool(worker_count)) {
+        fprintf(stderr, "Sampling devices sequentially\n");
+    }
 
-    // Print the console output
-    for (int i = 0; i < MAX_DEVICES; i++) {
-        if (console_devices[i].has_data) {
-            printf("GPU Name: %s GPU %d:", console_devices[i].model_name, console_devices[i].gpu_index);
-            if (metricsConfig->gpu_temp) {
-                printf(" Temperature: %u C", console_devices[i].gpu_temp);
-            }
-            if (metricsConfig->power_usage) {
-                printf(" Power Usage: %.2f W", console_devices[i].power_usage);
-            }
-            if (metricsConfig->vram_temp) {
-                printf(" VRAM Temp: %u C", console_devices[i].vram_temp);
-            }
-            if (metricsConfig->hotspot_temp) {
-                printf(" HotSpotTemp: %u C", console_devices[i].hotspot_temp);
-            }
-            if (metricsConfig->fan_speed) {
-                printf(" Fan: %u %%", console_devices[i].fan_speed);
-            }
-            if (metricsConfig->gpu_util) {
-                printf(" Core Utilization: %u %%", console_devices[i].gpu_util);
+    if (register_sampler_hz > 1000000) {
+        register_sampler_hz = 1000000;
+    }
+    if (register_sampler_hz > 0 && (metricsConfig.enabled & register_metrics)) {
+        pthread_t sampler_thread;
+        int err = pthread_create(&sampler_thread, NULL, registerSampler, &metricsConfig);
+        if (err != 0) {
+            fprintf(stderr, "Failed to start register sampler: %s\n", strerror(err));
+            register_sampler_hz = 0;
+        }
+    } else {
+        register_sampler_hz = 0;
+    }
+
+    if ((metricsConfig.enabled & kernel_event_metrics) && !startKmsgReader()) {
+        fprintf(stderr, "Continuing without kernel log events\n");
+    }
+
+    // Every enabled metric starts due now and then runs at its own interval
+    Schedule schedule = { .size = 0 };
+    uint64_t start_ms = monotonicMillis();
+    for (uint32_t pending = metricsConfig.enabled; pending != 0; pending &= pending - 1) {
+        schedulePush(&schedule, (ScheduleEntry){ .due_ms = start_ms, .field = __builtin_ctz(pending) });
+    }
+    uint64_t next_console_ms = start_ms;
+    uint64_t next_metrics_file_ms = start_ms;
+
+    while(1){
+        uint64_t deadline_ms = schedule.entries[0].due_ms;
+        sleepUntilMillis(deadline_ms);
+
+        double cycle_start = monotonicSeconds();
+        last_cycle_lag = cycle_start - deadline_ms / 1000.0;
+        if (last_cycle_lag < 0) {
+            last_cycle_lag = 0;
+        }
+
+        // Collect everything that is due
+        uint32_t due = 0;
+        uint64_t now_ms = monotonicMillis();
+        while (schedule.size > 0 && schedule.entries[0].due_ms <= now_ms) {
+            ScheduleEntry entry = schedulePop(&schedule);
+            due |= METRIC_BIT(entry.field);
+
+            missed_deadlines += advanceScheduleEntry(&entry, metricsConfig.interval_ms[entry.field], now_ms);
+            schedulePush(&schedule, entry);
+        }
+        // GPUs left out while the AER backfill ran get their count in the first cycle after it, not an interval later
+        if (atomic_load(&aer_backfill_state) == AER_BACKFILL_DONE && atomic_exchange(&aer_backfill_resample, false)) {
+            due |= METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS);
+        }
+
+        if (!handle_cache_valid && !rebuildHandleCacheWhenIdle()) {
+            // Driver is probably reloading, try again next time something is due
+            continue;
+        }
+
+        // The PCI bus is only rescanned when the topology changed
+        if (!refreshPciIndex(now_ms)) {
+            continue;
+        }
+
+        // Only walk the devices if a per-device metric is due. A device still sampling when
+        // the most frequent of these metrics is next due, or after 5 s, is published stale.
+        unsigned int device_count = cached_device_count;
+        if (due & ~host_metrics) {
+            unsigned int timeout_ms = DEFAULT_INTERVAL_MS;
+            for (uint32_t pending = due & ~host_metrics; pending != 0; pending &= pending - 1) {
+                unsigned int interval = metricsConfig.interval_ms[__builtin_ctz(pending)];
+                timeout_ms = interval < timeout_ms ? interval : timeout_ms;
             }
-            // Add other metrics as needed
+            DeviceData *slots = beginSnapshot();
+            sampleAllDevices(slots, device_count, due, timeout_ms);
+            publishSnapshot(device_count);
+        }
+        for (uint32_t pending = due & host_metrics; pending != 0; pending &= pending - 1) {
+            metricRegistry[__builtin_ctz(pending)].sample(0, due);
+        }
+
+        // metrics.txt follows the device and host metrics. Cycles that only read the registers
+        // reach the listener and the shared snapshot, and the file at the default cadence
+        metrics_file_due = (due & ~register_metrics) != 0 || now_ms >= next_metrics_file_ms;
+        if (metrics_file_due) {
+            next_metrics_file_ms = now_ms + DEFAULT_INTERVAL_MS;
+        }
+        readSnapshot(&current_snapshot);
+        createMetricFile(&current_snapshot, &metricsConfig);
+        // If console output is enabled, print the metrics to console at the default cadence
+        if (console_output && now_ms >= next_console_ms) {
+            printConsoleOutput(&current_snapshot, &metricsConfig);
+            next_console_ms = now_ms + DEFAULT_INTERVAL_MS;
+        }
+
+        last_cycle_duration = monotonicSeconds() - cycle_start;
+    }
+
+    return 0;
+}
 
-            printf("\n");
+void printConsoleOutput(const MetricsSnapshot* snapshot, MetricsConfig* metricsConfig) {
+    for (unsigned int i = 0; i < snapshot->device_count; i++) {
+        const DeviceData *device = &snapshot->devices[i];
+        printf("GPU Name: %s GPU %u:", device->device_name, i);
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_GPU_TEMP)) {
+            printf(" Temperature: %u C", device->gpu_temp);
+        }
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_POWER_USAGE)) {
+            printf(" Power Usage: %.2f W", device->power_usage / 1000.0);
+        }
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_VRAM_TEMP)) {
+            printf(" VRAM Temp: %u C", device->vram_temp);
+        }
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_HOT_SPOT_TEMP)) {
+            printf(" HotSpotTemp: %u C", device->hotspot_temp);
         }
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_FAN_SPEED)) {
+            printf(" Fan: %u %%", device->fan_speed);
+        }
+        if (metricsConfig->enabled & METRIC_BIT(GPU_METRIC_GPU_UTIL)) {
+            printf(" Core Utilization: %u %%", device->gpu_util);
+        }
+        // Add other metrics as needed
+
+        printf("\n");
     }
 }
 
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Scrape latency, body size and server CPU of the collector's embedded listener (--listen)
+# and of metrics_exporter reading metrics.txt, identity and gzip, for 8 and 32 GPUs, all
+# fed by the collector linked against the NVML mock.
+# Run by make bench, metrics_exporter needs port 9500 to be free.
+set -e
+
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d /tmp/server-bench-XXXXXX)
+pids=""
+
+LISTEN_PORT=19501
+EXPORTER_PORT=9500
+SCRAPES=2000
+
+# Start the collector for $1 GPUs in $work/$1 and metrics_exporter on its metrics.txt
+startServers() {
+    local gpus=$1
+    local dir="$work/$gpus"
+    mkdir -p "$dir/bars"
+    cp "$tests/../metrics.ini" "$dir/"
+    : > "$dir/kmsg"
+    for i in $(seq 1 "$gpus"); do
+        truncate -s 140k "$dir/bars/$(printf '0000:%02x:00.0' "$i")"
+    done
+
+    (cd "$dir" && MOCK_GPUS=$gpus exec "$tests/nvml_direct_access" --no-console --no-shm \
+        --listen "127.0.0.1:$LISTEN_PORT" --register-backend file:bars \
+        --syslog "$dir/syslog" --kmsg "$dir/kmsg" --sysfs-root "$dir") >/dev/null 2>&1 &
+    collector_pid=$!
+    until [ -s "$dir/metrics.txt" ]; do sleep 0.1; done
+    (cd "$dir" && exec "$tests/metrics_exporter") >/dev/null 2>&1 &
+    exporter_pid=$!
+    pids="$collector_pid $exporter_pid"
+    until "$tests/scrape_bench" wait "$LISTEN_PORT" 1 identity && "$tests/scrape_bench" wait "$EXPORTER_PORT" 1 identity; do
+        sleep 0.1
+    done
+}
+
+stopServers() {
+    if [ -n "$pids" ]; then
+        kill $pids 2>/dev/null || true
+        wait $pids 2>/dev/null || true
+    fi
+    pids=""
+}
+trap 'stopServers; rm -rf "$work"' EXIT
+
+for gpus in 8 32; do
+    startServers "$gpus"
+    "$tests/scrape_bench" "embedded listener, $gpus GPUs" "$LISTEN_PORT" "$SCRAPES" identity "$collector_pid"
+    for encoding in identity gzip; do
+        "$tests/scrape_bench" "metrics_exporter on metrics.txt, $gpus GPUs" "$EXPORTER_PORT" "$SCRAPES" "$encoding" "$exporter_pid"
+    done
+    stopServers
+done
@@ -0,0 +1,314 @@
+// Benchmarks of nvml_direct_access.c against the NVML and libpci mock, run by make bench.
+// Each prints one line per configuration; numbers depend on the machine, compare within a run.
+int collector_main(int argc, char* argv[]);
+#define main collector_main
+#include "../nvml_direct_access.c"
+#undef main
+
+#include "mock_nvml.h"
+
+static char bench_dir[] = "/tmp/collector-bench-XXXXXX";
+
+static void writeBarImage(const char *path, uint32_t vram, uint32_t hotspot) {
+    size_t length = HOTSPOT_REGISTER_OFFSET + sizeof(uint32_t);
+    char *image = calloc(1, length);
+    memcpy(image + VRAM_REGISTER_OFFSET, &vram, sizeof(vram));
+    memcpy(image + HOTSPOT_REGISTER_OFFSET, &hotspot, sizeof(hotspot));
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(image, 1, length, file) != length) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fclose(file);
+    free(image);
+}
+
+static bool resetCollector(void) {
+    unmapAllRegisterWindows();
+    return rebuildDeviceHandleCache() && refreshPciIndex(0);
+}
+
+// Register reads of 8 GPUs from file-backed BAR images, with the windows kept
+// mapped as the collector does and remapped every cycle as it used to
+static void benchRegisterCycles(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 8;
+    mkdir("bars", 0755);
+    for (unsigned int i = 0; i < mock_nvml.gpu_count; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "bars/0000:%02x:00.0", i + 1);
+        writeBarImage(path, 60 * 0x20, 70 << 8);
+    }
+    register_source = findRegisterSource("file:bars");
+    if (!resetCollector()) {
+        fprintf(stderr, "Failed to set up the mock devices\n");
+        exit(1);
+    }
+
+    uint32_t due = METRIC_BIT(GPU_METRIC_VRAM_TEMP) | METRIC_BIT(GPU_METRIC_HOT_SPOT_TEMP);
+    const unsigned int cycles = 20000;
+    for (int remap = 0; remap <= 1; remap++) {
+        double start = monotonicSeconds();
+        for (unsigned int c = 0; c < cycles; c++) {
+            if (remap) {
+                unmapAllRegisterWindows();
+            }
+            for (unsigned int i = 0; i < mock_nvml.gpu_count; i++) {
+                sampleRegisters(i, due);
+            }
+        }
+        double elapsed = monotonicSeconds() - start;
+        printf("registers, 8 GPUs, %s: %.0f cycles/s\n", remap ? "remapped every cycle" : "mapped once", cycles / elapsed);
+    }
+    unmapAllRegisterWindows();
+    register_source = NULL;
+}
+
+// The PCI function of each GPU looked up among 600 functions, through the index
+// and by walking the scanned list as the collector used to
+static void benchPciLookup(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 8;
+    mock_nvml.pci_functions = 600;
+    if (!resetCollector()) {
+        fprintf(stderr, "Failed to set up the mock devices\n");
+        exit(1);
+    }
+
+    const unsigned int lookups = 4000000;
+    unsigned long found = 0;
+    double start = monotonicSeconds();
+    for (unsigned int l = 0; l < lookups; l++) {
+        found += lookupPciDevice(&device_handles[l % mock_nvml.gpu_count].pci_info) != NULL;
+    }
+    double indexed = monotonicSeconds() - start;
+
+    start = monotonicSeconds();
+    for (unsigned int l = 0; l < lookups / 100; l++) {
+        const nvmlPciInfo_t *pci = &device_handles[l % mock_nvml.gpu_count].pci_info;
+        for (struct pci_dev *dev = pacc->devices; dev; dev = dev->next) {
+            if ((unsigned int)dev->domain == pci->domain && dev->bus == pci->bus && dev->dev == pci->device &&
+                ((unsigned int)(dev->device_id << 16) | dev->vendor_id) == pci->pciDeviceId) {
+                found++;
+                break;
+            }
+        }
+    }
+    double walked = (monotonicSeconds() - start) * 100;
+
+    printf("PCI lookup, 600 functions: index %.1f ns, list walk %.1f ns (%lu found)\n",
+           indexed * 1e9 / lookups, walked * 1e9 / lookups, found);
+}
+
+// One cycle of every per-device NVML metric on 16 GPUs whose calls take 2 ms each,
+// sampled in turn, on 16 workers, and on 16 workers with one GPU hung for 2 s
+static void benchSampleCycle(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 16;
+    mock_nvml.latency_us = 2000;
+    if (!resetCollector()) {
+        fprintf(stderr, "Failed to set up the mock devices\n");
+        exit(1);
+    }
+    uint32_t due = (METRIC_BIT(GPU_METRIC_COUNT) - 1) & ~register_metrics & ~host_metrics & ~kernel_event_metrics;
+    due &= ~(METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS) | METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    static DeviceData slots[MAX_DEVICES];
+
+    double start = monotonicSeconds();
+    sampleAllDevices(slots, 16, due, 1000);
+    printf("sample cycle, 16 GPUs, 2 ms per NVML call: sequential %.1f ms", (monotonicSeconds() - start) * 1000);
+
+    startWorkerPool(16);
+    start = monotonicSeconds();
+    sampleAllDevices(slots, 16, due, 1000);
+    printf(", 16 workers %.1f ms", (monotonicSeconds() - start) * 1000);
+
+    mock_nvml.hang_ms = 2000;
+    mock_nvml.hang_gpu = 5;
+    start = monotonicSeconds();
+    sampleAllDevices(slots, 16, due, 100);
+    printf(", 16 workers with GPU 5 hung and a 100 ms timeout %.1f ms (%s)\n", (monotonicSeconds() - start) * 1000,
+           slots[5].stale ? "GPU 5 stale" : "GPU 5 not stale");
+    mock_nvml.hang_gpu = -1;
+    // The next benchmark rebuilds the handle cache, which must not happen under the hung worker
+    waitForIdleWorkers(mock_nvml.hang_ms);
+}
+
+// Power and the NVLink counters of one GPU at 100 us per NVML call, with the one
+// batched call the collector makes and with one call per field
+static void benchFieldValues(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 1;
+    mock_nvml.latency_us = 100;
+    if (!resetCollector()) {
+        fprintf(stderr, "Failed to set up the mock devices\n");
+        exit(1);
+    }
+    uint32_t due = METRIC_BIT(GPU_METRIC_POWER_USAGE) | METRIC_BIT(GPU_METRIC_NVLINK_BANDWIDTH_TOTAL);
+    const unsigned int samples = 200;
+
+    double start = monotonicSeconds();
+    for (unsigned int n = 0; n < samples; n++) {
+        sampleFieldMetrics(0, due);
+    }
+    double batched = (monotonicSeconds() - start) / samples;
+
+    nvmlFieldValue_t field;
+    start = monotonicSeconds();
+    for (unsigned int n = 0; n < samples / 10; n++) {
+        memset(&field, 0, sizeof(field));
+        field.fieldId = NVML_FI_DEV_POWER_INSTANT;
+        nvmlDeviceGetFieldValues(device_handles[0].handle, 1, &field);
+        for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+            for (unsigned int id = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX; id <= NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX; id++) {
+                memset(&field, 0, sizeof(field));
+                field.fieldId = id;
+                field.scopeId = link;
+                nvmlDeviceGetFieldValues(device_handles[0].handle, 1, &field);
+            }
+        }
+    }
+    double individual = (monotonicSeconds() - start) / (samples / 10);
+
+    printf("power and NVLink fields, 100 us per NVML call: batched %.2f ms, one call per field %.2f ms\n",
+           batched * 1000, individual * 1000);
+}
+
+// 64 MB of syslog text with an AER report every aer_every lines, naming one of 8 GPUs
+static char *writeSyslogText(size_t size, unsigned int aer_every, size_t *length) {
+    char *log = malloc(size);
+    if (log == NULL) {
+        fprintf(stderr, "Failed to allocate the log\n");
+        exit(1);
+    }
+    *length = 0;
+    for (unsigned int n = 0; ; n++) {
+        char line[160];
+        int line_length = n % aer_every == aer_every - 1
+            ? snprintf(line, sizeof(line), "Oct 17 00:00:00 host kernel: pcieport 0000:00:01.0: AER: Corrected error received: 0000:%02x:00.0\n", n / aer_every % 8 + 1)
+            : snprintf(line, sizeof(line), "Oct 17 00:00:00 host systemd[1]: Started Session %u of User root, Accounting and Audit enabled.\n", n);
+        if (*length + (size_t)line_length > size) {
+            break;
+        }
+        memcpy(log + *length, line, (size_t)line_length);
+        *length += (size_t)line_length;
+    }
+    return log;
+}
+
+typedef struct {
+    const char *log;
+    size_t length;
+    unsigned long long counts[MAX_DEVICES];
+} AerScanJob;
+
+// Scans the log in 1 MB blocks, as the backfill hands out gzip buffers and file chunks
+static void* aerScanJob(void *arg) {
+    AerScanJob *job = arg;
+    const size_t block = 1024 * 1024;
+    for (size_t offset = 0; offset < job->length; offset += block) {
+        size_t length = job->length - offset < block ? job->length - offset : block;
+        aerScanBlock(job->log + offset, length, job->counts);
+    }
+    return NULL;
+}
+
+// Counting AER lines with 8 GPUs known to the classifier, as the backfill does: one AER
+// report per 1000 lines on one thread, and a report on every line on 1, 8 and 32 threads
+// scanning their own copy of the text at once
+static void benchAerScan(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 8;
+    if (!resetCollector()) {
+        fprintf(stderr, "Failed to set up the mock devices\n");
+        exit(1);
+    }
+    addGpuLogBuses();
+
+    const size_t size = 64 * 1024 * 1024;
+    size_t length;
+    char *log = writeSyslogText(size, 1000, &length);
+    static AerScanJob jobs[32];
+    jobs[0] = (AerScanJob){ .log = log, .length = length };
+    const unsigned int passes = 5;
+    double start = monotonicSeconds();
+    for (unsigned int p = 0; p < passes; p++) {
+        aerScanJob(&jobs[0]);
+    }
+    double elapsed = monotonicSeconds() - start;
+    printf("AER scan, 8 GPUs, 1 report per 1000 lines: %.2f GB/s", (double)length * passes / elapsed / 1e9);
+    free(log);
+
+    log = writeSyslogText(size, 1, &length);
+    const unsigned int thread_counts[] = {1, 8, 32};
+    for (unsigned int t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        unsigned int threads = thread_counts[t];
+        pthread_t workers[32];
+        start = monotonicSeconds();
+        for (unsigned int w = 0; w < threads; w++) {
+            jobs[w] = (AerScanJob){ .log = log, .length = length };
+            if (pthread_create(&workers[w], NULL, aerScanJob, &jobs[w]) != 0) {
+                fprintf(stderr, "Failed to start a scan thread\n");
+                exit(1);
+            }
+        }
+        for (unsigned int w = 0; w < threads; w++) {
+            pthread_join(workers[w], NULL);
+        }
+        elapsed = monotonicSeconds() - start;
+        printf("%s%u threads %.2f GB/s", t == 0 ? "; every line, " : ", ", threads, (double)length * threads / elapsed / 1e9);
+    }
+    printf(" (%ld cores)\n", sysconf(_SC_NPROCESSORS_ONLN));
+    free(log);
+}
+
+// Rendering one cycle of every metric into the exposition text for 8 and 32 GPUs,
+// without writing metrics.txt, as createMetricFile does on every cycle
+static void benchRenderMetrics(void) {
+    MetricsConfig config;
+    config.enabled = METRIC_BIT(GPU_METRIC_COUNT) - 1;
+    uint32_t due = (METRIC_BIT(GPU_METRIC_COUNT) - 1) & ~register_metrics & ~host_metrics & ~kernel_event_metrics;
+    due &= ~(METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS) | METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    metrics_file_enabled = false;
+
+    const unsigned int gpu_counts[] = {8, 32};
+    for (unsigned int g = 0; g < sizeof(gpu_counts) / sizeof(gpu_counts[0]); g++) {
+        mockNvmlReset();
+        mock_nvml.gpu_count = gpu_counts[g];
+        if (!resetCollector()) {
+            fprintf(stderr, "Failed to set up the mock devices\n");
+            exit(1);
+        }
+        DeviceData *slots = beginSnapshot();
+        sampleAllDevices(slots, mock_nvml.gpu_count, due, 1000);
+        publishSnapshot(mock_nvml.gpu_count);
+        readSnapshot(&current_snapshot);
+
+        const unsigned int renders = 2000;
+        double start = monotonicSeconds();
+        for (unsigned int r = 0; r < renders; r++) {
+            createMetricFile(&current_snapshot, &config);
+        }
+        double elapsed = (monotonicSeconds() - start) / renders;
+        printf("render, %u GPUs: %.1f us, %zu bytes\n", gpu_counts[g], elapsed * 1e6, metrics_buffer.length);
+    }
+    metrics_file_enabled = true;
+}
+
+int main(void) {
+    if (mkdtemp(bench_dir) == NULL || chdir(bench_dir) != 0) {
+        fprintf(stderr, "Failed to create the bench directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    benchRegisterCycles();
+    benchPciLookup();
+    benchFieldValues();
+    benchSampleCycle();
+    benchRenderMetrics();
+    benchAerScan();
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", bench_dir);
+    return system(command) == 0 ? 0 : 1;
+}
@@ -0,0 +1,806 @@
+// Unit tests of nvml_direct_access.c, built against the NVML and libpci mock by make check.
+// The collector is included whole so tests can reach its globals and helpers.
+int collector_main(int argc, char* argv[]);
+#define main collector_main
+#include "../nvml_direct_access.c"
+#undef main
+
+#include <sys/types.h>
+#include "mock_nvml.h"
+
+static unsigned int checks = 0;
+static unsigned int failures = 0;
+
+#define CHECK(condition) do { \
+    checks++; \
+    if (!(condition)) { \
+        failures++; \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #condition); \
+    } \
+} while (0)
+
+// Fixtures live in a scratch directory the tests chdir into
+static char fixture_dir[] = "/tmp/collector-test-XXXXXX";
+
+static void writeFile(const char *path, const void *data, size_t length) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(data, 1, length, file) != length) {
+        fprintf(stderr, "Failed to write fixture %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fclose(file);
+}
+
+// BAR0 image with the VRAM and hot spot registers set to the given raw values
+static void writeBarImage(const char *path, uint32_t vram, uint32_t hotspot) {
+    size_t length = HOTSPOT_REGISTER_OFFSET + sizeof(uint32_t);
+    char *image = calloc(1, length);
+    memcpy(image + VRAM_REGISTER_OFFSET, &vram, sizeof(vram));
+    memcpy(image + HOTSPOT_REGISTER_OFFSET, &hotspot, sizeof(hotspot));
+    writeFile(path, image, length);
+    free(image);
+}
+
+// Fresh handle cache and PCI index for the current mock configuration
+static bool resetCollector(void) {
+    unmapAllRegisterWindows();
+    return rebuildDeviceHandleCache() && refreshPciIndex(0);
+}
+
+static void testFileRegisterBackend(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 2;
+    mkdir("bars", 0755);
+    writeBarImage("bars/0000:01:00.0", 65 * 0x20, 70 << 8);
+    writeBarImage("bars/0000:02:00.0", 80 * 0x20, 0x7f << 8); // Hot spot reading out of range
+    register_source = findRegisterSource("file:bars");
+    CHECK(register_source == &registerSources[2]);
+    CHECK(resetCollector());
+
+    uint32_t due = METRIC_BIT(GPU_METRIC_VRAM_TEMP) | METRIC_BIT(GPU_METRIC_HOT_SPOT_TEMP);
+    devices[1].hotspot_temp = 12;
+    sampleRegisters(0, due);
+    sampleRegisters(1, due);
+    CHECK(devices[0].vram_temp == 65);
+    CHECK(devices[0].hotspot_temp == 70);
+    CHECK(devices[1].vram_temp == 80);
+    CHECK(devices[1].hotspot_temp == 12); // Kept from the last good reading
+
+    // The window stays mapped across cycles and sees the registers change
+    void *page = register_windows[0].vram_page;
+    writeBarImage("bars/0000:01:00.0", 66 * 0x20, 71 << 8);
+    sampleRegisters(0, due);
+    CHECK(register_windows[0].vram_page == page);
+    CHECK(devices[0].vram_temp == 66);
+    CHECK(devices[0].hotspot_temp == 71);
+
+    // A missing image leaves the window unmapped and the last reading in place
+    unlink("bars/0000:02:00.0");
+    unmapAllRegisterWindows();
+    sampleRegisters(1, due);
+    CHECK(register_windows[1].vram_page == NULL);
+    CHECK(devices[1].vram_temp == 80);
+
+    unmapAllRegisterWindows();
+    register_source = NULL;
+}
+
+// A GPU that drops off the bus is marked missing on its own, the other windows stay
+// mapped and the bus is rescanned with a doubling backoff until the GPU is back
+static void testMissingGpuRescanBackoff(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 2;
+    mkdir("bars", 0755);
+    writeBarImage("bars/0000:01:00.0", 65 * 0x20, 70 << 8);
+    writeBarImage("bars/0000:02:00.0", 80 * 0x20, 75 << 8);
+    register_source = findRegisterSource("file:bars");
+    CHECK(resetCollector());
+
+    uint32_t due = METRIC_BIT(GPU_METRIC_VRAM_TEMP);
+    sampleRegisters(0, due);
+    sampleRegisters(1, due);
+    void *page = register_windows[1].vram_page;
+    CHECK(register_windows[0].vram_page != NULL && page != NULL);
+
+    mock_nvml.hidden_gpu = 0;
+    CHECK(buildPciIndex());
+    unsigned long scans = mock_pci_scans;
+    sampleRegisters(0, due);
+    sampleRegisters(1, due);
+    CHECK(device_handles[0].pci_missing);
+    CHECK(!device_handles[1].pci_missing);
+    CHECK(register_windows[0].vram_page == NULL);
+    CHECK(register_windows[1].vram_page == page);
+
+    // Due 1 s after the index was built, then 1 s, 2 s and 4 s after each rescan
+    const uint64_t cycles_ms[] = {100, 500, 999, 1000, 1500, 1999, 2000, 3999, 4000, 7999};
+    const unsigned long expected_scans[] = {0, 0, 0, 1, 1, 1, 2, 2, 3, 3};
+    for (size_t c = 0; c < sizeof(cycles_ms) / sizeof(cycles_ms[0]); c++) {
+        CHECK(refreshPciIndex(cycles_ms[c]));
+        sampleRegisters(0, due);
+        sampleRegisters(1, due);
+        CHECK(mock_pci_scans - scans == expected_scans[c]);
+    }
+    CHECK(register_windows[1].vram_page == page);
+
+    mock_nvml.hidden_gpu = -1;
+    CHECK(refreshPciIndex(8000));
+    sampleRegisters(0, due);
+    CHECK(!device_handles[0].pci_missing);
+    CHECK(register_windows[0].vram_page != NULL);
+    CHECK(devices[0].vram_temp == 65);
+    CHECK(mock_pci_scans - scans == 4);
+
+    // Nothing missing when the next rescan would be due, the backoff starts over
+    CHECK(refreshPciIndex(16000));
+    CHECK(mock_pci_scans - scans == 4);
+    CHECK(pci_rescan_backoff_ms == PCI_RESCAN_MIN_BACKOFF_MS);
+
+    unmapAllRegisterWindows();
+    register_source = NULL;
+}
+
+// A GPU whose NVML calls hang is published stale after the timeout, without
+// holding back the others, and skipped until its worker comes back
+static void testHungGpuPublishedStale(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    CHECK(resetCollector());
+    if (worker_pool.worker_count == 0) {
+        CHECK(startWorkerPool(4));
+    }
+
+    static DeviceData slots[MAX_DEVICES];
+    memset(slots, 0, sizeof(slots));
+    slots[1].gpu_temp = 7;
+    uint32_t due = METRIC_BIT(GPU_METRIC_GPU_TEMP);
+    mock_nvml.hang_ms = 300;
+    mock_nvml.hang_gpu = 1;
+
+    double start = monotonicSeconds();
+    sampleAllDevices(slots, 4, due, 50);
+    CHECK(monotonicSeconds() - start < 0.2);
+    CHECK(slots[0].gpu_temp == 40 && !slots[0].stale);
+    CHECK(slots[1].gpu_temp == 7 && slots[1].stale);
+    CHECK(slots[2].gpu_temp == 42 && !slots[2].stale);
+    CHECK(slots[3].gpu_temp == 43 && !slots[3].stale);
+
+    // Still stuck in the first batch, the next one does not wait for it at all
+    slots[2].gpu_temp = 0;
+    start = monotonicSeconds();
+    sampleAllDevices(slots, 4, due, 50);
+    CHECK(monotonicSeconds() - start < 0.2);
+    CHECK(slots[1].gpu_temp == 7 && slots[1].stale);
+    CHECK(slots[2].gpu_temp == 42 && !slots[2].stale);
+
+    // Back once the hung call returned
+    mock_nvml.hang_gpu = -1;
+    usleep(400 * 1000);
+    sampleAllDevices(slots, 4, due, 50);
+    CHECK(slots[1].gpu_temp == 41 && !slots[1].stale);
+}
+
+// A handle cache rebuild waits for a worker still inside NVML instead of shutting
+// NVML down and unmapping its registers under it
+static void testRebuildWaitsForHungWorker(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    CHECK(resetCollector());
+    if (worker_pool.worker_count == 0) {
+        CHECK(startWorkerPool(4));
+    }
+
+    static DeviceData slots[MAX_DEVICES];
+    memset(slots, 0, sizeof(slots));
+    uint32_t due = METRIC_BIT(GPU_METRIC_GPU_TEMP);
+    mock_nvml.hang_ms = 500;
+    mock_nvml.hang_gpu = 2;
+    sampleAllDevices(slots, 4, due, 50);
+    CHECK(slots[2].stale);
+
+    // What a worker seeing NVML_ERROR_GPU_IS_LOST does
+    handle_cache_valid = false;
+    unsigned long long rebuilds = handle_cache_rebuilds;
+    CHECK(rebuildHandleCacheWhenIdle());
+    CHECK(handle_cache_rebuilds == rebuilds);
+    CHECK(!handle_cache_valid && nvml_initialized);
+    CHECK(device_handles[2].handle != NULL);
+
+    // The other GPUs are still sampled with the current session meanwhile
+    slots[0].gpu_temp = 0;
+    sampleAllDevices(slots, 4, due, 50);
+    CHECK(slots[0].gpu_temp == 40 && !slots[0].stale);
+    CHECK(slots[2].stale);
+
+    // Rebuilt once the hung call returned
+    mock_nvml.hang_gpu = -1;
+    usleep(500 * 1000);
+    CHECK(rebuildHandleCacheWhenIdle());
+    CHECK(handle_cache_rebuilds == rebuilds + 1);
+    CHECK(handle_cache_valid);
+    CHECK(refreshPciIndex(0));
+}
+
+// A rescan does not free the scan a worker stuck in NVML may still hold a pci_dev of
+static void testRescanWaitsForHungWorker(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    CHECK(resetCollector());
+    if (worker_pool.worker_count == 0) {
+        CHECK(startWorkerPool(4));
+    }
+
+    static DeviceData slots[MAX_DEVICES];
+    memset(slots, 0, sizeof(slots));
+    mock_nvml.hang_ms = 500;
+    mock_nvml.hang_gpu = 3;
+    sampleAllDevices(slots, 4, METRIC_BIT(GPU_METRIC_GPU_TEMP), 50);
+    CHECK(slots[3].stale);
+
+    struct pci_access *scan = pacc;
+    unsigned long scans = mock_pci_scans;
+    pci_rescan_wanted = true;
+    pci_rescan_due_ms = 0;
+    CHECK(refreshPciIndex(1000));
+    CHECK(mock_pci_scans == scans && pacc == scan);
+    CHECK(pci_rescan_wanted);
+
+    // Rescanned once the hung call returned
+    mock_nvml.hang_gpu = -1;
+    usleep(500 * 1000);
+    CHECK(refreshPciIndex(1000));
+    CHECK(mock_pci_scans == scans + 1);
+    CHECK(!pci_rescan_wanted);
+    CHECK(lookupPciDevice(&device_handles[3].pci_info) != NULL);
+}
+
+static void testScheduleDeadlines(void) {
+    // Collected on time, or with the next deadline landing exactly on now
+    ScheduleEntry entry = { .due_ms = 1000, .field = 0 };
+    CHECK(advanceScheduleEntry(&entry, 250, 1000) == 0 && entry.due_ms == 1250);
+    CHECK(advanceScheduleEntry(&entry, 250, 1500) == 0 && entry.due_ms == 1500);
+    CHECK(advanceScheduleEntry(&entry, 250, 1500) == 0 && entry.due_ms == 1750);
+
+    // Deadlines before now are skipped and counted
+    entry.due_ms = 1000;
+    CHECK(advanceScheduleEntry(&entry, 250, 1251) == 1 && entry.due_ms == 1500);
+    entry.due_ms = 1000;
+    CHECK(advanceScheduleEntry(&entry, 250, 1750) == 2 && entry.due_ms == 1750);
+    entry.due_ms = 1000;
+    CHECK(advanceScheduleEntry(&entry, 250, 1751) == 3 && entry.due_ms == 2000);
+}
+
+// Only errors that mean the driver cannot answer latch the field value fallbacks
+static void testFieldValueErrors(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 1;
+    CHECK(resetCollector());
+    uint32_t due = METRIC_BIT(GPU_METRIC_POWER_USAGE) | METRIC_BIT(GPU_METRIC_NVLINK_BANDWIDTH_TOTAL);
+
+    // A transient failure falls back to the individual call for this cycle only
+    mock_nvml.field_values_result = NVML_ERROR_TIMEOUT;
+    mock_nvml.field_values_failures = 1;
+    devices[0].power_usage = 0;
+    sampleFieldMetrics(0, due);
+    CHECK(devices[0].power_usage == 100000);
+    CHECK(!device_handles[0].power_field_unsupported);
+    CHECK(!device_handles[0].nvlink_field_unsupported);
+    unsigned long field_calls = mock_field_calls;
+    sampleFieldMetrics(0, due);
+    CHECK(mock_field_calls == field_calls + 1);
+    CHECK(devices[0].nvlink_bandwidth_total == 8 * 1000);
+
+    // So does a field that failed on its own
+    mock_nvml.power_field_supported = false;
+    sampleFieldMetrics(0, due);
+    CHECK(device_handles[0].power_field_unsupported);
+    CHECK(!device_handles[0].nvlink_field_unsupported);
+
+    const nvmlReturn_t unsupported[] = {NVML_ERROR_NOT_SUPPORTED, NVML_ERROR_FUNCTION_NOT_FOUND};
+    for (size_t e = 0; e < sizeof(unsupported) / sizeof(unsupported[0]); e++) {
+        CHECK(resetCollector());
+        mock_nvml.field_values_result = unsupported[e];
+        mock_nvml.field_values_failures = 1;
+        sampleFieldMetrics(0, due);
+        CHECK(device_handles[0].power_field_unsupported);
+        CHECK(device_handles[0].nvlink_field_unsupported);
+        field_calls = mock_field_calls;
+        sampleFieldMetrics(0, due);
+        CHECK(mock_field_calls == field_calls);
+    }
+
+    // A GPU without NVLink answers every link with not supported
+    mockNvmlReset();
+    mock_nvml.gpu_count = 1;
+    mock_nvml.nvlink_count = 0;
+    CHECK(resetCollector());
+    sampleFieldMetrics(0, due);
+    CHECK(!device_handles[0].power_field_unsupported);
+    CHECK(device_handles[0].nvlink_field_unsupported);
+}
+
+// Readers re-check the snapshot before every access and follow a collector that
+// re-sized or re-created it, instead of faulting on the stale mapping
+static void testSharedSnapshotRemap(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/collector-test-%d", (int)getpid());
+    CHECK(openSharedSnapshot(name));
+    static MetricsConfig config;
+    config.enabled = METRIC_BIT(GPU_METRIC_GPU_TEMP);
+    static MetricsSnapshot snapshot;
+    snapshot.generation = 1;
+    snapshot.device_count = 1;
+    writeSharedSnapshot(&snapshot, &config);
+
+    GpuSnapshotMapping mapping;
+    static GpuSnapshot copy;
+    CHECK(gpuSnapshotMap(&mapping, name));
+    CHECK(gpuSnapshotRead(&mapping, &copy) && copy.device_count == 1);
+    uint64_t generation = gpuSnapshotGeneration(&mapping);
+    CHECK(generation > 0);
+
+    // A collector of another version shrinks the object and writes its own header
+    int fd = shm_open(name, O_RDWR, 0);
+    CHECK(fd >= 0 && ftruncate(fd, 4096) == 0);
+    CHECK(gpuSnapshotGeneration(&mapping) == 0);
+    CHECK(!gpuSnapshotRead(&mapping, &copy));
+    CHECK(ftruncate(fd, sizeof(GpuSnapshot)) == 0);
+    uint32_t version = GPU_SNAPSHOT_VERSION + 1;
+    CHECK(pwrite(fd, &version, sizeof(version), offsetof(GpuSnapshot, version)) == sizeof(version));
+    CHECK(gpuSnapshotGeneration(&mapping) == 0);
+    CHECK(!gpuSnapshotRead(&mapping, &copy));
+
+    // This version's collector is back, in a re-created object
+    munmap(shared_snapshot, sizeof(GpuSnapshot));
+    close(fd);
+    shm_unlink(name);
+    CHECK(openSharedSnapshot(name));
+    snapshot.device_count = 2;
+    writeSharedSnapshot(&snapshot, &config);
+    CHECK(gpuSnapshotGeneration(&mapping) > 0);
+    CHECK(gpuSnapshotRead(&mapping, &copy) && copy.device_count == 2);
+
+    gpuSnapshotUnmap(&mapping);
+    munmap(shared_snapshot, sizeof(GpuSnapshot));
+    shared_snapshot = NULL;
+    shm_unlink(name);
+}
+
+// Without sysfs AER counters the syslog is counted: the rotated log and the open one are
+// backfilled on their own thread, GPU_AER_TOTAL_ERRORS is left out until that finished,
+// and the tracker then follows the log from where the backfill stopped
+static void testAerBackfillThread(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 2;
+    CHECK(resetCollector());
+    const char *gpu1 = "host kernel: pcieport 0000:00:01.0: AER: Corrected error received: 0000:01:00.0\n";
+    const char *gpu2 = "host kernel: pcieport 0000:00:01.0: AER: Corrected error received: 0000:02:00.0\n";
+    const char *other = "host systemd[1]: Started Session 1 of user root.\n";
+    char rotated[1024];
+    char current[1024];
+    snprintf(rotated, sizeof(rotated), "%s%s%s%s%s", gpu1, other, gpu1, gpu2, gpu1);
+    snprintf(current, sizeof(current), "%s%s%s", other, gpu1, gpu1);
+    writeFile("aer-syslog.1", rotated, strlen(rotated));
+    writeFile("aer-syslog", current, strlen(current));
+    syslog_path = "aer-syslog";
+    sysfs_root = "no-sysfs";
+
+    uint32_t due = METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS);
+    sampleAerCounters(0, due);
+    CHECK(devices[0].aer_total_pending);
+    CHECK(unsupportedMetrics(&devices[0], 0) & due);
+
+    for (unsigned int waited = 0; atomic_load(&aer_backfill_state) != AER_BACKFILL_DONE && waited < 5000; waited += 10) {
+        usleep(10000);
+    }
+    CHECK(atomic_load(&aer_backfill_state) == AER_BACKFILL_DONE);
+    snapshot_generation++;
+    sampleAerCounters(0, due);
+    sampleAerCounters(1, due);
+    CHECK(!devices[0].aer_total_pending && devices[0].aer_total_errors == 5);
+    CHECK(!devices[1].aer_total_pending && devices[1].aer_total_errors == 1);
+    CHECK(!(unsupportedMetrics(&devices[0], 0) & due));
+
+    // Appended after the backfill, counted once by the tracker
+    FILE *log = fopen("aer-syslog", "a");
+    CHECK(log != NULL);
+    fputs(gpu2, log);
+    fclose(log);
+    snapshot_generation++;
+    sampleAerCounters(1, due);
+    sampleAerCounters(0, due);
+    CHECK(devices[1].aer_total_errors == 2);
+    CHECK(devices[0].aer_total_errors == 5);
+
+    syslog_path = SYSLOG_PATH;
+    sysfs_root = "/sys";
+}
+
+// aer_dev_* file with one counter per error type and the total the collector reads
+static void writeAerFile(const char *dir, const char *name, const char *total_name, unsigned int total) {
+    char path[256];
+    char text[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int length = snprintf(text, sizeof(text), "RxErr 0\nBadTLP %u\nBadDLLP 0\n%s %u\n", total, total_name, total);
+    writeFile(path, text, (size_t)length);
+}
+
+static void writeAerFiles(const char *dir, unsigned int correctable, unsigned int nonfatal, unsigned int fatal) {
+    writeAerFile(dir, "aer_dev_correctable", "TOTAL_ERR_COR", correctable);
+    writeAerFile(dir, "aer_dev_nonfatal", "TOTAL_ERR_NONFATAL", nonfatal);
+    writeAerFile(dir, "aer_dev_fatal", "TOTAL_ERR_FATAL", fatal);
+}
+
+// A fake sysfs tree: GPU 0 behind root port 0000:00:01.0, both with aer_dev_* files, and
+// GPU 1 directly below the host bridge with its aer_dev_fatal file missing. Counters are
+// re-read through the open files, and reopened when the device identity changes.
+static void testAerSysfsCounters(void) {
+    mkdir("sysfs", 0755);
+    mkdir("sysfs/devices", 0755);
+    mkdir("sysfs/devices/pci0000:00", 0755);
+    mkdir("sysfs/devices/pci0000:00/0000:00:01.0", 0755);
+    mkdir("sysfs/devices/pci0000:00/0000:00:01.0/0000:01:00.0", 0755);
+    mkdir("sysfs/devices/pci0000:00/0000:02:00.0", 0755);
+    mkdir("sysfs/bus", 0755);
+    mkdir("sysfs/bus/pci", 0755);
+    mkdir("sysfs/bus/pci/devices", 0755);
+    CHECK(symlink("../../../devices/pci0000:00/0000:00:01.0", "sysfs/bus/pci/devices/0000:00:01.0") == 0);
+    CHECK(symlink("../../../devices/pci0000:00/0000:00:01.0/0000:01:00.0", "sysfs/bus/pci/devices/0000:01:00.0") == 0);
+    CHECK(symlink("../../../devices/pci0000:00/0000:02:00.0", "sysfs/bus/pci/devices/0000:02:00.0") == 0);
+    const char *gpu0 = "sysfs/devices/pci0000:00/0000:00:01.0/0000:01:00.0";
+    const char *port0 = "sysfs/devices/pci0000:00/0000:00:01.0";
+    const char *gpu1 = "sysfs/devices/pci0000:00/0000:02:00.0";
+    writeAerFiles(gpu0, 4, 2, 1);
+    writeAerFiles(port0, 9, 0, 0);
+    writeAerFile(gpu1, "aer_dev_correctable", "TOTAL_ERR_COR", 3);
+    writeAerFile(gpu1, "aer_dev_nonfatal", "TOTAL_ERR_NONFATAL", 0);
+
+    mockNvmlReset();
+    mock_nvml.gpu_count = 2;
+    sysfs_root = "sysfs";
+    CHECK(resetCollector());
+
+    char port[32] = "";
+    CHECK(upstreamPortBusId("0000:01:00.0", port, sizeof(port)) && strcmp(port, "0000:00:01.0") == 0);
+    CHECK(!upstreamPortBusId("0000:02:00.0", port, sizeof(port)));
+    CHECK(!upstreamPortBusId("0000:03:00.0", port, sizeof(port)));
+
+    uint32_t due = METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS) | METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS);
+    sampleAerCounters(0, due);
+    const GpuAerCounters *counters = &devices[0].aer_dev;
+    CHECK(counters->ports == ((1u << GPU_AER_PORT_DEVICE) | (1u << GPU_AER_PORT_UPSTREAM)));
+    CHECK(counters->errors[GPU_AER_PORT_DEVICE][GPU_AER_CORRECTABLE] == 4);
+    CHECK(counters->errors[GPU_AER_PORT_DEVICE][GPU_AER_NONFATAL] == 2);
+    CHECK(counters->errors[GPU_AER_PORT_DEVICE][GPU_AER_FATAL] == 1);
+    CHECK(counters->errors[GPU_AER_PORT_UPSTREAM][GPU_AER_CORRECTABLE] == 9);
+    CHECK(devices[0].aer_total_errors == 7 && !devices[0].aer_total_pending);
+    CHECK(!(unsupportedMetrics(&devices[0], 0) & due));
+
+    // Incomplete counters and no upstream port: the sysfs family is left out for the GPU
+    sampleAerCounters(1, METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    CHECK(devices[1].aer_dev.ports == 0);
+    CHECK(unsupportedMetrics(&devices[1], 1) & METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+
+    // Rewritten in place, re-read through the file opened before
+    int fd_before = aer_sysfs[0].fds[GPU_AER_PORT_DEVICE][GPU_AER_CORRECTABLE];
+    writeAerFile(gpu0, "aer_dev_correctable", "TOTAL_ERR_COR", 6);
+    sampleAerCounters(0, due);
+    CHECK(aer_sysfs[0].fds[GPU_AER_PORT_DEVICE][GPU_AER_CORRECTABLE] == fd_before);
+    CHECK(devices[0].aer_dev.errors[GPU_AER_PORT_DEVICE][GPU_AER_CORRECTABLE] == 6);
+    CHECK(devices[0].aer_total_errors == 9);
+
+    // The missing file appears with a new device identity, after a handle cache rebuild
+    writeAerFile(gpu1, "aer_dev_fatal", "TOTAL_ERR_FATAL", 0);
+    sampleAerCounters(1, METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    CHECK(devices[1].aer_dev.ports == 0);
+    CHECK(resetCollector());
+    sampleAerCounters(1, METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    CHECK(devices[1].aer_dev.ports == 1u << GPU_AER_PORT_DEVICE);
+    CHECK(devices[1].aer_dev.errors[GPU_AER_PORT_DEVICE][GPU_AER_CORRECTABLE] == 3);
+
+    sysfs_root = "/sys";
+}
+
+// Hotplug: the classifier's bus list follows the handle cache. Buses still present keep their
+// slot and counters, slots of removed GPUs are cleared and reused, so swapping in more than
+// MAX_DEVICES different GPUs over time still classifies every current one.
+static void testLogBusRebuild(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    CHECK(resetCollector());
+    addGpuLogBuses();
+    int bus2 = logBusIndex("0000:02:00.0");
+    int bus4 = logBusIndex("0000:04:00.0");
+    CHECK(bus2 >= 0 && bus4 >= 0);
+    pthread_mutex_lock(&aer_log_lock);
+    aer_log.counts[bus2] = 7;
+    aer_log.counts[bus4] = 5;
+    pthread_mutex_unlock(&aer_log_lock);
+
+    // GPUs 3 and 4 removed
+    mock_nvml.gpu_count = 2;
+    CHECK(resetCollector());
+    CHECK(logBusIndex("0000:02:00.0") == bus2 && aer_log.counts[bus2] == 7);
+    CHECK(findLogBus("0000:04:00.0") < 0 && aer_log.counts[bus4] == 0);
+    const char *gone = "kernel: pcieport 0000:00:01.0: AER: Corrected error received: 0000:04:00.0";
+    CHECK(classifyLogLine(gone, strlen(gone), NULL).buses == 0);
+
+    // A different set of 32 GPUs, every one of them gets a bus
+    mock_nvml.gpu_count = MAX_DEVICES;
+    mock_nvml.first_bus = 0x40;
+    CHECK(resetCollector());
+    unsigned int known = 0;
+    for (unsigned int i = 0; i < MAX_DEVICES; i++) {
+        char bus_id[20];
+        snprintf(bus_id, sizeof(bus_id), "0000:%02x:00.0", 0x40 + i);
+        int bus = findLogBus(bus_id);
+        known += bus >= 0;
+        char line[128];
+        snprintf(line, sizeof(line), "kernel: pcieport 0000:00:01.0: AER: Corrected error received: %s", bus_id);
+        CHECK(bus >= 0 && classifyLogLine(line, strlen(line), NULL).buses == 1u << bus);
+    }
+    CHECK(known == MAX_DEVICES);
+    CHECK(findLogBus("0000:02:00.0") < 0 && aer_log.counts[bus2] == 0);
+}
+
+// Strict check of the text exposition format: every family starts with one HELP and one TYPE,
+// any samples follow contiguously under the same name with the same label names, no family or
+// series repeats, and label values and sample values parse. Returns the number of violations.
+#define EXPOSITION_MAX_FAMILIES 256
+#define EXPOSITION_MAX_SERIES 8192
+
+static bool isMetricNameStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':';
+}
+
+static bool isMetricNameChar(char c) {
+    return isMetricNameStart(c) || (c >= '0' && c <= '9');
+}
+
+static size_t metricNameLength(const char *text) {
+    size_t length = 0;
+    if (!isMetricNameStart(text[0])) {
+        return 0;
+    }
+    while (isMetricNameChar(text[length])) {
+        length++;
+    }
+    return length;
+}
+
+static unsigned int exposition_violations;
+static bool exposition_quiet = false; // Set while feeding the parser deliberately broken text
+
+static void expositionViolation(unsigned int line_number, const char *line, const char *reason) {
+    if (exposition_violations++ < 5 && !exposition_quiet) {
+        fprintf(stderr, "exposition line %u: %s: %.*s\n", line_number, reason, (int)strcspn(line, "\n"), line);
+    }
+}
+
+static unsigned int checkExposition(const char *text, size_t length) {
+    static char families[EXPOSITION_MAX_FAMILIES][128];
+    static char *series[EXPOSITION_MAX_SERIES];
+    unsigned int family_count = 0;
+    unsigned int series_count = 0;
+    char family[128] = "";
+    char label_names[256] = "";
+    int state = 0; // 0 no family, 1 after HELP, 2 after TYPE, 3 after a sample
+    exposition_violations = 0;
+
+    if (length == 0 || text[length - 1] != '\n') {
+        expositionViolation(0, "", "text does not end with a newline");
+    }
+    unsigned int line_number = 0;
+    for (const char *line = text; line < text + length; line = strchr(line, '\n') + 1) {
+        line_number++;
+        size_t line_length = strcspn(line, "\n");
+        char buffer[1024];
+        if (line_length == 0 || line_length >= sizeof(buffer)) {
+            expositionViolation(line_number, line, "empty or overlong line");
+            continue;
+        }
+        memcpy(buffer, line, line_length);
+        buffer[line_length] = '\0';
+
+        if (strncmp(buffer, "# HELP ", 7) == 0) {
+            size_t name_length = metricNameLength(buffer + 7);
+            if (name_length == 0 || name_length >= sizeof(family) || buffer[7 + name_length] != ' ') {
+                expositionViolation(line_number, line, "malformed HELP");
+                continue;
+            }
+            if (state == 1) {
+                expositionViolation(line_number, line, "previous family has no TYPE");
+            }
+            memcpy(family, buffer + 7, name_length);
+            family[name_length] = '\0';
+            for (unsigned int f = 0; f < family_count; f++) {
+                if (strcmp(families[f], family) == 0) {
+                    expositionViolation(line_number, line, "family repeated");
+                }
+            }
+            if (family_count < EXPOSITION_MAX_FAMILIES) {
+                strcpy(families[family_count++], family);
+            }
+            state = 1;
+        } else if (strncmp(buffer, "# TYPE ", 7) == 0) {
+            size_t name_length = metricNameLength(buffer + 7);
+            const char *type = buffer + 7 + name_length + 1;
+            if (state != 1 || name_length != strlen(family) || strncmp(buffer + 7, family, name_length) != 0 ||
+                buffer[7 + name_length] != ' ') {
+                expositionViolation(line_number, line, "TYPE does not follow the HELP of its family");
+            } else if (strcmp(type, "counter") != 0 && strcmp(type, "gauge") != 0 && strcmp(type, "untyped") != 0) {
+                expositionViolation(line_number, line, "unknown TYPE");
+            }
+            state = 2;
+            label_names[0] = '\0';
+        } else if (buffer[0] == '#') {
+            expositionViolation(line_number, line, "unexpected comment");
+        } else {
+            size_t name_length = metricNameLength(buffer);
+            if (state < 2 || name_length != strlen(family) || strncmp(buffer, family, name_length) != 0) {
+                expositionViolation(line_number, line, "sample outside its family");
+                continue;
+            }
+            // Label names of this sample, comma separated, compared against the family's first sample
+            char names[256] = "";
+            const char *cursor = buffer + name_length;
+            bool malformed = false;
+            if (*cursor == '{') {
+                cursor++;
+                while (*cursor != '}' && !malformed) {
+                    size_t label_length = metricNameLength(cursor);
+                    if (label_length == 0 || cursor[label_length] != '=' || cursor[label_length + 1] != '"' ||
+                        strlen(names) + label_length + 2 > sizeof(names)) {
+                        malformed = true;
+                        break;
+                    }
+                    if (names[0] != '\0') {
+                        strcat(names, ",");
+                    }
+                    strncat(names, cursor, label_length);
+                    cursor += label_length + 2;
+                    while (*cursor != '"' && *cursor != '\0') {
+                        if (*cursor == '\\') {
+                            cursor++;
+                            if (*cursor != '\\' && *cursor != '"' && *cursor != 'n') {
+                                malformed = true;
+                                break;
+                            }
+                        }
+                        cursor++;
+                    }
+                    if (malformed || *cursor != '"') {
+                        malformed = true;
+                        break;
+                    }
+                    cursor++;
+                    if (*cursor == ',') {
+                        cursor++;
+                    } else if (*cursor != '}') {
+                        malformed = true;
+                    }
+                }
+                cursor++;
+            }
+            char *end = NULL;
+            if (!malformed && *cursor == ' ') {
+                strtod(cursor + 1, &end);
+            }
+            if (malformed || end == NULL || end == cursor + 1 || *end != '\0') {
+                expositionViolation(line_number, line, "malformed sample");
+                continue;
+            }
+            if (state == 2) {
+                strcpy(label_names, names);
+            } else if (strcmp(label_names, names) != 0) {
+                expositionViolation(line_number, line, "label names differ within the family");
+            }
+            state = 3;
+
+            size_t series_length = cursor - buffer;
+            for (unsigned int n = 0; n < series_count; n++) {
+                if (strlen(series[n]) == series_length && strncmp(series[n], buffer, series_length) == 0) {
+                    expositionViolation(line_number, line, "series repeated");
+                }
+            }
+            if (series_count < EXPOSITION_MAX_SERIES) {
+                series[series_count++] = strndup(buffer, series_length);
+            }
+        }
+    }
+    if (state == 1) {
+        expositionViolation(line_number, "", "last family has no TYPE");
+    }
+    for (unsigned int n = 0; n < series_count; n++) {
+        free(series[n]);
+    }
+    return exposition_violations;
+}
+
+// The rendered metrics of 4 GPUs, with every metric enabled, Xid and AER type counters and
+// register aggregates present, pass the strict parser; so do broken texts fail it
+static void testExpositionFormat(void) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    CHECK(resetCollector());
+    uint32_t due = (METRIC_BIT(GPU_METRIC_COUNT) - 1) & ~register_metrics & ~host_metrics & ~kernel_event_metrics;
+    due &= ~(METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS) | METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    DeviceData *slots = beginSnapshot();
+    sampleAllDevices(slots, 4, due, 1000);
+    publishSnapshot(4);
+    readSnapshot(&current_snapshot);
+    current_snapshot.devices[1].kernel_events.xid_counts[79] = 2;
+    current_snapshot.devices[3].kernel_events.xid_counts[13] = 1;
+    current_snapshot.devices[2].kernel_events.aer_type_counts[0] = 5;
+    current_snapshot.devices[0].aer_dev.ports = 1u << GPU_AER_PORT_DEVICE;
+    current_snapshot.devices[0].aer_dev.errors[GPU_AER_PORT_DEVICE][0] = 3;
+    current_snapshot.devices[2].aer_dev.ports = (1u << GPU_AER_PORT_DEVICE) | (1u << GPU_AER_PORT_UPSTREAM);
+    kmsg_reader_running = true;
+
+    register_sampler_hz = 10;
+    recordTemp(&register_aggregates[0].vram, 60);
+    recordTemp(&register_aggregates[2].hotspot, 75);
+
+    MetricsConfig config;
+    config.enabled = METRIC_BIT(GPU_METRIC_COUNT) - 1;
+    metrics_file_enabled = false;
+    createMetricFile(&current_snapshot, &config);
+    metrics_file_enabled = true;
+    register_sampler_hz = 0;
+    kmsg_reader_running = false;
+
+    CHECK(metrics_buffer.length > 0);
+    CHECK(checkExposition(metrics_buffer.data, metrics_buffer.length) == 0);
+    CHECK(strstr(metrics_buffer.data, "xid=\"79\"") != NULL);
+    CHECK(strstr(metrics_buffer.data, "_p99{") != NULL);
+
+    exposition_quiet = true;
+
+    // The parser itself rejects what the per-device renderer used to write
+    const char *repeated = "# HELP a A.\n# TYPE a gauge\na{gpu=\"0\"} 1\n# HELP b B.\n# TYPE b gauge\nb 1\n"
+                           "# HELP a A.\n# TYPE a gauge\na{gpu=\"1\"} 1\n";
+    CHECK(checkExposition(repeated, strlen(repeated)) > 0);
+    const char *mixed_labels = "# HELP a A.\n# TYPE a gauge\na{gpu=\"0\",uuid=\"x\"} 1\na{gpu=\"1\"} 1\n";
+    CHECK(checkExposition(mixed_labels, strlen(mixed_labels)) > 0);
+    const char *wrong_name = "# HELP a A.\n# TYPE a gauge\nb 1\n";
+    CHECK(checkExposition(wrong_name, strlen(wrong_name)) > 0);
+    const char *no_type = "# HELP a A.\na 1\n";
+    CHECK(checkExposition(no_type, strlen(no_type)) > 0);
+    const char *header_only = "# HELP a A.\n# TYPE a counter\n# HELP b B.\n# TYPE b gauge\nb 1\n";
+    CHECK(checkExposition(header_only, strlen(header_only)) == 0);
+    const char *duplicate = "# HELP a A.\n# TYPE a gauge\na{gpu=\"0\"} 1\na{gpu=\"0\"} 2\n";
+    CHECK(checkExposition(duplicate, strlen(duplicate)) > 0);
+    const char *bad_value = "# HELP a A.\n# TYPE a gauge\na{gpu=\"0\"} one\n";
+    CHECK(checkExposition(bad_value, strlen(bad_value)) > 0);
+    exposition_quiet = false;
+}
+
+int main(void) {
+    if (mkdtemp(fixture_dir) == NULL || chdir(fixture_dir) != 0) {
+        fprintf(stderr, "Failed to create the fixture directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    testFileRegisterBackend();
+    testMissingGpuRescanBackoff();
+    testHungGpuPublishedStale();
+    testRebuildWaitsForHungWorker();
+    testRescanWaitsForHungWorker();
+    testScheduleDeadlines();
+    testFieldValueErrors();
+    testSharedSnapshotRemap();
+    testAerBackfillThread();
+    testAerSysfsCounters();
+    testLogBusRebuild();
+    testExpositionFormat();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    if (failures == 0) {
+        char command[64];
+        snprintf(command, sizeof(command), "rm -rf %s", fixture_dir);
+        if (system(command) != 0) {
+            fprintf(stderr, "Failed to remove %s\n", fixture_dir);
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,62 @@
+// Tests of metrics_exporter.cpp, built against the collector and the NVML mock by make check.
+// The exporter is included whole so tests can reach its renderer.
+int exporter_main(int argc, char* argv[]);
+#define main exporter_main
+#include "../metrics_exporter.cpp"
+#undef main
+
+extern "C" bool renderCollectorFixture(const char *shm_name, const char **text, size_t *length);
+
+static unsigned int checks = 0;
+static unsigned int failures = 0;
+
+#define CHECK(condition) do { \
+    checks++; \
+    if (!(condition)) { \
+        failures++; \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #condition); \
+    } \
+} while (0)
+
+// --shm renders the same exposition text the collector wrote in the cycle it published
+static void testSnapshotMatchesCollector() {
+    char name[64];
+    snprintf(name, sizeof(name), "/exporter-test-%d", (int)getpid());
+    const char *text = NULL;
+    size_t length = 0;
+    CHECK(renderCollectorFixture(name, &text, &length));
+
+    GpuSnapshotMapping mapping;
+    static GpuSnapshot snapshot;
+    CHECK(gpuSnapshotMap(&mapping, name) && gpuSnapshotRead(&mapping, &snapshot));
+    gpuSnapshotUnmap(&mapping);
+    shm_unlink(name);
+    if (failures > 0) {
+        return;
+    }
+
+    std::string expected(text, length);
+    std::string rendered = renderSnapshot(snapshot);
+    CHECK(rendered == expected);
+    CHECK(expected.find("collector_device_stale{gpu=\"3\"} 1\n") != std::string::npos);
+
+    // Point at the first line that differs
+    if (rendered != expected) {
+        size_t i = 0;
+        while (i < rendered.size() && i < expected.size() && rendered[i] == expected[i]) {
+            i++;
+        }
+        size_t line_start = expected.rfind('\n', i == 0 ? 0 : i - 1);
+        line_start = line_start == std::string::npos || i == 0 ? 0 : line_start + 1;
+        fprintf(stderr, "collector: %s\nexporter:  %s\n",
+                expected.substr(line_start, expected.find('\n', line_start) - line_start).c_str(),
+                rendered.substr(line_start, rendered.find('\n', line_start) - line_start).c_str());
+    }
+}
+
+int main() {
+    testSnapshotMatchesCollector();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pci/pci.h>
+#include "mock_nvml.h"
+
+#define MOCK_NVIDIA_VENDOR 0x10de
+#define MOCK_GPU_DEVICE 0x2204
+
+MockNvml mock_nvml;
+atomic_ulong mock_nvml_calls;
+atomic_ulong mock_field_calls;
+atomic_ulong mock_pci_scans;
+bool mock_configured = false;
+
+// Functions of the last scan, owned by the pci_access that scanned them
+// Each scan owns its functions, like libpci, so an old scan can outlive the next one
+typedef struct {
+    struct pci_access access;
+    struct pci_dev *pool;
+} MockPciAccess;
+
+unsigned int mockEnv(const char *name, unsigned int fallback);
+void mockCall(nvmlDevice_t device);
+unsigned int mockIndex(nvmlDevice_t device);
+
+unsigned int mockEnv(const char *name, unsigned int fallback) {
+    const char *value = getenv(name);
+    return value != NULL ? (unsigned int)strtoul(value, NULL, 10) : fallback;
+}
+
+void mockNvmlReset(void) {
+    memset(&mock_nvml, 0, sizeof(mock_nvml));
+    mock_nvml.gpu_count = mockEnv("MOCK_GPUS", 2);
+    mock_nvml.first_bus = 1;
+    mock_nvml.pci_functions = mockEnv("MOCK_PCI_FUNCS", 16);
+    mock_nvml.latency_us = mockEnv("MOCK_LATENCY_US", 0);
+    mock_nvml.hang_gpu = getenv("MOCK_HANG_GPU") != NULL ? (int)mockEnv("MOCK_HANG_GPU", 0) : -1;
+    mock_nvml.hang_ms = mockEnv("MOCK_HANG_MS", 0);
+    mock_nvml.hidden_gpu = -1;
+    mock_nvml.nvlink_count = 4;
+    mock_nvml.power_field_supported = true;
+    mock_nvml.field_values_result = NVML_SUCCESS;
+    mock_configured = true;
+}
+
+// Handles are index + 1 so that NULL stays invalid
+unsigned int mockIndex(nvmlDevice_t device) {
+    return (unsigned int)(uintptr_t)device - 1;
+}
+
+// Every call pays the configured latency, calls for the hung GPU the hang
+void mockCall(nvmlDevice_t device) {
+    if (!mock_configured) {
+        mockNvmlReset();
+    }
+    atomic_fetch_add(&mock_nvml_calls, 1);
+    if (device != NULL && mock_nvml.hang_gpu >= 0 && mockIndex(device) == (unsigned int)mock_nvml.hang_gpu) {
+        usleep(mock_nvml.hang_ms * 1000);
+    }
+    if (mock_nvml.latency_us > 0) {
+        usleep(mock_nvml.latency_us);
+    }
+}
+
+nvmlReturn_t nvmlInit(void) {
+    mockCall(NULL);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlShutdown(void) {
+    return NVML_SUCCESS;
+}
+
+const char* nvmlErrorString(nvmlReturn_t result) {
+    static __thread char text[32];
+    snprintf(text, sizeof(text), "mock error %d", (int)result);
+    return text;
+}
+
+nvmlReturn_t nvmlSystemGetDriverVersion(char *version, unsigned int length) {
+    mockCall(NULL);
+    snprintf(version, length, "550.54.14");
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetCount(unsigned int *count) {
+    mockCall(NULL);
+    *count = mock_nvml.gpu_count;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByIndex(unsigned int index, nvmlDevice_t *device) {
+    mockCall(NULL);
+    if (index >= mock_nvml.gpu_count) {
+        return NVML_ERROR_INVALID_ARGUMENT;
+    }
+    *device = (nvmlDevice_t)(uintptr_t)(index + 1);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetName(nvmlDevice_t device, char *name, unsigned int length) {
+    mockCall(device);
+    snprintf(name, length, "NVIDIA Mock %u", mockIndex(device));
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUUID(nvmlDevice_t device, char *uuid, unsigned int length) {
+    mockCall(device);
+    snprintf(uuid, length, "GPU-mock-%04u", mockIndex(device));
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPciInfo(nvmlDevice_t device, nvmlPciInfo_t *pci) {
+    mockCall(device);
+    memset(pci, 0, sizeof(*pci));
+    pci->domain = 0;
+    pci->bus = mockIndex(device) + mock_nvml.first_bus;
+    pci->device = 0;
+    pci->pciDeviceId = (MOCK_GPU_DEVICE << 16) | MOCK_NVIDIA_VENDOR;
+    snprintf(pci->busId, sizeof(pci->busId), "00000000:%02X:00.0", pci->bus);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTemperature(nvmlDevice_t device, nvmlTemperatureSensors_t sensor, unsigned int *temp) {
+    (void)sensor;
+    mockCall(device);
+    *temp = 40 + mockIndex(device);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerUsage(nvmlDevice_t device, unsigned int *power) {
+    mockCall(device);
+    *power = 100000 + mockIndex(device) * 1234;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetClockInfo(nvmlDevice_t device, nvmlClockType_t type, unsigned int *clock) {
+    mockCall(device);
+    *clock = type == NVML_CLOCK_SM ? 1800 : 9500;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetFanSpeed(nvmlDevice_t device, unsigned int *speed) {
+    mockCall(device);
+    *speed = 30 + mockIndex(device);
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUtilizationRates(nvmlDevice_t device, nvmlUtilization_t *utilization) {
+    mockCall(device);
+    utilization->gpu = 50;
+    utilization->memory = 20;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMemoryInfo(nvmlDevice_t device, nvmlMemory_t *memory) {
+    mockCall(device);
+    memory->total = 24ULL << 30;
+    memory->used = 4ULL << 30;
+    memory->free = memory->total - memory->used;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetCurrentClocksThrottleReasons(nvmlDevice_t device, unsigned long long *reasons) {
+    mockCall(device);
+    *reasons = nvmlClocksThrottleReasonGpuIdle | nvmlClocksThrottleReasonSwPowerCap;
+    return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetFieldValues(nvmlDevice_t device, int count, nvmlFieldValue_t *values) {
+    mockCall(device);
+    atomic_fetch_add(&mock_field_calls, 1);
+    if (mock_nvml.field_values_failures > 0) {
+        mock_nvml.field_values_failures--;
+        return mock_nvml.field_values_result;
+    }
+    for (int v = 0; v < count; v++) {
+        values[v].nvmlReturn = NVML_ERROR_NOT_SUPPORTED;
+        switch (values[v].fieldId) {
+#ifdef NVML_FI_DEV_POWER_INSTANT
+            case NVML_FI_DEV_POWER_INSTANT:
+                if (mock_nvml.power_field_supported) {
+                    values[v].nvmlReturn = NVML_SUCCESS;
+                    values[v].valueType = NVML_VALUE_TYPE_UNSIGNED_INT;
+                    values[v].value.uiVal = 100000 + mockIndex(device) * 1234;
+                }
+                break;
+#endif
+#ifdef NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX
+            case NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX:
+            case NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX:
+                if (values[v].scopeId < mock_nvml.nvlink_count) {
+                    values[v].nvmlReturn = NVML_SUCCESS;
+                    values[v].valueType = NVML_VALUE_TYPE_UNSIGNED_LONG_LONG;
+                    values[v].value.ullVal = 1000;
+                }
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+    return NVML_SUCCESS;
+}
+
+struct pci_access* pci_alloc(void) {
+    if (!mock_configured) {
+        mockNvmlReset();
+    }
+    MockPciAccess *mock = calloc(1, sizeof(MockPciAccess));
+    return mock != NULL ? &mock->access : NULL;
+}
+
+void pci_init(struct pci_access *access) {
+    (void)access;
+}
+
+// The GPUs at 0000:<i + first_bus>:00.0 first, then other vendors' functions spread over
+// further domains, buses and functions up to pci_functions in total
+void pci_scan_bus(struct pci_access *access) {
+    atomic_fetch_add(&mock_pci_scans, 1);
+    unsigned int count = mock_nvml.pci_functions > mock_nvml.gpu_count ? mock_nvml.pci_functions : mock_nvml.gpu_count;
+    MockPciAccess *mock = (MockPciAccess *)access;
+    free(mock->pool);
+    mock->pool = calloc(count, sizeof(*mock->pool));
+    if (mock->pool == NULL) {
+        return;
+    }
+    struct pci_dev *last = NULL;
+    for (unsigned int i = 0; i < count; i++) {
+        struct pci_dev *dev = &mock->pool[i];
+        if (i < mock_nvml.gpu_count) {
+            if ((int)i == mock_nvml.hidden_gpu) {
+                continue;
+            }
+            dev->bus = i + mock_nvml.first_bus;
+            dev->vendor_id = MOCK_NVIDIA_VENDOR;
+            dev->device_id = MOCK_GPU_DEVICE;
+            dev->base_addr[0] = 0xf0000000ULL + ((pciaddr_t)i << 24);
+        } else {
+            unsigned int other = i - mock_nvml.gpu_count;
+            dev->domain = 1 + other / 2048;
+            dev->bus = (other / 8) % 256;
+            dev->dev = other % 8;
+            dev->func = (other / 8 / 256) % 8;
+            dev->vendor_id = 0x8086;
+            dev->device_id = 0x1234;
+        }
+        // libpci lists the most recently found function first
+        dev->next = last;
+        last = dev;
+    }
+    access->devices = last;
+}
+
+int pci_fill_info(struct pci_dev *dev, int flags) {
+    (void)dev;
+    return flags;
+}
+
+void pci_cleanup(struct pci_access *access) {
+    MockPciAccess *mock = (MockPciAccess *)access;
+    free(mock->pool);
+    free(mock);
+}
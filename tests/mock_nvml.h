@@ -0,0 +1,34 @@
+#ifndef MOCK_NVML_H
+#define MOCK_NVML_H
+
+// Stand-in for the NVML and libpci calls nvml_direct_access makes, so the collector
+// can be tested and benchmarked without a GPU or driver. Tests set the knobs below
+// directly, the mock-linked collector binary reads them from MOCK_* variables.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <nvml.h>
+
+typedef struct {
+    unsigned int gpu_count;       // MOCK_GPUS, GPU i sits at PCI bus i + first_bus
+    unsigned int first_bus;       // 1 by default, moved to stand in for GPUs swapped by a hotplug
+    unsigned int pci_functions;   // MOCK_PCI_FUNCS, functions on the bus including the GPUs
+    unsigned int latency_us;      // MOCK_LATENCY_US, added to every NVML call
+    int hang_gpu;                 // MOCK_HANG_GPU, -1 for none: every call for this GPU takes hang_ms
+    unsigned int hang_ms;         // MOCK_HANG_MS
+    int hidden_gpu;               // GPU left out of the PCI scan, -1 for none
+    unsigned int nvlink_count;    // Links that report throughput, 0 for a GPU without NVLink
+    bool power_field_supported;   // Whether NVML_FI_DEV_POWER_INSTANT answers
+    nvmlReturn_t field_values_result; // Returned by nvmlDeviceGetFieldValues while failures remain
+    unsigned int field_values_failures;
+} MockNvml;
+
+extern MockNvml mock_nvml;
+extern atomic_ulong mock_nvml_calls;   // Every NVML call
+extern atomic_ulong mock_field_calls;  // nvmlDeviceGetFieldValues calls
+extern atomic_ulong mock_pci_scans;    // pci_scan_bus calls
+
+// Defaults, then whatever the MOCK_* environment variables override
+void mockNvmlReset(void);
+
+#endif
@@ -0,0 +1,50 @@
+// The collector's side of exporter_test: renders 4 mock GPUs into its exposition
+// buffer and the shared snapshot in the same cycle, like createMetricFile does.
+int collector_main(int argc, char* argv[]);
+#define main collector_main
+#include "../nvml_direct_access.c"
+#undef main
+
+#include "mock_nvml.h"
+
+bool renderCollectorFixture(const char *shm_name, const char **text, size_t *length);
+
+// Every metric enabled, one GPU stale, with Xid, AER and register aggregate samples present
+bool renderCollectorFixture(const char *shm_name, const char **text, size_t *length) {
+    mockNvmlReset();
+    mock_nvml.gpu_count = 4;
+    if (!rebuildDeviceHandleCache() || !refreshPciIndex(0) || !openSharedSnapshot(shm_name)) {
+        return false;
+    }
+    uint32_t due = (METRIC_BIT(GPU_METRIC_COUNT) - 1) & ~register_metrics & ~host_metrics & ~kernel_event_metrics;
+    due &= ~(METRIC_BIT(GPU_METRIC_AER_TOTAL_ERRORS) | METRIC_BIT(GPU_METRIC_AER_DEV_ERRORS));
+    DeviceData *slots = beginSnapshot();
+    sampleAllDevices(slots, 4, due, 1000);
+    slots[3].stale = true;
+    publishSnapshot(4);
+    readSnapshot(&current_snapshot);
+    current_snapshot.devices[1].kernel_events.xid_counts[79] = 2;
+    current_snapshot.devices[2].kernel_events.aer_type_counts[0] = 5;
+    current_snapshot.devices[2].kernel_events.counts[GPU_KERNEL_EVENT_AER] = 5;
+    current_snapshot.devices[2].kernel_events.last_seconds[GPU_KERNEL_EVENT_AER] = 1700000000.25;
+    current_snapshot.devices[0].aer_dev.ports = 1u << GPU_AER_PORT_DEVICE;
+    current_snapshot.devices[0].aer_dev.errors[GPU_AER_PORT_DEVICE][0] = 3;
+    current_snapshot.devices[2].aer_dev.ports = (1u << GPU_AER_PORT_DEVICE) | (1u << GPU_AER_PORT_UPSTREAM);
+    current_snapshot.devices[1].aer_total_pending = true;
+    kmsg_reader_running = true;
+    register_sampler_hz = 10;
+    recordTemp(&register_aggregates[0].vram, 60);
+    recordTemp(&register_aggregates[0].vram, 63);
+    recordTemp(&register_aggregates[2].hotspot, 75);
+
+    MetricsConfig config;
+    config.enabled = METRIC_BIT(GPU_METRIC_COUNT) - 1;
+    metrics_file_enabled = false;
+    createMetricFile(&current_snapshot, &config);
+    munmap(shared_snapshot, sizeof(GpuSnapshot));
+    shared_snapshot = NULL;
+
+    *text = metrics_buffer.data;
+    *length = metrics_buffer.length;
+    return !metrics_buffer.failed;
+}
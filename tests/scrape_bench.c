@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+// Scrapes http://127.0.0.1:PORT/metrics COUNT times, one connection per scrape like
+// a fresh Prometheus target, and prints the latency, the body size and, given the
+// server's pid, the server CPU time per scrape. Used by tests/bench_servers.sh.
+//
+// Usage: scrape_bench LABEL PORT COUNT identity|gzip [PID]
+// Exits 1 if a scrape fails, so it also serves to wait for a server to come up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define RESPONSE_MAX (16 * 1024 * 1024)
+
+double monotonicSeconds(void);
+double processCpuSeconds(long pid);
+long scrape(int port, const char *encoding, char *response);
+int compareDoubles(const void *a, const void *b);
+
+double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// utime + stime of a process from /proc/<pid>/stat, -1 if it cannot be read
+double processCpuSeconds(long pid) {
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+
+    // Fields 14 and 15, counted after the parenthesised command name
+    char *field = strrchr(stat, ')');
+    unsigned long long utime = 0;
+    unsigned long long stime = 0;
+    if (field == NULL || sscanf(field + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// One GET /metrics, returns the body length or -1 on failure
+long scrape(int port, const char *encoding, char *response) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    char request[256];
+    int request_length = snprintf(request, sizeof(request),
+                                  "GET /metrics HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\nAccept-Encoding: %s\r\n\r\n", encoding);
+    if (write(fd, request, request_length) != request_length) {
+        close(fd);
+        return -1;
+    }
+
+    size_t length = 0;
+    ssize_t got;
+    while (length < RESPONSE_MAX - 1 && (got = read(fd, response + length, RESPONSE_MAX - 1 - length)) > 0) {
+        length += got;
+    }
+    close(fd);
+    response[length] = '\0';
+
+    char *body = strstr(response, "\r\n\r\n");
+    if (strncmp(response, "HTTP/1.1 200", 12) != 0 || body == NULL) {
+        return -1;
+    }
+    return (long)(response + length - (body + 4));
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s LABEL PORT COUNT identity|gzip [PID]\n", argv[0]);
+        return 2;
+    }
+    const char *label = argv[1];
+    int port = atoi(argv[2]);
+    int count = atoi(argv[3]);
+    const char *encoding = argv[4];
+    long pid = argc > 5 ? atol(argv[5]) : 0;
+
+    char *response = malloc(RESPONSE_MAX);
+    double *latencies = malloc(sizeof(double) * (count > 0 ? count : 1));
+    if (response == NULL || latencies == NULL) {
+        return 2;
+    }
+
+    double cpu_before = pid > 0 ? processCpuSeconds(pid) : -1;
+    long body_length = 0;
+    for (int s = 0; s < count; s++) {
+        double start = monotonicSeconds();
+        body_length = scrape(port, encoding, response);
+        latencies[s] = monotonicSeconds() - start;
+        if (body_length < 0) {
+            return 1;
+        }
+    }
+    double cpu_after = pid > 0 ? processCpuSeconds(pid) : -1;
+    if (count < 10) {
+        return 0; // Only waiting for the server
+    }
+
+    qsort(latencies, count, sizeof(double), compareDoubles);
+    printf("%s, %s: p50 %.3f ms, p99 %.3f ms, %ld bytes", label, encoding,
+           latencies[count / 2] * 1000, latencies[count * 99 / 100] * 1000, body_length);
+    if (cpu_before >= 0 && cpu_after >= 0) {
+        printf(", server CPU %.1f us per scrape", (cpu_after - cpu_before) * 1e6 / count);
+    }
+    printf("\n");
+    return 0;
+}